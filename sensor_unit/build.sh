@@ -1 +1,4 @@
 west build -b nrf52840dk_nrf52840 -- -DCONF_FILE="prj.conf overlay-ot.conf"
+
+# Low power profile (sleepy end device)
+# west build -b nrf52840dk_nrf52840 -- -DCONF_FILE="prj.conf overlay-ot.conf overlay-sed.conf"
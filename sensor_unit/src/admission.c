@@ -0,0 +1,191 @@
+/* admission.c - Per-client rate limiting for the CoAP server */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(admission, LOG_LEVEL_INF);
+
+#include <zephyr/zephyr.h>
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/net/net_ip.h>
+
+#include "common.h"
+
+//--------------------------------------------------------
+// Limiter parameters
+//--------------------------------------------------------
+
+/* Number of clients tracked, the least recently seen one is evicted */
+#ifndef ADMISSION_CLIENTS
+	#define ADMISSION_CLIENTS 8
+#endif
+
+/* Sustained requests per second and burst size of every client */
+#ifndef ADMISSION_CLIENT_RATE
+	#define ADMISSION_CLIENT_RATE 2
+#endif
+
+#ifndef ADMISSION_CLIENT_BURST
+	#define ADMISSION_CLIENT_BURST 8
+#endif
+
+/* Limit of all clients together, bounds the load of the server thread */
+#ifndef ADMISSION_GLOBAL_RATE
+	#define ADMISSION_GLOBAL_RATE 20
+#endif
+
+#ifndef ADMISSION_GLOBAL_BURST
+	#define ADMISSION_GLOBAL_BURST 40
+#endif
+
+/* Retry hint sent while the pending table is full */
+#ifndef ADMISSION_BUSY_MAX_AGE
+	#define ADMISSION_BUSY_MAX_AGE 2
+#endif
+
+/* Tokens are kept in thousandths, so the refill is exact per millisecond */
+#define TOKEN_SCALE 1000U
+
+//--------------------------------------------------------
+// Runtime Variables
+//--------------------------------------------------------
+
+struct token_bucket {
+	uint32_t tokens;
+	uint32_t last_refill;
+};
+
+struct client_entry {
+	struct in6_addr addr;
+	struct token_bucket bucket;
+	bool used;
+};
+
+/* Only touched from the CoAP server thread */
+static struct client_entry clients[ADMISSION_CLIENTS];
+static struct token_bucket global_bucket = {
+	.tokens = ADMISSION_GLOBAL_BURST * TOKEN_SCALE,
+};
+static struct admission_stats stats;
+
+//--------------------------------------------------------
+// Function Implementations
+//--------------------------------------------------------
+
+/* Refills the bucket and takes one token, returns the seconds until the next
+ * token is available if the bucket is empty
+ */
+static uint32_t bucket_take(struct token_bucket *bucket, uint32_t rate,
+			    uint32_t burst, uint32_t now)
+{
+	uint32_t elapsed = now - bucket->last_refill;
+	uint32_t missing;
+
+	bucket->last_refill = now;
+	/* rate tokens per second are rate thousandths per millisecond */
+	if (elapsed >= burst * MSEC_PER_SEC / rate) {
+		bucket->tokens = burst * TOKEN_SCALE;
+	} else {
+		bucket->tokens = MIN(bucket->tokens + elapsed * rate,
+				     burst * TOKEN_SCALE);
+	}
+
+	if (bucket->tokens >= TOKEN_SCALE) {
+		bucket->tokens -= TOKEN_SCALE;
+		return 0;
+	}
+
+	missing = TOKEN_SCALE - bucket->tokens;
+	return MAX(1, DIV_ROUND_UP(missing, rate * MSEC_PER_SEC));
+}
+
+static struct client_entry *client_lookup(const struct in6_addr *addr,
+					  uint32_t now)
+{
+	struct client_entry *oldest = &clients[0];
+
+	for (int i = 0; i < ADMISSION_CLIENTS; i++) {
+		if (!clients[i].used) {
+			oldest = &clients[i];
+			continue;
+		}
+
+		if (net_ipv6_addr_cmp(&clients[i].addr, addr)) {
+			return &clients[i];
+		}
+
+		if (oldest->used &&
+		    now - clients[i].bucket.last_refill >
+		    now - oldest->bucket.last_refill) {
+			oldest = &clients[i];
+		}
+	}
+
+	if (oldest->used) {
+		stats.evicted++;
+	}
+
+	/* A new client starts with a full bucket */
+	oldest->addr = *addr;
+	oldest->bucket.tokens = ADMISSION_CLIENT_BURST * TOKEN_SCALE;
+	oldest->bucket.last_refill = now;
+	oldest->used = true;
+
+	return oldest;
+}
+
+int admission_check(const struct sockaddr *addr, bool saturated,
+		    uint32_t *retry_after)
+{
+	uint32_t now = k_uptime_get_32();
+	struct client_entry *client;
+
+	/* The request needs a pending and none is free before retransmissions
+	 * complete, no tokens are charged for requests that are shed anyway
+	 */
+	if (saturated) {
+		stats.shed_busy++;
+		*retry_after = ADMISSION_BUSY_MAX_AGE;
+		return -EBUSY;
+	}
+
+	if (addr->sa_family != AF_INET6) {
+		return 0;
+	}
+
+	client = client_lookup(&net_sin6(addr)->sin6_addr, now);
+
+	*retry_after = bucket_take(&client->bucket, ADMISSION_CLIENT_RATE,
+				   ADMISSION_CLIENT_BURST, now);
+	if (*retry_after) {
+		stats.shed_client++;
+		return -EAGAIN;
+	}
+
+	*retry_after = bucket_take(&global_bucket, ADMISSION_GLOBAL_RATE,
+				   ADMISSION_GLOBAL_BURST, now);
+	if (*retry_after) {
+		stats.shed_global++;
+		return -EAGAIN;
+	}
+
+	stats.admitted++;
+
+	return 0;
+}
+
+void admission_count_dropped(void)
+{
+	stats.dropped++;
+}
+
+void admission_get_stats(struct admission_stats *admission_stats)
+{
+	*admission_stats = stats;
+}
@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2020 Libre Solar Technologies GmbH
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/adc.h>
+#include <zephyr/sys/ring_buffer.h>
+#include <zephyr/sys/util.h>
+#include <string.h>
+
+#include "common.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(analog, LOG_LEVEL_DBG);
+
+//--------------------------------------------------------
+// Alias definitions
+//--------------------------------------------------------
+
+#if !DT_NODE_EXISTS(DT_PATH(zephyr_user)) || \
+	!DT_NODE_HAS_PROP(DT_PATH(zephyr_user), io_channels)
+#error "No suitable devicetree overlay specified"
+#endif
+
+#define ADC_NODE		DT_PHANDLE(DT_PATH(zephyr_user), io_channels)
+
+/* All channels are read in one sequence, so they have to share the ADC */
+#define ANALOG_SAME_ADC(node_id, prop, idx) \
+	BUILD_ASSERT(DT_SAME_NODE(DT_PHANDLE_BY_IDX(node_id, prop, idx), ADC_NODE), \
+		     "Channels have to use the same ADC.");
+DT_FOREACH_PROP_ELEM(DT_PATH(zephyr_user), io_channels, ANALOG_SAME_ADC)
+
+/* Common settings supported by most ADCs */
+#define ADC_RESOLUTION		12
+#define ADC_GAIN		ADC_GAIN_1
+#define ADC_REFERENCE		ADC_REF_INTERNAL
+#define ADC_ACQUISITION_TIME	ADC_ACQ_TIME_DEFAULT
+
+#ifdef CONFIG_ADC_NRFX_SAADC
+#define ADC_INPUT_POS_OFFSET SAADC_CH_PSELP_PSELP_AnalogInput0
+#else
+#define ADC_INPUT_POS_OFFSET 0
+#endif
+
+/* Every returned sample is the average of 2^ADC_OVERSAMPLING conversions */
+#ifndef ADC_OVERSAMPLING
+	#define ADC_OVERSAMPLING 4
+#endif
+
+#if defined(CONFIG_ADC_NRFX_SAADC) && ANALOG_NUM_CHANNELS > 1
+/* The SAADC only oversamples in single channel mode, average in software */
+#define ADC_HW_OVERSAMPLING	0
+#define ADC_SW_SAMPLINGS	BIT(ADC_OVERSAMPLING)
+#else
+#define ADC_HW_OVERSAMPLING	ADC_OVERSAMPLING
+#define ADC_SW_SAMPLINGS	1
+#endif
+
+/* Number of frames (one sample per channel) kept in continuous mode */
+#ifndef ANALOG_RING_FRAMES
+	#define ANALOG_RING_FRAMES 64
+#endif
+
+/* Extra time on top of two sampling intervals to wait for a stop */
+#ifndef ANALOG_STOP_MARGIN_MS
+	#define ANALOG_STOP_MARGIN_MS 20
+#endif
+
+#define ANALOG_FRAME_SIZE (ANALOG_NUM_CHANNELS * sizeof(int16_t))
+
+//--------------------------------------------------------
+// Static helper functions
+//--------------------------------------------------------
+
+static enum adc_action continuous_sample_done(const struct device *dev,
+					      const struct adc_sequence *sequence,
+					      uint16_t sampling_index);
+
+//--------------------------------------------------------
+// Runtime Variables
+//--------------------------------------------------------
+
+#define ANALOG_CHANNEL_ID(node_id, prop, idx) DT_IO_CHANNELS_INPUT_BY_IDX(node_id, idx),
+static const uint8_t channel_ids[ANALOG_NUM_CHANNELS] = {
+	DT_FOREACH_PROP_ELEM(DT_PATH(zephyr_user), io_channels, ANALOG_CHANNEL_ID)
+};
+
+/* The ADC stores samples in ascending channel order, this maps the
+ * devicetree index to the position within a frame
+ */
+static uint8_t frame_index[ANALOG_NUM_CHANNELS];
+
+static const struct device *dev_adc = DEVICE_DT_GET(ADC_NODE);
+static uint32_t channel_mask;
+static bool initialized;
+
+static int16_t sample_buffer[ADC_SW_SAMPLINGS * ANALOG_NUM_CHANNELS];
+
+static const struct adc_sequence_options sequence_options = {
+	.extra_samplings = ADC_SW_SAMPLINGS - 1,
+};
+
+static struct adc_sequence sequence = {
+	.options     = &sequence_options,
+	.buffer      = sample_buffer,
+	/* buffer size in bytes, not number of samples */
+	.buffer_size = sizeof(sample_buffer),
+	.resolution  = ADC_RESOLUTION,
+	.oversampling = ADC_HW_OVERSAMPLING,
+};
+
+/* Continuous mode: the ADC is triggered by its sequence timer and every frame
+ * is pushed into the ring from the sampling callback
+ */
+static int16_t continuous_frame[ANALOG_NUM_CHANNELS];
+/* Copy of the last complete frame for analog_read(), the ADC writes
+ * continuous_frame while the next sampling runs
+ */
+static int16_t latest_frame[ANALOG_NUM_CHANNELS];
+static struct k_spinlock latest_lock;
+static struct adc_sequence_options continuous_options = {
+	.callback = continuous_sample_done,
+};
+static struct adc_sequence continuous_sequence = {
+	.options     = &continuous_options,
+	.buffer      = continuous_frame,
+	.buffer_size = sizeof(continuous_frame),
+	.resolution  = ADC_RESOLUTION,
+	.oversampling = ADC_HW_OVERSAMPLING,
+};
+
+RING_BUF_DECLARE(frame_ring, ANALOG_RING_FRAMES * ANALOG_FRAME_SIZE);
+static struct k_poll_signal continuous_signal;
+static atomic_t continuous_running;
+static atomic_t continuous_stop;
+static atomic_t frames_dropped;
+
+//--------------------------------------------------------
+// Function Implementations
+//--------------------------------------------------------
+
+int analog_init(void)
+{
+	struct adc_channel_cfg channel_cfg = {
+		.gain = ADC_GAIN,
+		.reference = ADC_REFERENCE,
+		.acquisition_time = ADC_ACQUISITION_TIME,
+		.differential = 0
+	};
+	int ret;
+
+	if (!device_is_ready(dev_adc)) {
+		LOG_ERR("ADC device not found");
+		return -ENODEV;
+	}
+
+	for (int i = 0; i < ANALOG_NUM_CHANNELS; i++) {
+		channel_cfg.channel_id = channel_ids[i];
+#ifdef CONFIG_ADC_CONFIGURABLE_INPUTS
+		channel_cfg.input_positive = ADC_INPUT_POS_OFFSET + channel_ids[i];
+#endif
+		ret = adc_channel_setup(dev_adc, &channel_cfg);
+		if (ret != 0) {
+			LOG_ERR("Setting up ADC channel %d failed with error %d",
+				channel_ids[i], ret);
+			return ret;
+		}
+
+		if (channel_mask & BIT(channel_ids[i])) {
+			LOG_ERR("ADC channel %d configured twice", channel_ids[i]);
+			return -EINVAL;
+		}
+		channel_mask |= BIT(channel_ids[i]);
+	}
+
+	for (int i = 0; i < ANALOG_NUM_CHANNELS; i++) {
+		frame_index[i] = 0;
+		for (int j = 0; j < ANALOG_NUM_CHANNELS; j++) {
+			if (channel_ids[j] < channel_ids[i]) {
+				frame_index[i]++;
+			}
+		}
+	}
+
+	sequence.channels = channel_mask;
+	continuous_sequence.channels = channel_mask;
+	k_poll_signal_init(&continuous_signal);
+	initialized = true;
+
+	LOG_INF("Set up %d ADC channels (mask 0x%x)", ANALOG_NUM_CHANNELS, channel_mask);
+
+	return 0;
+}
+
+int analog_read(int16_t *samples)
+{
+	int err;
+
+	if (!initialized) {
+		return -ENODEV;
+	}
+
+	/* While streaming the ADC is busy, use the most recent frame instead */
+	if (atomic_get(&continuous_running)) {
+		k_spinlock_key_t key = k_spin_lock(&latest_lock);
+
+		for (int i = 0; i < ANALOG_NUM_CHANNELS; i++) {
+			samples[i] = latest_frame[frame_index[i]];
+		}
+		k_spin_unlock(&latest_lock, key);
+		return 0;
+	}
+
+	err = adc_read(dev_adc, &sequence);
+	if (err != 0) {
+		LOG_ERR("ADC reading failed with error %d", err);
+		return err;
+	}
+
+	for (int i = 0; i < ANALOG_NUM_CHANNELS; i++) {
+		int32_t sum = 0;
+
+		for (int s = 0; s < ADC_SW_SAMPLINGS; s++) {
+			sum += sample_buffer[s * ANALOG_NUM_CHANNELS + frame_index[i]];
+		}
+		samples[i] = sum / ADC_SW_SAMPLINGS;
+	}
+
+	return 0;
+}
+
+static enum adc_action continuous_sample_done(const struct device *dev,
+					      const struct adc_sequence *sequence,
+					      uint16_t sampling_index)
+{
+	k_spinlock_key_t key = k_spin_lock(&latest_lock);
+
+	memcpy(latest_frame, continuous_frame, sizeof(latest_frame));
+	k_spin_unlock(&latest_lock, key);
+
+	/* Only complete frames go into the ring */
+	if (ring_buf_space_get(&frame_ring) < ANALOG_FRAME_SIZE) {
+		atomic_inc(&frames_dropped);
+	} else {
+		ring_buf_put(&frame_ring, (uint8_t *)continuous_frame,
+			     ANALOG_FRAME_SIZE);
+	}
+
+	/* The last sampling, so a stop that timed out still ends here */
+	if (atomic_get(&continuous_stop)) {
+		atomic_set(&continuous_running, 0);
+		return ADC_ACTION_FINISH;
+	}
+
+	return ADC_ACTION_REPEAT;
+}
+
+/* Waits for the sequence to raise continuous_signal, which it does once it
+ * has finished. A sequence that has already finished returns at once.
+ */
+static int continuous_wait(void)
+{
+	struct k_poll_event event = K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_SIGNAL,
+							     K_POLL_MODE_NOTIFY_ONLY,
+							     &continuous_signal);
+	uint32_t timeout_ms = 2 * continuous_options.interval_us / USEC_PER_MSEC +
+			      ANALOG_STOP_MARGIN_MS;
+
+	return k_poll(&event, 1, K_MSEC(timeout_ms));
+}
+
+int analog_start_continuous(uint32_t interval_us)
+{
+	int err;
+
+	if (!initialized) {
+		return -ENODEV;
+	}
+
+	if (!atomic_cas(&continuous_running, 0, 1)) {
+		return -EALREADY;
+	}
+
+	/* A stop that timed out leaves the old sequence to finish on its own */
+	if (atomic_get(&continuous_stop) && continuous_wait() != 0) {
+		LOG_ERR("Previous continuous ADC mode did not finish");
+		atomic_set(&continuous_running, 0);
+		return -EBUSY;
+	}
+
+	ring_buf_reset(&frame_ring);
+	atomic_set(&frames_dropped, 0);
+	atomic_set(&continuous_stop, 0);
+	k_poll_signal_reset(&continuous_signal);
+
+	continuous_options.interval_us = interval_us;
+
+	err = adc_read_async(dev_adc, &continuous_sequence, &continuous_signal);
+	if (err != 0) {
+		LOG_ERR("Starting continuous ADC mode failed with error %d", err);
+		atomic_set(&continuous_running, 0);
+		return err;
+	}
+
+	LOG_INF("Continuous ADC mode started, interval %u us", interval_us);
+
+	return 0;
+}
+
+/* Returns -EBUSY if the sequence did not finish within two sampling
+ * intervals. The running state is then cleared by the last sampling.
+ */
+int analog_stop_continuous(void)
+{
+	if (!atomic_get(&continuous_running)) {
+		return 0;
+	}
+
+	atomic_set(&continuous_stop, 1);
+
+	/* Finishes with the next sampling */
+	if (continuous_wait() != 0) {
+		LOG_ERR("Continuous ADC mode did not stop");
+		return -EBUSY;
+	}
+
+	atomic_set(&continuous_running, 0);
+
+	LOG_INF("Continuous ADC mode stopped, %d frames dropped",
+		(int)atomic_get(&frames_dropped));
+
+	return 0;
+}
+
+uint32_t analog_get_frames(int16_t *frames, uint32_t max_frames)
+{
+	int16_t frame[ANALOG_NUM_CHANNELS];
+	uint32_t count = 0;
+
+	while (count < max_frames &&
+	       ring_buf_get(&frame_ring, (uint8_t *)frame,
+			    ANALOG_FRAME_SIZE) == ANALOG_FRAME_SIZE) {
+		for (int i = 0; i < ANALOG_NUM_CHANNELS; i++) {
+			frames[count * ANALOG_NUM_CHANNELS + i] = frame[frame_index[i]];
+		}
+		count++;
+	}
+
+	return count;
+}
+
+uint32_t analog_get_dropped_frames(void)
+{
+	return atomic_get(&frames_dropped);
+}
@@ -11,8 +11,12 @@
 LOG_MODULE_REGISTER(coap, LOG_LEVEL_INF);
 
 #include <zephyr/zephyr.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/random/rand32.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <zephyr/net/socket.h>
 #include <zephyr/net/net_mgmt.h>
@@ -21,20 +25,208 @@ LOG_MODULE_REGISTER(coap, LOG_LEVEL_INF);
 #include <zephyr/net/coap.h>
 #include <zephyr/net/coap_link_format.h>
 #include <zephyr/net/tls_credentials.h>
+#include <zephyr/settings/settings.h>
 
 #include "common.h"
 #include "net_private.h"
 #include "ipv6.h"
 
-#define NUM_OBSERVERS 10
 #define NUM_PENDINGS 10
+/* Longest URI path the router has to resolve */
+#define MAX_PATH_SEGMENTS 8
 static struct coap_pending pendings[NUM_PENDINGS];
 static struct coap_observer observers[NUM_OBSERVERS];
 
+/* Send notifications from pre-encoded headers, set to 0 to build every
+ * notification with coap_packet_init for comparison
+ */
+#ifndef NOTIFY_TEMPLATES
+	#define NOTIFY_TEMPLATES 1
+#endif
+
+/* Header, token, ETag, Observe (fixed 3 byte value), Content-Format,
+ * Max-Age (fixed 2 byte value) and payload marker
+ */
+#define TEMPLATE_MAX_LEN (4 + COAP_TOKEN_MAX_LEN + 5 + 4 + 1 + 3 + 1)
+#define MAX_PAYLOAD_LEN 20
+#define COAP_PAYLOAD_MARKER 0xFF
+
+#define ETAG_LEN 4
+/* Link format body of /.well-known/core, generated once */
+#define WELL_KNOWN_CORE_LEN 768
+/* rt filters of one discovery request, e.g. ?rt=temperature&rt=humidity */
+#define WELL_KNOWN_CORE_MAX_FILTERS 8
+/* Block size 128 bytes, fits into MAX_COAP_MSG_LEN with the header */
+#define WELL_KNOWN_CORE_SZX 3
+/* The resource set never changes at runtime */
+#define WELL_KNOWN_CORE_MAX_AGE 3600
+
+/* Header of the notifications of one observer, encoded once at registration.
+ * Only the message ID, ETag, Observe value and Max-Age are patched per
+ * notification.
+ */
+struct notification_template {
+	uint8_t hdr[TEMPLATE_MAX_LEN];
+	uint8_t hdr_len;
+	uint8_t etag_offset;
+	uint8_t observe_offset;
+	uint8_t max_age_offset;
+	struct coap_pending *pending;
+};
+
+/* Formatted value of every sensor resource, shared by all of its observers */
+struct payload_cache {
+	char data[MAX_PAYLOAD_LEN];
+	uint8_t len;
+	uint8_t etag[ETAG_LEN];
+};
+
+static struct notification_template templates[NUM_OBSERVERS];
+/* Written by the thread taking the samples, read when notifications are sent
+ * or retransmitted from the system work queue
+ */
+static struct payload_cache payloads[COAP_SENSOR_RESOURCE_COUNT];
+static struct k_spinlock payload_lock;
+
+static uint32_t notify_count;
+static uint64_t notify_cycles;
+
+static char well_known_core[WELL_KNOWN_CORE_LEN];
+static uint16_t well_known_core_len;
+static uint8_t well_known_core_etag[ETAG_LEN];
+/* Zone the cached body was encoded with, it is encoded again on a change */
+static int32_t well_known_core_zone = -1;
+/* Links matching the filters of the request being answered */
+static char well_known_core_filtered[WELL_KNOWN_CORE_LEN];
+
+/* RFC 7252 8.2: responses to multicast requests are spread over the Leisure
+ * period, Leisure = S * G / R with S the response size, G the estimated
+ * number of servers in the group and R the data rate they may use
+ */
+#ifndef MCAST_GROUP_SIZE
+	#define MCAST_GROUP_SIZE 8
+#endif
+
+/* Bytes per second, a small share of the 250 kbit/s of 802.15.4 */
+#ifndef MCAST_DATA_RATE
+	#define MCAST_DATA_RATE 1250
+#endif
+
+#define MCAST_DEFAULT_LEISURE_MS 5000
+#define MCAST_DELAYED_RESPONSES 4
+/* Multicast requests remembered to detect retries and duplicates */
+#define MCAST_RECENT_REQUESTS 4
+
+struct delayed_response {
+	uint8_t data[MAX_COAP_MSG_LEN];
+	uint16_t len;
+	struct sockaddr_in6 addr;
+	uint32_t due;
+	bool used;
+};
+
+struct recent_request {
+	struct in6_addr addr;
+	uint16_t id;
+};
+
+/* Only touched from the CoAP server thread, which also sends the delayed
+ * responses when they are due
+ */
+static struct delayed_response delayed_responses[MCAST_DELAYED_RESPONSES];
+static struct recent_request recent_requests[MCAST_RECENT_REQUESTS];
+static uint8_t recent_next;
+static bool request_multicast;
+static struct mcast_stats mcast_stats;
+static uint64_t mcast_delay_sum;
+
+/* Observe values are reserved in blocks, so the sequence only has to be
+ * written to flash once every OBSERVE_AGE_RESERVE notifications
+ */
+#ifndef OBSERVE_AGE_RESERVE
+	#define OBSERVE_AGE_RESERVE 256
+#endif
+
+/* Reservations due in the same sampling cycle are written together */
+#ifndef OBSERVE_AGE_SAVE_DELAY_MS
+	#define OBSERVE_AGE_SAVE_DELAY_MS 1000
+#endif
+
+/* Observer registration as stored in the settings, "coap/obs/<slot>" */
+struct stored_observer {
+	struct sockaddr_in6 addr;
+	uint8_t token[COAP_TOKEN_MAX_LEN];
+	uint8_t tkl;
+	uint8_t resource;
+};
+
+static struct stored_observer stored_observers[NUM_OBSERVERS];
+static uint32_t stored_observers_valid;
+/* Highest Observe value that may have been sent, "coap/age/<resource>" */
+static uint32_t age_reserved[COAP_SENSOR_RESOURCE_COUNT];
+/* Serializes flash writes of the reservation with its update in RAM */
+static K_MUTEX_DEFINE(age_lock);
+BUILD_ASSERT(NUM_OBSERVERS <= 32, "stored_observers_valid is a 32 bit mask");
+
+/* Time stop_coap() waits for the server thread to close its sockets */
+#define SERVER_STOP_TIMEOUT_MS 500
+
+static K_SEM_DEFINE(server_run, 0, 1);
+/* Available while no serve loop runs, start_coap() takes it */
+static K_SEM_DEFINE(server_stopped, 1, 1);
+static atomic_t server_running;
+/* stop_coap() writes to wake_fds[1] to end the poll of the server thread */
+static int wake_fds[2] = { -1, -1 };
+static struct server_stats server_stats;
+static uint32_t server_start_time;
+static bool server_first_request;
+static bool observers_restored;
+/* Samples taken before coap_init() must not advance the Observe sequence
+ * that is restored from flash
+ */
+static atomic_t coap_initialized;
+
+/* Resources changed since the last batch, only used by the low power profile */
+static ATOMIC_DEFINE(deferred_updates, COAP_SENSOR_RESOURCE_COUNT);
+
 static struct k_work_delayable retransmit_work;
 
 static void retransmit_request(struct k_work *work);
 static void schedule_next_retransmission(void);
+static void coap_sends_cancel(void);
+static struct notification_template *template_of_pending(struct coap_pending *pending);
+static void template_release(struct coap_observer *observer);
+static int observers_in_use(void);
+static void release_pending(struct coap_pending *pending);
+static int send_template(struct notification_template *tmpl,
+			 const struct sockaddr *addr);
+static void etag_calculate(const void *data, size_t len, uint8_t *etag);
+static bool etag_matches(struct coap_packet *request, const uint8_t *etag);
+static void well_known_core_build(void);
+static void observer_store(struct coap_observer *observer,
+			   struct coap_resource *resource);
+static void observer_forget(struct coap_observer *observer);
+static void observers_load(void);
+static void observers_restore(void);
+static void observe_age_reserve(int resource_id);
+static void observe_age_save(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(age_save_work, observe_age_save);
+static void resource_send_update(int resource_id);
+static int init_mcast_socket(struct config *cfg);
+static bool mcast_request_seen(struct coap_packet *request,
+			       struct sockaddr *addr, bool multicast);
+static int mcast_defer_response(struct coap_packet *cpkt,
+				const struct sockaddr *addr, socklen_t addr_len);
+static int mcast_send_due_responses(void);
+static int send_error_response(struct coap_packet *request,
+			       const struct sockaddr *addr,
+			       socklen_t addr_len,
+			       uint8_t code, uint32_t max_age);
+static int send_simple_response(struct coap_packet *request,
+				const struct sockaddr *addr,
+				socklen_t addr_len,
+				uint8_t code, uint32_t max_age,
+				const char *payload, uint16_t payload_len);
 static int well_known_core_get(struct coap_resource *resource,
 			       struct coap_packet *request,
 			       struct sockaddr *addr, socklen_t addr_len);
@@ -43,96 +235,83 @@ static int echo_put(struct coap_resource *resource,
 		    struct coap_packet *request,
 		    struct sockaddr *addr, socklen_t addr_len);
 
-static int temperature_get(struct coap_resource *resource,
+static int sensor_get(struct coap_resource *resource,
 		    struct coap_packet *request,
 		    struct sockaddr *addr, socklen_t addr_len);
 
-static void temperature_notify(struct coap_resource *resource,
-		       struct coap_observer *observer);
-
-static int humidity_get(struct coap_resource *resource,
-		    struct coap_packet *request,
-		    struct sockaddr *addr, socklen_t addr_len);
+static int stream_post(struct coap_resource *resource,
+		       struct coap_packet *request,
+		       struct sockaddr *addr, socklen_t addr_len);
 
-static void humidity_notify(struct coap_resource *resource,
-		       struct coap_observer *observer);
+static int stream_delete(struct coap_resource *resource,
+			 struct coap_packet *request,
+			 struct sockaddr *addr, socklen_t addr_len);
 
-static int  air_quality_get(struct coap_resource *resource,
-		    struct coap_packet *request,
-		    struct sockaddr *addr, socklen_t addr_len);
+static int stream_status_get(struct coap_resource *resource,
+			     struct coap_packet *request,
+			     struct sockaddr *addr, socklen_t addr_len);
+static int config_resource_get(struct coap_resource *resource,
+			       struct coap_packet *request,
+			       struct sockaddr *addr, socklen_t addr_len);
+static int config_resource_put(struct coap_resource *resource,
+			       struct coap_packet *request,
+			       struct sockaddr *addr, socklen_t addr_len);
 
-static void  air_quality_notify(struct coap_resource *resource,
+static void sensor_notify(struct coap_resource *resource,
 		       struct coap_observer *observer);
 
-static int air_pressure_get(struct coap_resource *resource,
-		    struct coap_packet *request,
-		    struct sockaddr *addr, socklen_t addr_len);
-
-static void air_pressure_notify(struct coap_resource *resource,
-		       struct coap_observer *observer);
+/* Paths and resource entries are generated from the sensor description in common.h */
+#define SENSOR_RESOURCE_PATH(ID, kind, idx, segments) \
+	static const char * const ID##_##idx##_path[] = { "sensors", __DEBRACKET segments, NULL };
 
-static int presence_get(struct coap_resource *resource,
-		    struct coap_packet *request,
-		    struct sockaddr *addr, socklen_t addr_len);
+SENSOR_RESOURCES(SENSOR_RESOURCE_PATH)
+ 
+static const char * const echo_path[] = { "echo", NULL };
+static const char * const stream_path[] = { "stream", NULL };
+static const char * const config_path[] = { "config", NULL };
 
-static void presence_notify(struct coap_resource *resource,
-		       struct coap_observer *observer);
+#define CFG_RESOURCE_PATH(ID, name, type, def, min, max) \
+	static const char * const cfg_##ID##_path[] = { "config", name, NULL };
 
-static int luminance_get(struct coap_resource *resource,
-		    struct coap_packet *request,
-		    struct sockaddr *addr, socklen_t addr_len);
+CFG_PARAMS(CFG_RESOURCE_PATH)
 
-static void luminance_notify(struct coap_resource *resource,
-		       struct coap_observer *observer);
+#define CFG_RESOURCE_ENTRY(ID, name, type, def, min, max) \
+	[COAP_RESOURCE_CFG_##ID] = { \
+		.path = cfg_##ID##_path, \
+		.get = config_resource_get, \
+		.put = config_resource_put, \
+	},
 
-static const char * const temperature_path[] = {"sensors", "temperature", NULL };
-static const char * const humidity_path[] = {"sensors",  "humidity", NULL };
-static const char * const air_quality_path[] = {"sensors",  "air_quality", NULL };
-static const char * const air_pressure_path[] = {"sensors",  "air_pressure", NULL };
-static const char * const presence_path[] = {"sensors",  "presence", NULL };
-static const char * const luminance_path[] = {"sensors",  "luminance", NULL };
- 
-static const char * const echo_path[] = { "echo", NULL };
+#define SENSOR_RESOURCE_ENTRY(ID, kind, idx, segments) \
+	[COAP_RESOURCE_##ID##_##idx] = { \
+		.path = ID##_##idx##_path, \
+		.get = sensor_get, \
+		.notify = sensor_notify, \
+	},
 
 static struct coap_resource resources[] = {
-	{ .get = well_known_core_get,
-	  .path = COAP_WELL_KNOWN_CORE_PATH,
-	},
-	{
+	SENSOR_RESOURCES(SENSOR_RESOURCE_ENTRY)
+	[COAP_RESOURCE_ECHO] = {
 		.put = echo_put,
 		.path = echo_path,
 	}, 
-	{
-		.path = temperature_path,
-		.get = temperature_get,
-		.notify = temperature_notify,
+	[COAP_RESOURCE_STREAM] = {
+		.get = stream_status_get,
+		.post = stream_post,
+		.del = stream_delete,
+		.path = stream_path,
 	},
-	{
-		.path = humidity_path,
-		.get = humidity_get,
-		.notify = humidity_notify,
-	},
-	{
-		.path = air_quality_path,
-		.get = air_quality_get,
-		.notify = air_quality_notify,
-	},
-	{
-		.path = air_pressure_path,
-		.get = air_pressure_get,
-		.notify = air_pressure_notify,
-	},
-	{
-		.path = presence_path,
-		.get = presence_get,
-		.notify = presence_notify,
+	[COAP_RESOURCE_CONFIG] = {
+		.get = config_resource_get,
+		.put = config_resource_put,
+		.path = config_path,
 	},
-	{
-		.path = luminance_path,
-		.get = luminance_get,
-		.notify = luminance_notify,
+	CFG_PARAMS(CFG_RESOURCE_ENTRY)
+	[COAP_RESOURCE_WELL_KNOWN_CORE] = {
+		.get = well_known_core_get,
+		.path = COAP_WELL_KNOWN_CORE_PATH,
 	},
-	{ }
+	[COAP_RESOURCE_COUNT] = { }
 };
 
 static void coap_server_process_received_packet(uint8_t *data, uint16_t data_len,
@@ -140,6 +319,7 @@ static void coap_server_process_received_packet(uint8_t *data, uint16_t data_len
 				 socklen_t client_addr_len);
 
 static void coap_server_thread(void);
+static void coap_server_serve(void);
 
 K_THREAD_DEFINE(coap_thread_id, STACK_SIZE,
 		coap_server_thread, NULL, NULL, NULL,
@@ -183,7 +363,11 @@ static bool join_coap_multicast_group(void)
 
 	ifaddr->addr_state = NET_ADDR_PREFERRED;
 
-	struct net_if_mcast_addr *if_mcast_addr =	net_if_ipv6_maddr_add (iface, &mcast_addr.sin6_addr);
+	/* Still registered when the server is restarted after a reconnect */
+	struct net_if_mcast_addr *if_mcast_addr = net_if_ipv6_maddr_lookup(&mcast_addr.sin6_addr, &iface);
+	if (if_mcast_addr == NULL) {
+		if_mcast_addr = net_if_ipv6_maddr_add(iface, &mcast_addr.sin6_addr);
+	}
 	
 	if (if_mcast_addr == NULL) {
 		LOG_ERR("Cannot join IPv6 multicast group");
@@ -217,30 +401,124 @@ static int init_coap_proto(struct config *cfg, struct sockaddr *bind_addr,
 	return ret;
 }
 
-void start_coap(void)
+/* Requests to the group address are received on their own socket, so they
+ * can be told apart from unicast requests
+ */
+static int init_mcast_socket(struct config *cfg)
 {
-	join_coap_multicast_group();
+	struct sockaddr_in6 mcast_addr = {
+		.sin6_family = AF_INET6,
+		.sin6_addr = ALL_NODES_LOCAL_COAP_MCAST,
+		.sin6_port = htons(COAP_PORT) };
+	int ret;
+
+	cfg->coap.mcast_sock = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+	if (cfg->coap.mcast_sock < 0) {
+		NET_ERR("Failed to create multicast socket: %d", errno);
+		return -errno;
+	}
+
+	ret = bind(cfg->coap.mcast_sock, (struct sockaddr *)&mcast_addr,
+		   sizeof(mcast_addr));
+	if (ret < 0) {
+		/* Multicast requests then arrive on the unicast socket and are
+		 * answered without Leisure
+		 */
+		LOG_WRN("Failed to bind multicast socket: %d", errno);
+		ret = -errno;
+		(void)close(cfg->coap.mcast_sock);
+		cfg->coap.mcast_sock = -1;
+	}
+
+	return ret;
+}
+
+/* Everything that does not need the network, called once at boot while the
+ * network is still joining
+ */
+void coap_init(void)
+{
+	coap_router_init(resources);
+	well_known_core_build();
 	k_work_init_delayable(&retransmit_work, retransmit_request);
 
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, wake_fds) < 0) {
+		LOG_ERR("Failed to create wake socket pair: %d", errno);
+	}
+
+	observers_load();
+
 #if defined(CONFIG_USERSPACE)
-		k_mem_domain_add_thread(&app_domain, coap_thread_id);
+	k_mem_domain_add_thread(&app_domain, coap_thread_id);
 #endif
 
-		k_thread_name_set(coap_thread_id, "coap");
-		k_thread_start(coap_thread_id);
+	k_thread_name_set(coap_thread_id, "coap");
+	k_thread_start(coap_thread_id);
+
+	atomic_set(&coap_initialized, 1);
 }
 
-void stop_coap(void)
+/* Can be called again after stop_coap(), e.g. when the network reconnects.
+ * Observers and pending notifications are kept across restarts.
+ */
+void start_coap(void)
 {
-	/* Not very graceful way to close a thread, but as we may be blocked
-	 * in recvfrom call it seems to be necessary
+	static bool started;
+
+	if (atomic_get(&server_running)) {
+		return;
+	}
+
+	/* Blocks while the loop of a stop that timed out still closes its
+	 * sockets, two loops must never run at once
 	 */
-	if (IS_ENABLED(CONFIG_NET_IPV6)) {
-		k_thread_abort(coap_thread_id);
-		if (conf.ipv6.coap.sock >= 0) {
-			(void)close(conf.ipv6.coap.sock);
-		}
+	k_sem_take(&server_stopped, K_FOREVER);
+
+	if (started) {
+		server_stats.restarts++;
+	}
+	started = true;
+
+	server_start_time = k_uptime_get_32();
+	server_first_request = true;
+
+	join_coap_multicast_group();
+
+	atomic_set(&server_running, 1);
+	k_sem_give(&server_run);
+}
+
+/* The server thread is woken from poll through the socket pair, closes its
+ * sockets and waits until it is started again
+ */
+void stop_coap(void)
+{
+	char wake = 0;
+
+	if (!atomic_get(&server_running)) {
+		return;
+	}
+
+	coap_sends_cancel();
+
+	if (send(wake_fds[1], &wake, sizeof(wake), 0) < 0) {
+		LOG_ERR("Failed to wake CoAP server: %d", errno);
+		return;
+	}
+
+	/* The loop ends with the wake, nothing may send meanwhile */
+	atomic_set(&server_running, 0);
+
+	if (k_sem_take(&server_stopped, K_MSEC(SERVER_STOP_TIMEOUT_MS)) != 0) {
+		LOG_WRN("CoAP server did not stop in time, restart waits for it");
+		return;
 	}
+	k_sem_give(&server_stopped);
+}
+
+void coap_get_server_stats(struct server_stats *stats)
+{
+	*stats = server_stats;
 }
 
 //--------------------------------------------------------
@@ -248,12 +526,46 @@ void stop_coap(void)
 //--------------------------------------------------------
 
 static void coap_server_thread(void)
+{
+	while (true) {
+		k_sem_take(&server_run, K_FOREVER);
+
+		coap_server_serve();
+
+		/* Also when a socket failed, nothing may send on the sockets
+		 * once they are closed
+		 */
+		atomic_set(&server_running, 0);
+		coap_sends_cancel();
+
+		if (conf.ipv6.coap.sock >= 0) {
+			(void)close(conf.ipv6.coap.sock);
+			conf.ipv6.coap.sock = -1;
+		}
+		if (conf.ipv6.coap.mcast_sock >= 0) {
+			(void)close(conf.ipv6.coap.mcast_sock);
+			conf.ipv6.coap.mcast_sock = -1;
+		}
+
+		/* The receivers may have changed their address meanwhile */
+		memset(delayed_responses, 0, sizeof(delayed_responses));
+
+		k_sem_give(&server_stopped);
+
+		LOG_INF("CoAP server stopped");
+	}
+}
+
+/* Serves requests until stop_coap() is called or a socket fails */
+static void coap_server_serve(void)
 {
 	int ret = 0;
 	int received;
 	struct sockaddr client_addr;
 	socklen_t client_addr_len;
-	client_addr_len = sizeof(client_addr);
+	struct pollfd fds[3];
+	int nfds = 0;
+	char wake[4];
 
 	struct sockaddr_in6 addr6;
 
@@ -267,21 +579,70 @@ static void coap_server_thread(void)
 		return;
 	}
 
+	server_stats.bind_ms = k_uptime_get_32() - server_start_time;
+	boot_mark(BOOT_COAP_BOUND);
+
+	fds[nfds].fd = wake_fds[0];
+	fds[nfds].events = POLLIN;
+	nfds++;
+
+	/* The group socket comes first, so a copy of a multicast request that
+	 * is also delivered to the unicast socket is recognized as duplicate
+	 */
+	if (init_mcast_socket(&conf.ipv6) == 0) {
+		fds[nfds].fd = conf.ipv6.coap.mcast_sock;
+		fds[nfds].events = POLLIN;
+		nfds++;
+	}
+	fds[nfds].fd = conf.ipv6.coap.sock;
+	fds[nfds].events = POLLIN;
+	nfds++;
+
+	/* Notifications can be sent now that the socket is bound */
+	if (!observers_restored) {
+		observers_restore();
+		observers_restored = true;
+	}
+
+	/* Retransmissions were cancelled when the server stopped */
+	schedule_next_retransmission();
+
 	while (ret == 0) {
 		
-		received = recvfrom(conf.ipv6.coap.sock, conf.ipv6.coap.recv_buffer,
-				    sizeof(conf.ipv6.coap.recv_buffer), 0,
-				    &client_addr, &client_addr_len);
-
-		if (received < 0) {
-			LOG_ERR("Connection error %d", errno);
+		ret = poll(fds, nfds, mcast_send_due_responses());
+		if (ret < 0) {
+			LOG_ERR("Poll error %d", errno);
 			quit();
 			return;
 		}
-		LOG_DBG("Received CoAP Packet");
-		coap_server_process_received_packet(conf.ipv6.coap.recv_buffer, received, &client_addr,
-				     client_addr_len);
-		
+		ret = 0;
+
+		if (fds[0].revents & POLLIN) {
+			(void)recv(wake_fds[0], wake, sizeof(wake), 0);
+			return;
+		}
+
+		for (int i = 1; i < nfds; i++) {
+			if (!(fds[i].revents & POLLIN)) {
+				continue;
+			}
+
+			client_addr_len = sizeof(client_addr);
+			received = recvfrom(fds[i].fd, conf.ipv6.coap.recv_buffer,
+					    sizeof(conf.ipv6.coap.recv_buffer), 0,
+					    &client_addr, &client_addr_len);
+
+			if (received < 0) {
+				LOG_ERR("Connection error %d", errno);
+				quit();
+				return;
+			}
+			LOG_DBG("Received CoAP Packet");
+			request_multicast = fds[i].fd == conf.ipv6.coap.mcast_sock;
+			coap_server_process_received_packet(conf.ipv6.coap.recv_buffer, received, &client_addr,
+					     client_addr_len);
+			request_multicast = false;
+		}
 	}
 }
 
@@ -307,12 +668,34 @@ static struct coap_resource *find_resource_by_observer(
 	return NULL;
 }
 
-static void remove_observer(struct sockaddr *addr)
+/* A client may observe several resources, the token tells which one */
+static struct coap_observer *find_observer(const struct sockaddr *addr,
+					   const uint8_t *token, uint8_t tkl)
+{
+	const struct sockaddr_in6 *a = net_sin6(addr);
+
+	for (int i = 0; i < NUM_OBSERVERS; i++) {
+		struct coap_observer *o = &observers[i];
+		const struct sockaddr_in6 *b = net_sin6(&o->addr);
+
+		if (o->addr.sa_family == AF_INET6 && o->tkl == tkl &&
+		    memcmp(o->token, token, tkl) == 0 &&
+		    a->sin6_port == b->sin6_port &&
+		    net_ipv6_addr_cmp(&a->sin6_addr, &b->sin6_addr)) {
+			return o;
+		}
+	}
+
+	return NULL;
+}
+
+static void remove_observer(const struct sockaddr *addr,
+			    const uint8_t *token, uint8_t tkl)
 {
 	struct coap_resource *r;
 	struct coap_observer *o;
 
-	o = coap_find_observer_by_addr(observers, NUM_OBSERVERS, addr);
+	o = find_observer(addr, token, tkl);
 	if (!o) {
 		return;
 	}
@@ -326,14 +709,28 @@ static void remove_observer(struct sockaddr *addr)
 	LOG_INF("Removing observer %p", o);
 
 	coap_remove_observer(r, o);
+	observer_forget(o);
+	template_release(o);
 	memset(o, 0, sizeof(struct coap_observer));
 }
 
+/* The token is taken from the header of the notification that is pending */
+static void remove_observer_of_pending(struct coap_pending *pending)
+{
+	uint8_t tkl = pending->data[0] & 0x0f;
+
+	remove_observer(&pending->addr, &pending->data[4], tkl);
+}
+
 static void retransmit_request(struct k_work *work)
 {
 	struct coap_pending *pending;
 	int r;
 
+	if (!atomic_get(&server_running)) {
+		return;
+	}
+
 	pending = coap_pending_next_to_expire(pendings, NUM_PENDINGS);
 	if (!pending) {
 		return;
@@ -341,9 +738,13 @@ static void retransmit_request(struct k_work *work)
 
 	if (!coap_pending_cycle(pending)) {
 		LOG_ERR("Pending Retransmission timed out");
-		remove_observer(&pending->addr);
-		k_free(pending->data);
-		coap_pending_clear(pending);
+		remove_observer_of_pending(pending);
+		release_pending(pending);
+	} else if (template_of_pending(pending)) {
+		r = send_template(template_of_pending(pending), &pending->addr);
+		if (r < 0) {
+			LOG_ERR("Failed to send %d", -r);
+		}
 	} else {
 		net_hexdump("Retransmit", pending->data, pending->len);
 
@@ -351,6 +752,8 @@ static void retransmit_request(struct k_work *work)
 			   &pending->addr, sizeof(struct sockaddr_in6));
 		if (r < 0) {
 			LOG_ERR("Failed to send %d", errno);
+		} else {
+			power_count_tx(pending->len);
 		}
 	}
 
@@ -363,6 +766,11 @@ static void schedule_next_retransmission(void)
 	int32_t remaining;
 	uint32_t now = k_uptime_get_32();
 
+	/* Rescheduled when the server starts again */
+	if (!atomic_get(&server_running)) {
+		return;
+	}
+
 	/* Get the first pending retransmission to expire after cycling. */
 	pending = coap_pending_next_to_expire(pendings, NUM_PENDINGS);
 	if (!pending) {
@@ -379,6 +787,17 @@ static void schedule_next_retransmission(void)
 }
 
 
+/* Retransmissions and the stream are sent from the system work queue, both
+ * are stopped and waited for before the sockets are closed
+ */
+static void coap_sends_cancel(void)
+{
+	struct k_work_sync sync;
+
+	(void)k_work_cancel_delayable_sync(&retransmit_work, &sync);
+	stream_stop_sync();
+}
+
 static int create_pending_request(struct coap_packet *response,
 				  const struct sockaddr *addr)
 {
@@ -402,6 +821,94 @@ static int create_pending_request(struct coap_packet *response,
 	return 0;
 }
 
+/* Replaces coap_handle_request: the resource is resolved through the router
+ * in O(path length) instead of matching every entry of resources[]
+ */
+static int coap_dispatch_request(struct coap_packet *request,
+				 struct sockaddr *client_addr,
+				 socklen_t client_addr_len)
+{
+	struct coap_option path[MAX_PATH_SEGMENTS];
+	struct coap_resource *resource;
+	coap_method_t method;
+	int num;
+
+	num = coap_find_options(request, COAP_OPTION_URI_PATH, path,
+				MAX_PATH_SEGMENTS);
+	if (num < 0) {
+		return num;
+	}
+
+	resource = coap_router_lookup(path, num);
+	if (!resource) {
+		return -ENOENT;
+	}
+
+	switch (coap_header_get_code(request)) {
+	case COAP_METHOD_GET:
+		method = resource->get;
+		break;
+	case COAP_METHOD_POST:
+		method = resource->post;
+		break;
+	case COAP_METHOD_PUT:
+		method = resource->put;
+		break;
+	case COAP_METHOD_DELETE:
+		method = resource->del;
+		break;
+	default:
+		return -ENOTSUP;
+	}
+
+	if (!method) {
+		return -EPERM;
+	}
+
+	return method(resource, request, client_addr, client_addr_len);
+}
+
+/* Rate limits every client. Observe registrations are also shed while no
+ * notification can be queued, since their notifications are confirmable and
+ * need a pending. Plain requests are answered without one and pass. Shed
+ * confirmable requests are answered with 5.03 and a Max-Age telling the
+ * client when to retry, non-confirmable ones are dropped.
+ */
+static int admit_request(struct coap_packet *request,
+			 struct sockaddr *client_addr,
+			 socklen_t client_addr_len)
+{
+	uint32_t retry_after;
+	bool saturated;
+	int r;
+
+	/* Empty messages (pings) are cheap and not limited */
+	if (coap_header_get_code(request) == COAP_CODE_EMPTY) {
+		return 0;
+	}
+
+	saturated = coap_request_is_observe(request) &&
+		    coap_pending_next_unused(pendings, NUM_PENDINGS) == NULL;
+
+	r = admission_check(client_addr, saturated, &retry_after);
+	if (r == 0) {
+		return 0;
+	}
+
+	LOG_DBG("Request shed (%d), retry after %u s", r, retry_after);
+
+	if (coap_header_get_type(request) != COAP_TYPE_CON) {
+		admission_count_dropped();
+		return r;
+	}
+
+	(void)send_error_response(request, client_addr, client_addr_len,
+				  COAP_RESPONSE_CODE_SERVICE_UNAVAILABLE,
+				  retry_after);
+
+	return r;
+}
+
 static void coap_server_process_received_packet(uint8_t *data, uint16_t data_len,
 				 struct sockaddr *client_addr,
 				 socklen_t client_addr_len)
@@ -423,20 +930,36 @@ static void coap_server_process_received_packet(uint8_t *data, uint16_t data_len
 
 	pending = coap_pending_received(&request, pendings, NUM_PENDINGS);
 	if (!pending) {
-		r = coap_handle_request(&request, resources, options, opt_num,
-					client_addr, client_addr_len);
+		if (mcast_request_seen(&request, client_addr, request_multicast)) {
+			return;
+		}
+
+		r = admit_request(&request, client_addr, client_addr_len);
+		if (r < 0) {
+			return;
+		}
+
+		r = coap_dispatch_request(&request, client_addr, client_addr_len);
+		if (r >= 0 && server_first_request) {
+			boot_mark(BOOT_FIRST_REQUEST);
+			server_first_request = false;
+			server_stats.first_request_ms = k_uptime_get_32() -
+							server_start_time;
+			LOG_INF("First request served %u ms after start",
+				server_stats.first_request_ms);
+		}
 		if (r < 0) {
 			LOG_WRN("No handler for such request (%d)\n", r);
 		}
 	}
 	/* Clear CoAP pending request */
 	else if (type == COAP_TYPE_ACK || type == COAP_TYPE_RESET) {
-		k_free(pending->data);
-		coap_pending_clear(pending);
-
+		/* A Reset carries no token, the rejected notification has it */
 		if (type == COAP_TYPE_RESET) {
-			remove_observer(client_addr);
+			remove_observer_of_pending(pending);
 		}
+
+		release_pending(pending);
 	}
 }
 
@@ -446,32 +969,102 @@ static int send_coap_reply(struct coap_packet *cpkt,
 {
 	int r;
 
+	/* Handlers answer multicast requests like unicast ones, the response
+	 * is deferred here. Notifications sent by other threads are not affected.
+	 */
+	if (request_multicast && k_current_get() == coap_thread_id) {
+		return mcast_defer_response(cpkt, addr, addr_len);
+	}
+
 	net_hexdump("Reply", cpkt->data, cpkt->offset);
 
 	r = sendto(conf.ipv6.coap.sock, cpkt->data, cpkt->offset, 0, addr, addr_len);
 	if (r < 0) {
 		LOG_ERR("Failed to send %d", errno);
 		r = -errno;
+	} else {
+		power_count_tx(cpkt->offset);
 	}
 
 	return r;
 }
 
-static int send_notification_packet(const struct sockaddr *addr,
-				    socklen_t addr_len,
-				    uint16_t age, uint16_t id,
-				    const uint8_t *token, uint8_t tkl,
-				    bool is_response, void* payload, uint8_t payload_length )
+/* Piggybacked error response without payload, Max-Age is omitted if 0 */
+static int send_error_response(struct coap_packet *request,
+			       const struct sockaddr *addr,
+			       socklen_t addr_len,
+			       uint8_t code, uint32_t max_age)
+{
+	return send_simple_response(request, addr, addr_len, code, max_age,
+				    NULL, 0);
+}
+
+/* Piggybacked response with an optional text/plain payload */
+static int send_simple_response(struct coap_packet *request,
+				const struct sockaddr *addr,
+				socklen_t addr_len,
+				uint8_t code, uint32_t max_age,
+				const char *payload, uint16_t payload_len)
 {
 	struct coap_packet response;
-	uint8_t *data;
+	uint8_t token[COAP_TOKEN_MAX_LEN];
+	uint8_t data[MAX_COAP_MSG_LEN];
 	uint8_t type;
+	uint8_t tkl;
 	int r;
 
-	if (is_response) {
-		type = COAP_TYPE_ACK;
-	} else {
-		type = COAP_TYPE_CON;
+	tkl = coap_header_get_token(request, token);
+	type = coap_header_get_type(request) == COAP_TYPE_CON ?
+	       COAP_TYPE_ACK : COAP_TYPE_NON_CON;
+
+	r = coap_packet_init(&response, data, sizeof(data), COAP_VERSION_1,
+			     type, tkl, token, code,
+			     coap_header_get_id(request));
+
+	if (r == 0 && payload) {
+		r = coap_append_option_int(&response, COAP_OPTION_CONTENT_FORMAT,
+					   COAP_CONTENT_FORMAT_TEXT_PLAIN);
+	}
+
+	if (r == 0 && max_age) {
+		r = coap_append_option_int(&response, COAP_OPTION_MAX_AGE,
+					   max_age);
+	}
+
+	if (r == 0 && payload) {
+		r = coap_packet_append_payload_marker(&response);
+		if (r == 0) {
+			r = coap_packet_append_payload(&response,
+						       (uint8_t *)payload,
+						       payload_len);
+		}
+	}
+
+	if (r == 0) {
+		r = send_coap_reply(&response, addr, addr_len);
+	}
+
+	return r;
+}
+
+/* A NULL payload answers with 2.03 Valid, etag is optional */
+static int send_notification_packet(const struct sockaddr *addr,
+				    socklen_t addr_len,
+				    uint16_t age, uint16_t id,
+				    const uint8_t *token, uint8_t tkl,
+				    bool is_response, const uint8_t *etag,
+				    uint16_t max_age,
+				    void* payload, uint8_t payload_length )
+{
+	struct coap_packet response;
+	uint8_t *data;
+	uint8_t type;
+	int r;
+
+	if (is_response) {
+		type = COAP_TYPE_ACK;
+	} else {
+		type = COAP_TYPE_CON;
 	}
 
 	if (!is_response) {
@@ -485,24 +1078,36 @@ static int send_notification_packet(const struct sockaddr *addr,
 
 	r = coap_packet_init(&response, data, MAX_COAP_MSG_LEN,
 			     COAP_VERSION_1, type, tkl, token,
-			     COAP_RESPONSE_CODE_CONTENT, id);
+			     payload ? COAP_RESPONSE_CODE_CONTENT : COAP_RESPONSE_CODE_VALID,
+			     id);
+
+	if (r == 0 && etag) {
+		r = coap_packet_append_option(&response, COAP_OPTION_ETAG,
+					      etag, ETAG_LEN);
+	}
 	
 	if (r == 0 && age >= 2U) {
 		r = coap_append_option_int(&response, COAP_OPTION_OBSERVE, age);
 	}
 
-	if(r == 0)
+	if(r == 0 && payload)
 	{	
 		r = coap_append_option_int(&response, COAP_OPTION_CONTENT_FORMAT,
 					COAP_CONTENT_FORMAT_TEXT_PLAIN);
 	}
 
 	if(r == 0)
+	{
+		r = coap_append_option_int(&response, COAP_OPTION_MAX_AGE,
+					max_age);
+	}
+
+	if(r == 0 && payload)
 	{
 		r = coap_packet_append_payload_marker(&response);
 	}
 
-	if(r == 0)
+	if(r == 0 && payload)
 	{
 		r = coap_packet_append_payload(&response, (uint8_t *)payload, 
 				       payload_length);
@@ -528,331 +1133,754 @@ static int send_notification_packet(const struct sockaddr *addr,
 }
 
 //--------------------------------------------------------
-// Resources
+// Notification templates
 //--------------------------------------------------------
 
-static int well_known_core_get(struct coap_resource *resource,
-			       struct coap_packet *request,
-			       struct sockaddr *addr, socklen_t addr_len)
+static struct notification_template *template_of_pending(struct coap_pending *pending)
 {
-	struct coap_packet response;
-	uint8_t *data;
-	int r;
-
-	data = (uint8_t *)k_malloc(MAX_COAP_MSG_LEN);
-	if (!data) {
-		return -ENOMEM;
+	for (int i = 0; i < NUM_OBSERVERS; i++) {
+		if (pending->data == templates[i].hdr) {
+			return &templates[i];
+		}
 	}
 
-	r = coap_well_known_core_get(resource, request, &response,
-				     data, MAX_COAP_MSG_LEN);
-	if (r == 0) {
-		r = send_coap_reply(&response, addr, addr_len);
-	}
+	return NULL;
+}
 
-	k_free(data);
+static void release_pending(struct coap_pending *pending)
+{
+	struct notification_template *tmpl = template_of_pending(pending);
 
-	return r;
+	if (tmpl) {
+		tmpl->pending = NULL;
+	} else {
+		k_free(pending->data);
+	}
+
+	coap_pending_clear(pending);
 }
 
-static int echo_put(struct coap_resource *resource,
-		    struct coap_packet *request,
-		    struct sockaddr *addr, socklen_t addr_len)
+/* Lowering /config/observers keeps the registered observers, it only
+ * refuses new ones until enough of them are gone
+ */
+static int observers_in_use(void)
 {
-	struct coap_packet response;
-	uint8_t token[COAP_TOKEN_MAX_LEN];
-	const uint8_t *payload;
-	uint8_t *data;
-	uint16_t payload_len;
-	uint8_t code;
-	uint8_t type;
-	uint8_t tkl;
-	uint16_t id;
-	int r;
+	int count = 0;
 
-	code = coap_header_get_code(request);
-	type = coap_header_get_type(request);
-	id = coap_header_get_id(request);
-	tkl = coap_header_get_token(request, token);
+	for (int i = 0; i < NUM_OBSERVERS; i++) {
+		if (observers[i].addr.sa_family != AF_UNSPEC) {
+			count++;
+		}
+	}
 
-	LOG_DBG("*******");
-	LOG_DBG("type: %u code %u id %u", type, code, id);
-	LOG_DBG("*******");
+	return count;
+}
 
-	payload = coap_packet_get_payload(request, &payload_len);
-	if (payload) {
-		net_hexdump("PUT Payload", payload, payload_len);
+/* The slot of a removed observer neither keeps a retransmission running nor
+ * hands its header to the next observer
+ */
+static void template_release(struct coap_observer *observer)
+{
+	struct notification_template *tmpl = &templates[observer - observers];
+
+	if (tmpl->pending) {
+		coap_pending_clear(tmpl->pending);
 	}
 
-	if (type == COAP_TYPE_CON) {
-		type = COAP_TYPE_ACK;
-	} else {
-		type = COAP_TYPE_NON_CON;
+	memset(tmpl, 0, sizeof(*tmpl));
+}
+
+static void payload_get(int resource_id, struct payload_cache *payload)
+{
+	k_spinlock_key_t key = k_spin_lock(&payload_lock);
+
+	*payload = payloads[resource_id];
+	k_spin_unlock(&payload_lock, key);
+}
+
+/* Sensor values are valid until the next sample is taken. The BME680 is only
+ * fetched every gas_every samples and keeps its values in between. The
+ * limits of period_ms and gas_every keep it within the two bytes of the
+ * templates.
+ */
+static uint16_t sensor_max_age(const struct coap_resource *resource)
+{
+	uint32_t period = config_get(CFG_SAMPLE_PERIOD_MS) / MSEC_PER_SEC;
+
+	switch (sensor_resources[resource - resources].kind) {
+	case SENSOR_TEMPERATURE:
+	case SENSOR_HUMIDITY:
+	case SENSOR_AIR_QUALITY:
+	case SENSOR_AIR_PRESSURE:
+		return period * config_get(CFG_GAS_EVERY);
+	default:
+		return period;
 	}
+}
 
-	data = (uint8_t *)k_malloc(MAX_COAP_MSG_LEN);
-	if (!data) {
-		return -ENOMEM;
+static void template_init(struct coap_resource *resource,
+			  struct coap_observer *observer)
+{
+	struct notification_template *tmpl = &templates[observer - observers];
+	uint8_t *p = tmpl->hdr;
+
+	/* Version 1, CON, token length */
+	*p++ = (COAP_VERSION_1 << 6) | (COAP_TYPE_CON << 4) | observer->tkl;
+	*p++ = COAP_RESPONSE_CODE_CONTENT;
+	/* Message ID, patched per notification */
+	*p++ = 0;
+	*p++ = 0;
+	memcpy(p, observer->token, observer->tkl);
+	p += observer->tkl;
+
+	/* ETag: delta 4, length 4, patched per notification */
+	*p++ = (COAP_OPTION_ETAG << 4) | ETAG_LEN;
+	tmpl->etag_offset = p - tmpl->hdr;
+	p += ETAG_LEN;
+
+	/* Observe: delta 2, length 3, the value is always sent with 3 bytes so
+	 * it can be patched in place
+	 */
+	*p++ = ((COAP_OPTION_OBSERVE - COAP_OPTION_ETAG) << 4) | 3;
+	tmpl->observe_offset = p - tmpl->hdr;
+	*p++ = 0;
+	*p++ = 0;
+	*p++ = 0;
+
+	/* Content-Format: delta 6, text/plain is encoded as empty value */
+	*p++ = (COAP_OPTION_CONTENT_FORMAT - COAP_OPTION_OBSERVE) << 4;
+
+	/* Max-Age: delta 2, length 2, follows the sample period */
+	*p++ = ((COAP_OPTION_MAX_AGE - COAP_OPTION_CONTENT_FORMAT) << 4) | 2;
+	tmpl->max_age_offset = p - tmpl->hdr;
+	sys_put_be16(sensor_max_age(resource), p);
+	p += 2;
+
+	*p++ = COAP_PAYLOAD_MARKER;
+
+	tmpl->hdr_len = p - tmpl->hdr;
+}
+
+static int send_template(struct notification_template *tmpl,
+			 const struct sockaddr *addr)
+{
+	struct coap_observer *observer = &observers[tmpl - templates];
+	struct coap_resource *resource = find_resource_by_observer(resources, observer);
+	struct payload_cache payload;
+	struct iovec iov[2];
+	struct msghdr msg = { 0 };
+	int r;
+
+	if (!resource) {
+		return -ENOENT;
 	}
 
-	r = coap_packet_init(&response, data, MAX_COAP_MSG_LEN,
-			     COAP_VERSION_1, type, tkl, token,
-			     COAP_RESPONSE_CODE_CHANGED, id);
-	if (r == 0) {
+	payload_get(resource - resources, &payload);
 
-		r = coap_packet_append_payload_marker(&response);
-		if (r == 0) {
-			r = coap_packet_append_payload(&response, payload, payload_len);
-			if (r == 0) {
-				r = send_coap_reply(&response, addr, addr_len);
-			}
+	iov[0].iov_base = tmpl->hdr;
+	iov[0].iov_len = tmpl->hdr_len;
+	iov[1].iov_base = payload.data;
+	iov[1].iov_len = payload.len;
 
-		}
+	msg.msg_name = (void *)addr;
+	msg.msg_namelen = sizeof(struct sockaddr_in6);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = ARRAY_SIZE(iov);
 
+	r = sendmsg(conf.ipv6.coap.sock, &msg, 0);
+	if (r < 0) {
+		return -errno;
 	}
 
-	k_free(data);
+	power_count_tx(r);
 
 	return r;
 }
 
-static int temperature_get(struct coap_resource *resource,
-		    struct coap_packet *request,
-		    struct sockaddr *addr, socklen_t addr_len)
+/* Patches message ID and Observe value into the template and sends it with
+ * the cached payload of the resource
+ */
+static int send_notification_template(struct coap_resource *resource,
+				      struct coap_observer *observer)
 {
-	struct coap_observer *observer;
-	uint8_t token[COAP_TOKEN_MAX_LEN];
-	uint16_t id;
-	uint8_t code;
-	uint8_t type;
-	uint8_t tkl;
-	bool observe = true;
+	struct notification_template *tmpl = &templates[observer - observers];
+	uint16_t id = coap_next_id();
+	k_spinlock_key_t key;
+	int r;
 
-	if (!coap_request_is_observe(request)) {
-		if (coap_get_option_int(request, COAP_OPTION_OBSERVE) == 1) {
-			remove_observer(addr);
-		}
-		observe = false;
-		
-	}
-	else
-	{
-		observer = coap_observer_next_unused(observers, NUM_OBSERVERS);
-		if (!observer) {
-			LOG_ERR("Not enough observer slots.");
+	sys_put_be16(id, &tmpl->hdr[2]);
+	key = k_spin_lock(&payload_lock);
+	memcpy(&tmpl->hdr[tmpl->etag_offset], payloads[resource - resources].etag,
+	       ETAG_LEN);
+	k_spin_unlock(&payload_lock, key);
+	sys_put_be24(resource->age, &tmpl->hdr[tmpl->observe_offset]);
+	sys_put_be16(sensor_max_age(resource), &tmpl->hdr[tmpl->max_age_offset]);
+
+	if (tmpl->pending) {
+		/* RFC 7641 4.5.2: the newer notification replaces the one still
+		 * being retransmitted, keeping its retransmission state
+		 */
+		tmpl->pending->id = id;
+	} else {
+		struct coap_packet pkt = {
+			.data = tmpl->hdr,
+			.offset = tmpl->hdr_len,
+			.max_len = sizeof(tmpl->hdr),
+		};
+		struct coap_pending *pending;
+
+		pending = coap_pending_next_unused(pendings, NUM_PENDINGS);
+		if (!pending) {
 			return -ENOMEM;
 		}
 
-		coap_observer_init(observer, request, addr);
-
-		coap_register_observer(resource, observer);
-	}
+		r = coap_pending_init(pending, &pkt, &observer->addr,
+				      MAX_RETRANSMIT_COUNT);
+		if (r < 0) {
+			return -EINVAL;
+		}
 
-	code = coap_header_get_code(request);
-	type = coap_header_get_type(request);
-	id = coap_header_get_id(request);
-	tkl = coap_header_get_token(request, token);
+		coap_pending_cycle(pending);
+		tmpl->pending = pending;
 
-	LOG_DBG("*******");
-	LOG_DBG("type: %u code %u id %u", type, code, id);
-	LOG_DBG("*******");
+		schedule_next_retransmission();
+	}
 
-	char temp[20];
-	sensor_data_t sensor_data;
-	get_sensor_data(&sensor_data);
-	sprintf(temp, "%d.%.2i",sensor_data.temp.val1,sensor_data.temp.val2);
-	
-	return send_notification_packet(addr, addr_len,
-					observe ? resource->age : 0,
-					id, token, tkl, true,
-				 &temp, strlen(temp));
+	return send_template(tmpl, &observer->addr);
 }
 
-static void temperature_notify(struct coap_resource *resource,
-		       struct coap_observer *observer)
+void coap_get_notification_stats(uint32_t *count, uint32_t *avg_cycles)
 {
-	char temp[20];
-	sensor_data_t sensor_data;
-	get_sensor_data(&sensor_data);
-	sprintf(temp, "%d.%.2i",sensor_data.temp.val1,sensor_data.temp.val2);
-	
-	LOG_INF("Sending Temperature Resource Notification: %s", temp);
-
-	send_notification_packet(&observer->addr,
-				 sizeof(observer->addr),
-				 resource->age, 0,
-				 observer->token, observer->tkl, false,
-				 &temp, strlen(temp));
+	*count = notify_count;
+	*avg_cycles = notify_count ? notify_cycles / notify_count : 0;
 }
 
-static int humidity_get(struct coap_resource *resource,
-		    struct coap_packet *request,
-		    struct sockaddr *addr, socklen_t addr_len)
+//--------------------------------------------------------
+// Observer persistence
+//--------------------------------------------------------
+
+static int coap_settings_set(const char *name, size_t len,
+			     settings_read_cb read_cb, void *cb_arg)
 {
-	struct coap_observer *observer;
-	uint8_t token[COAP_TOKEN_MAX_LEN];
-	uint16_t id;
-	uint8_t code;
-	uint8_t type;
-	uint8_t tkl;
-	bool observe = true;
+	const char *next;
+	int index;
+	int r;
 
-	if (!coap_request_is_observe(request)) {
-		if (coap_get_option_int(request, COAP_OPTION_OBSERVE) == 1) {
-			remove_observer(addr);
-		}
-		observe = false;
-		
-	}
-	else
-	{
-		observer = coap_observer_next_unused(observers, NUM_OBSERVERS);
-		if (!observer) {
-			LOG_ERR("Not enough observer slots.");
-			return -ENOMEM;
+	if (settings_name_steq(name, "obs", &next) && next) {
+		index = atoi(next);
+		if (index < 0 || index >= NUM_OBSERVERS ||
+		    len != sizeof(stored_observers[index])) {
+			return -EINVAL;
 		}
 
-		coap_observer_init(observer, request, addr);
+		r = read_cb(cb_arg, &stored_observers[index], len);
+		if (r < 0) {
+			return r;
+		}
 
-		coap_register_observer(resource, observer);
+		stored_observers_valid |= BIT(index);
+		return 0;
 	}
 
-	code = coap_header_get_code(request);
-	type = coap_header_get_type(request);
-	id = coap_header_get_id(request);
-	tkl = coap_header_get_token(request, token);
+	if (settings_name_steq(name, "age", &next) && next) {
+		index = atoi(next);
+		if (index < 0 || index >= COAP_SENSOR_RESOURCE_COUNT ||
+		    len != sizeof(age_reserved[index])) {
+			return -EINVAL;
+		}
 
-	LOG_DBG("*******");
-	LOG_DBG("type: %u code %u id %u", type, code, id);
-	LOG_DBG("*******");
+		r = read_cb(cb_arg, &age_reserved[index], len);
+		return r < 0 ? r : 0;
+	}
 
-	char humidity[20];
-	sensor_data_t sensor_data;
-	get_sensor_data(&sensor_data);
-	sprintf(humidity, "%d.%.2i",sensor_data.humidity.val1,sensor_data.humidity.val2);
-	
-	return send_notification_packet(addr, addr_len,
-					observe ? resource->age : 0,
-					id, token, tkl, true,
-				 &humidity, strlen(humidity));
+	return -ENOENT;
 }
 
-static void humidity_notify(struct coap_resource *resource,
-		       struct coap_observer *observer)
+SETTINGS_STATIC_HANDLER_DEFINE(coap, "coap", NULL, coap_settings_set, NULL, NULL);
+
+static void observer_store(struct coap_observer *observer,
+			   struct coap_resource *resource)
 {
-	char humidity[20];
-	sensor_data_t sensor_data;
-	get_sensor_data(&sensor_data);
-	sprintf(humidity, "%d.%.2i",sensor_data.humidity.val1,sensor_data.humidity.val2);
-	
-	LOG_INF("Sending Humidty Resource Notification: %s", humidity);
+	int slot = observer - observers;
+	struct stored_observer *stored = &stored_observers[slot];
+	char key[sizeof("coap/obs/") + 2];
+	int r;
 
-	send_notification_packet(&observer->addr,
-				 sizeof(observer->addr),
-				 resource->age, 0,
-				 observer->token, observer->tkl, false,
-				 &humidity, strlen(humidity));
+	memset(stored, 0, sizeof(*stored));
+	memcpy(&stored->addr, &observer->addr, sizeof(stored->addr));
+	memcpy(stored->token, observer->token, observer->tkl);
+	stored->tkl = observer->tkl;
+	stored->resource = resource - resources;
+	stored_observers_valid |= BIT(slot);
+
+	snprintk(key, sizeof(key), "coap/obs/%d", slot);
+	r = settings_save_one(key, stored, sizeof(*stored));
+	if (r < 0) {
+		LOG_WRN("Failed to store observer %d: %d", slot, r);
+	}
 }
 
-static int  air_quality_get(struct coap_resource *resource,
-		    struct coap_packet *request,
-		    struct sockaddr *addr, socklen_t addr_len)
+static void observer_forget(struct coap_observer *observer)
 {
-	struct coap_observer *observer;
-	uint8_t token[COAP_TOKEN_MAX_LEN];
-	uint16_t id;
-	uint8_t code;
-	uint8_t type;
-	uint8_t tkl;
-	bool observe = true;
+	int slot = observer - observers;
+	char key[sizeof("coap/obs/") + 2];
 
-	if (!coap_request_is_observe(request)) {
-		if (coap_get_option_int(request, COAP_OPTION_OBSERVE) == 1) {
-			remove_observer(addr);
-		}
-		observe = false;
-		
+	if (!(stored_observers_valid & BIT(slot))) {
+		return;
 	}
-	else
-	{
-		observer = coap_observer_next_unused(observers, NUM_OBSERVERS);
-		if (!observer) {
-			LOG_ERR("Not enough observer slots.");
-			return -ENOMEM;
+
+	stored_observers_valid &= ~BIT(slot);
+
+	snprintk(key, sizeof(key), "coap/obs/%d", slot);
+	(void)settings_delete(key);
+}
+
+/* Called before every notification: once the Observe value reaches the
+ * reserved one, the next block is reserved in flash before it is used
+ */
+/* Extends the reservation once less than `margin` values of it are left */
+static void observe_age_store(int resource_id, uint32_t margin)
+{
+	struct coap_resource *resource = &resources[resource_id];
+	char key[sizeof("coap/age/") + 3];
+	uint32_t reserved;
+	int r;
+
+	k_mutex_lock(&age_lock, K_FOREVER);
+
+	if ((int32_t)(resource->age + 1 + margin - age_reserved[resource_id]) < 0) {
+		k_mutex_unlock(&age_lock);
+		return;
+	}
+
+	reserved = resource->age + 1 + OBSERVE_AGE_RESERVE;
+
+	snprintk(key, sizeof(key), "coap/age/%d", resource_id);
+	r = settings_save_one(key, &reserved, sizeof(reserved));
+	if (r < 0) {
+		LOG_WRN("Failed to store Observe sequence of %d: %d",
+			resource_id, r);
+	}
+
+	age_reserved[resource_id] = reserved;
+	k_mutex_unlock(&age_lock);
+}
+
+static void observe_age_save(struct k_work *work)
+{
+	for (int i = 0; i < COAP_SENSOR_RESOURCE_COUNT; i++) {
+		observe_age_store(i, OBSERVE_AGE_RESERVE / 2);
+	}
+}
+
+/* Called before each notification. The flash write is left to the system
+ * work queue once half of the reserved block is used, the values still
+ * reserved cover the notifications until it is done. Only if they run out
+ * the notification path writes the reservation itself.
+ */
+static void observe_age_reserve(int resource_id)
+{
+	struct coap_resource *resource = &resources[resource_id];
+	uint32_t reserved = age_reserved[resource_id];
+
+	if ((int32_t)(resource->age + 1 - reserved) >= 0) {
+		observe_age_store(resource_id, 0);
+	} else if ((int32_t)(resource->age + 1 + OBSERVE_AGE_RESERVE / 2 - reserved) >= 0) {
+		k_work_schedule(&age_save_work, K_MSEC(OBSERVE_AGE_SAVE_DELAY_MS));
+	}
+}
+
+/* Reads the stored observers at boot, before the network is up */
+static void observers_load(void)
+{
+	int r;
+
+	r = settings_load_subtree("coap");
+	if (r < 0) {
+		LOG_WRN("Failed to load stored observers: %d", r);
+		stored_observers_valid = 0;
+	}
+}
+
+/* Registers the observers stored before the reboot again and sends them the
+ * current values right away, the clients do not have to re-register. Before
+ * the first sample is taken its notifications announce the values instead.
+ */
+static void observers_restore(void)
+{
+	bool restored[COAP_SENSOR_RESOURCE_COUNT] = { false };
+
+	for (int slot = 0; slot < NUM_OBSERVERS; slot++) {
+		struct stored_observer *stored = &stored_observers[slot];
+		struct coap_observer *observer = &observers[slot];
+		struct coap_resource *resource;
+
+		if (!(stored_observers_valid & BIT(slot))) {
+			continue;
 		}
 
-		coap_observer_init(observer, request, addr);
+		if (stored->resource >= COAP_SENSOR_RESOURCE_COUNT ||
+		    stored->tkl > COAP_TOKEN_MAX_LEN) {
+			observer_forget(observer);
+			continue;
+		}
+
+		resource = &resources[stored->resource];
+
+		/* Continue after every value that may have been sent */
+		if (resource->age == 0 && age_reserved[stored->resource] >= 2) {
+			resource->age = age_reserved[stored->resource];
+		}
+
+		memset(observer, 0, sizeof(*observer));
+		memcpy(&observer->addr, &stored->addr, sizeof(stored->addr));
+		memcpy(observer->token, stored->token, stored->tkl);
+		observer->tkl = stored->tkl;
 
 		coap_register_observer(resource, observer);
+		template_init(resource, observer);
+		restored[stored->resource] = true;
+
+		LOG_INF("Restored observer %d of resource %d", slot,
+			stored->resource);
 	}
 
-	code = coap_header_get_code(request);
-	type = coap_header_get_type(request);
-	id = coap_header_get_id(request);
-	tkl = coap_header_get_token(request, token);
+	if (!sensors_have_sample()) {
+		return;
+	}
 
-	LOG_DBG("*******");
-	LOG_DBG("type: %u code %u id %u", type, code, id);
-	LOG_DBG("*******");
+	for (int id = 0; id < COAP_SENSOR_RESOURCE_COUNT; id++) {
+		if (restored[id]) {
+			coap_resource_update(id);
+		}
+	}
+}
 
-	char air_quality[10];
-	sensor_data_t sensor_data;
-	get_sensor_data(&sensor_data);
-	sprintf(air_quality, "%d",sensor_data.air_quality_index);
+//--------------------------------------------------------
+// Multicast responses
+//--------------------------------------------------------
 
-	return send_notification_packet(addr, addr_len,
-					observe ? resource->age : 0,
-					id, token, tkl, true,
-				 &air_quality, strlen(air_quality));
+/* Retransmissions of a multicast request, and copies of it delivered to the
+ * unicast socket, are not answered again
+ */
+static bool mcast_request_seen(struct coap_packet *request,
+			       struct sockaddr *addr, bool multicast)
+{
+	struct in6_addr *src = &net_sin6(addr)->sin6_addr;
+	uint16_t id = coap_header_get_id(request);
+
+	for (int i = 0; i < MCAST_RECENT_REQUESTS; i++) {
+		if (recent_requests[i].id == id &&
+		    net_ipv6_addr_cmp(&recent_requests[i].addr, src)) {
+			if (multicast) {
+				mcast_stats.retries++;
+			}
+			return true;
+		}
+	}
+
+	if (multicast) {
+		mcast_stats.requests++;
+		recent_requests[recent_next].addr = *src;
+		recent_requests[recent_next].id = id;
+		recent_next = (recent_next + 1) % MCAST_RECENT_REQUESTS;
+	}
+
+	return false;
 }
 
-static void  air_quality_notify(struct coap_resource *resource,
-		       struct coap_observer *observer)
+static int mcast_defer_response(struct coap_packet *cpkt,
+				const struct sockaddr *addr, socklen_t addr_len)
 {
-	char air_quality[10];
-	sensor_data_t sensor_data;
-	get_sensor_data(&sensor_data);
-	sprintf(air_quality, "%d",sensor_data.air_quality_index);
+	struct delayed_response *d = NULL;
+	uint32_t leisure;
+	uint32_t delay;
 
-	LOG_INF("Sending Air Quality Resource Notification: %s", air_quality);
-	
-	send_notification_packet(&observer->addr,
-				 sizeof(observer->addr),
-				 resource->age, 0,
-				 observer->token, observer->tkl, false,
-				 &air_quality, strlen(air_quality));
+	/* Errors are not sent in response to multicast (RFC 7252 8.2), the
+	 * client learns nothing from a 4.04 of every node in the group
+	 */
+	if ((coap_header_get_code(cpkt) >> 5) >= 4) {
+		mcast_stats.suppressed++;
+		return 0;
+	}
+
+	for (int i = 0; i < MCAST_DELAYED_RESPONSES; i++) {
+		if (!delayed_responses[i].used) {
+			d = &delayed_responses[i];
+			break;
+		}
+	}
+
+	if (!d || addr_len > sizeof(d->addr)) {
+		mcast_stats.overflows++;
+		return -ENOMEM;
+	}
+
+	memcpy(d->data, cpkt->data, cpkt->offset);
+	d->len = cpkt->offset;
+	memcpy(&d->addr, addr, addr_len);
+
+	/* A multicast request is never acknowledged, the response is sent as
+	 * NON with its own message ID
+	 */
+	if (coap_header_get_type(cpkt) == COAP_TYPE_ACK) {
+		d->data[0] = (d->data[0] & ~0x30) | (COAP_TYPE_NON_CON << 4);
+		sys_put_be16(coap_next_id(), &d->data[2]);
+	}
+
+	leisure = MIN(MCAST_DEFAULT_LEISURE_MS,
+		      (uint32_t)d->len * MCAST_GROUP_SIZE * MSEC_PER_SEC /
+		      MCAST_DATA_RATE);
+	delay = leisure ? sys_rand32_get() % leisure : 0;
+
+	d->due = k_uptime_get_32() + delay;
+	d->used = true;
+
+	mcast_stats.delayed++;
+	mcast_delay_sum += delay;
+	mcast_stats.avg_delay_ms = mcast_delay_sum / mcast_stats.delayed;
+
+	LOG_DBG("Multicast response delayed by %u ms (Leisure %u ms)",
+		delay, leisure);
+
+	return 0;
 }
 
-static int air_pressure_get(struct coap_resource *resource,
-		    struct coap_packet *request,
-		    struct sockaddr *addr, socklen_t addr_len)
+/* Sends all due responses, returns the poll timeout until the next one */
+static int mcast_send_due_responses(void)
 {
-	struct coap_observer *observer;
+	uint32_t now = k_uptime_get_32();
+	int timeout = -1;
+	int r;
+
+	for (int i = 0; i < MCAST_DELAYED_RESPONSES; i++) {
+		struct delayed_response *d = &delayed_responses[i];
+		int32_t remaining = d->due - now;
+
+		if (!d->used) {
+			continue;
+		}
+
+		if (remaining > 0) {
+			if (timeout < 0 || remaining < timeout) {
+				timeout = remaining;
+			}
+			continue;
+		}
+
+		net_hexdump("Reply", d->data, d->len);
+
+		r = sendto(conf.ipv6.coap.sock, d->data, d->len, 0,
+			   (struct sockaddr *)&d->addr, sizeof(d->addr));
+		if (r < 0) {
+			LOG_ERR("Failed to send %d", errno);
+		} else {
+			power_count_tx(d->len);
+		}
+		d->used = false;
+	}
+
+	return timeout;
+}
+
+void coap_get_mcast_stats(struct mcast_stats *stats)
+{
+	*stats = mcast_stats;
+}
+
+//--------------------------------------------------------
+// Response cache
+//--------------------------------------------------------
+
+static void etag_calculate(const void *data, size_t len, uint8_t *etag)
+{
+	sys_put_be32(crc32_ieee(data, len), etag);
+}
+
+static bool etag_matches(struct coap_packet *request, const uint8_t *etag)
+{
+	struct coap_option options[4];
+	int num;
+
+	num = coap_find_options(request, COAP_OPTION_ETAG, options,
+				ARRAY_SIZE(options));
+
+	for (int i = 0; i < num; i++) {
+		if (options[i].len == ETAG_LEN &&
+		    memcmp(options[i].value, etag, ETAG_LEN) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Sensor resources are typed by their quantity, rt="temperature" is shared
+ * by sensors/temperature and sensors/temperature/1
+ */
+static const char *resource_type(const struct coap_resource *r)
+{
+	if (r->notify == sensor_notify) {
+		return r->path[1];
+	}
+
+	return NULL;
+}
+
+/* RFC 6690 4.1, a value ending with '*' matches as prefix. Several filters
+ * match if any of them does, so a client finds all the types it needs with
+ * one request.
+ */
+static bool rt_filters_match(const char *rt, const struct coap_option *filters,
+			     int num_filters)
+{
+	for (int i = 0; i < num_filters; i++) {
+		const char *value = (const char *)filters[i].value + strlen("rt=");
+		size_t len = filters[i].len - strlen("rt=");
+
+		if (len > 0 && value[len - 1] == '*') {
+			if (strlen(rt) >= len - 1 && memcmp(rt, value, len - 1) == 0) {
+				return true;
+			}
+		} else if (strlen(rt) == len && memcmp(rt, value, len) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Encodes the links of all resources, or only of the typed ones matching
+ * one of the filters. Typed links carry the zone of the sensor unit. Returns
+ * the length of the body.
+ */
+static int link_format_encode(char *buf, size_t size, int32_t zone,
+			      const struct coap_option *filters, int num_filters)
+{
+	struct coap_resource *r;
+	const char * const *p;
+	const char *rt;
+	int len = 0;
+
+	for (r = resources; r && r->path; r++) {
+		if (r == &resources[COAP_RESOURCE_WELL_KNOWN_CORE]) {
+			continue;
+		}
+
+		rt = resource_type(r);
+		if (num_filters > 0 &&
+		    (!rt || !rt_filters_match(rt, filters, num_filters))) {
+			continue;
+		}
+
+		len += snprintk(&buf[len], size - len, "%s<", len ? "," : "");
+		for (p = r->path; *p && len < size; p++) {
+			len += snprintk(&buf[len], size - len, "/%s", *p);
+		}
+		if (len < size) {
+			len += snprintk(&buf[len], size - len, ">");
+		}
+		if (len < size && rt) {
+			len += snprintk(&buf[len], size - len, ";rt=\"%s\";zone=%d",
+					rt, zone);
+		}
+		if (len < size && r->notify) {
+			len += snprintk(&buf[len], size - len, ";obs");
+		}
+
+		if (len >= size) {
+			LOG_ERR("/.well-known/core truncated, increase WELL_KNOWN_CORE_LEN");
+			len = size - 1;
+			break;
+		}
+	}
+
+	return len;
+}
+
+/* Encodes the link format description of all resources, again only once
+ * the zone changed
+ */
+static void well_known_core_build(void)
+{
+	well_known_core_zone = config_get(CFG_ZONE);
+	well_known_core_len = link_format_encode(well_known_core,
+						 sizeof(well_known_core),
+						 well_known_core_zone, NULL, 0);
+	etag_calculate(well_known_core, well_known_core_len, well_known_core_etag);
+}
+
+//--------------------------------------------------------
+// Resources
+//--------------------------------------------------------
+
+static int well_known_core_get(struct coap_resource *resource,
+			       struct coap_packet *request,
+			       struct sockaddr *addr, socklen_t addr_len)
+{
+	struct coap_option filters[WELL_KNOWN_CORE_MAX_FILTERS];
+	struct coap_packet response;
 	uint8_t token[COAP_TOKEN_MAX_LEN];
+	uint8_t filtered_etag[ETAG_LEN];
+	const uint8_t *etag;
+	const char *body;
+	uint16_t body_len;
+	uint8_t *data;
 	uint16_t id;
 	uint8_t code;
 	uint8_t type;
 	uint8_t tkl;
-	bool observe = true;
+	int block2;
+	uint32_t num = 0;
+	uint8_t szx = WELL_KNOWN_CORE_SZX;
+	uint32_t offset;
+	uint16_t block_len;
+	int num_filters = 0;
+	bool more;
+	bool valid;
+	int r;
 
-	if (!coap_request_is_observe(request)) {
-		if (coap_get_option_int(request, COAP_OPTION_OBSERVE) == 1) {
-			remove_observer(addr);
+	/* A zone written through /config is picked up with the next request */
+	if (well_known_core_zone != config_get(CFG_ZONE)) {
+		well_known_core_build();
+	}
+
+	etag = well_known_core_etag;
+	body = well_known_core;
+	body_len = well_known_core_len;
+
+	/* Queries other than rt are not supported and do not filter */
+	r = coap_find_options(request, COAP_OPTION_URI_QUERY, filters,
+			      ARRAY_SIZE(filters));
+	for (int i = 0; i < r; i++) {
+		if (filters[i].len > strlen("rt=") &&
+		    memcmp(filters[i].value, "rt=", strlen("rt=")) == 0) {
+			filters[num_filters++] = filters[i];
 		}
-		observe = false;
-		
 	}
-	else
-	{
-		observer = coap_observer_next_unused(observers, NUM_OBSERVERS);
-		if (!observer) {
-			LOG_ERR("Not enough observer slots.");
-			return -ENOMEM;
+
+	/* A filtered body is encoded per request, also for each block. Without
+	 * a match a multicast request is not answered, the 4.04 is suppressed.
+	 */
+	if (num_filters > 0) {
+		body = well_known_core_filtered;
+		body_len = link_format_encode(well_known_core_filtered,
+					      sizeof(well_known_core_filtered),
+					      well_known_core_zone,
+					      filters, num_filters);
+		if (body_len == 0) {
+			return send_error_response(request, addr, addr_len,
+						   COAP_RESPONSE_CODE_NOT_FOUND,
+						   WELL_KNOWN_CORE_MAX_AGE);
 		}
 
-		coap_observer_init(observer, request, addr);
+		etag_calculate(body, body_len, filtered_etag);
+		etag = filtered_etag;
+	}
 
-		coap_register_observer(resource, observer);
+	data = (uint8_t *)k_malloc(MAX_COAP_MSG_LEN);
+	if (!data) {
+		return -ENOMEM;
 	}
 
 	code = coap_header_get_code(request);
@@ -864,65 +1892,94 @@ static int air_pressure_get(struct coap_resource *resource,
 	LOG_DBG("type: %u code %u id %u", type, code, id);
 	LOG_DBG("*******");
 
-	char air_pressure[20];
-	sensor_data_t sensor_data;
-	get_sensor_data(&sensor_data);
-	sprintf(air_pressure, "%d.%.2i",sensor_data.press.val1,sensor_data.press.val2);
-	
-	return send_notification_packet(addr, addr_len,
-					observe ? resource->age : 0,
-					id, token, tkl, true,
-				 &air_pressure, strlen(air_pressure));
-}
+	if (type == COAP_TYPE_CON) {
+		type = COAP_TYPE_ACK;
+	} else {
+		type = COAP_TYPE_NON_CON;
+	}
 
-static void air_pressure_notify(struct coap_resource *resource,
-		       struct coap_observer *observer)
-{
-	char air_pressure[20];
-	sensor_data_t sensor_data;
-	get_sensor_data(&sensor_data);
-	sprintf(air_pressure, "%d.%.2i",sensor_data.press.val1,sensor_data.press.val2);
+	valid = etag_matches(request, etag);
 
-	LOG_INF("Sending Air Pressure Resource Notification: %s", air_pressure);
-	
-	send_notification_packet(&observer->addr,
-				 sizeof(observer->addr),
-				 resource->age, 0,
-				 observer->token, observer->tkl, false,
-				 &air_pressure, strlen(air_pressure));
+	/* Only the requested block of the body is copied. A larger block size
+	 * than ours is answered with smaller blocks starting at the same
+	 * offset (RFC 7959 2.4), a block beyond the body or the reserved
+	 * SZX 7 is a bad option.
+	 */
+	block2 = coap_get_option_int(request, COAP_OPTION_BLOCK2);
+	if (block2 >= 0) {
+		num = block2 >> 4;
+		szx = block2 & 0x7;
+		if (szx > WELL_KNOWN_CORE_SZX && szx < 7) {
+			num <<= szx - WELL_KNOWN_CORE_SZX;
+			szx = WELL_KNOWN_CORE_SZX;
+		}
+	}
+
+	offset = num * (16U << szx);
+	if (szx > WELL_KNOWN_CORE_SZX || offset >= body_len) {
+		k_free(data);
+		return send_error_response(request, addr, addr_len,
+					   COAP_RESPONSE_CODE_BAD_OPTION, 0);
+	}
+	block_len = MIN(16U << szx, body_len - offset);
+	more = offset + block_len < body_len;
+
+	r = coap_packet_init(&response, data, MAX_COAP_MSG_LEN,
+			     COAP_VERSION_1, type, tkl, token,
+			     valid ? COAP_RESPONSE_CODE_VALID : COAP_RESPONSE_CODE_CONTENT,
+			     id);
+
+	if (r == 0) {
+		r = coap_packet_append_option(&response, COAP_OPTION_ETAG,
+					      etag, ETAG_LEN);
+	}
+
+	if (r == 0 && !valid) {
+		r = coap_append_option_int(&response, COAP_OPTION_CONTENT_FORMAT,
+					   COAP_CONTENT_FORMAT_APP_LINK_FORMAT);
+	}
+
+	if (r == 0) {
+		r = coap_append_option_int(&response, COAP_OPTION_MAX_AGE,
+					   WELL_KNOWN_CORE_MAX_AGE);
+	}
+
+	if (r == 0 && !valid && (more || block2 >= 0)) {
+		r = coap_append_option_int(&response, COAP_OPTION_BLOCK2,
+					   (num << 4) | (more << 3) | szx);
+	}
+
+	if (r == 0 && !valid) {
+		r = coap_packet_append_payload_marker(&response);
+		if (r == 0) {
+			r = coap_packet_append_payload(&response,
+					(uint8_t *)&body[offset], block_len);
+		}
+	}
+
+	if (r == 0) {
+		r = send_coap_reply(&response, addr, addr_len);
+	}
+
+	k_free(data);
+
+	return r;
 }
 
-static int presence_get(struct coap_resource *resource,
+static int echo_put(struct coap_resource *resource,
 		    struct coap_packet *request,
 		    struct sockaddr *addr, socklen_t addr_len)
 {
-	struct coap_observer *observer;
+	struct coap_packet response;
 	uint8_t token[COAP_TOKEN_MAX_LEN];
-	uint16_t id;
+	const uint8_t *payload;
+	uint8_t *data;
+	uint16_t payload_len;
 	uint8_t code;
 	uint8_t type;
 	uint8_t tkl;
-	bool observe = true;
-
-	if (!coap_request_is_observe(request)) {
-		if (coap_get_option_int(request, COAP_OPTION_OBSERVE) == 1) {
-			remove_observer(addr);
-		}
-		observe = false;
-		
-	}
-	else
-	{
-		observer = coap_observer_next_unused(observers, NUM_OBSERVERS);
-		if (!observer) {
-			LOG_ERR("Not enough observer slots.");
-			return -ENOMEM;
-		}
-
-		coap_observer_init(observer, request, addr);
-
-		coap_register_observer(resource, observer);
-	}
+	uint16_t id;
+	int r;
 
 	code = coap_header_get_code(request);
 	type = coap_header_get_type(request);
@@ -933,35 +1990,44 @@ static int presence_get(struct coap_resource *resource,
 	LOG_DBG("type: %u code %u id %u", type, code, id);
 	LOG_DBG("*******");
 
-	char presence[5];
-	sensor_data_t sensor_data;
-	get_sensor_data(&sensor_data);
-	sprintf(presence, "%d",sensor_data.presence);
-	
-	return send_notification_packet(addr, addr_len,
-					observe ? resource->age : 0,
-					id, token, tkl, true,
-				 &presence, strlen(presence));
-}
+	payload = coap_packet_get_payload(request, &payload_len);
+	if (payload) {
+		net_hexdump("PUT Payload", payload, payload_len);
+	}
 
-static void presence_notify(struct coap_resource *resource,
-		       struct coap_observer *observer)
-{
-	char presence[5];
-	sensor_data_t sensor_data;
-	get_sensor_data(&sensor_data);
-	sprintf(presence, "%d",sensor_data.presence);
+	if (type == COAP_TYPE_CON) {
+		type = COAP_TYPE_ACK;
+	} else {
+		type = COAP_TYPE_NON_CON;
+	}
 
-	LOG_INF("Sending Presence Resource Notification: %s", presence);
-	
-	send_notification_packet(&observer->addr,
-				 sizeof(observer->addr),
-				 resource->age, 0,
-				 observer->token, observer->tkl, false,
-				 &presence, strlen(presence));
+	data = (uint8_t *)k_malloc(MAX_COAP_MSG_LEN);
+	if (!data) {
+		return -ENOMEM;
+	}
+
+	r = coap_packet_init(&response, data, MAX_COAP_MSG_LEN,
+			     COAP_VERSION_1, type, tkl, token,
+			     COAP_RESPONSE_CODE_CHANGED, id);
+	if (r == 0) {
+
+		r = coap_packet_append_payload_marker(&response);
+		if (r == 0) {
+			r = coap_packet_append_payload(&response, payload, payload_len);
+			if (r == 0) {
+				r = send_coap_reply(&response, addr, addr_len);
+			}
+
+		}
+
+	}
+
+	k_free(data);
+
+	return r;
 }
 
-static int luminance_get(struct coap_resource *resource,
+static int sensor_get(struct coap_resource *resource,
 		    struct coap_packet *request,
 		    struct sockaddr *addr, socklen_t addr_len)
 {
@@ -973,24 +2039,43 @@ static int luminance_get(struct coap_resource *resource,
 	uint8_t tkl;
 	bool observe = true;
 
+	/* The first sample is normally taken before the network is up, should
+	 * a request be faster the client retries after a second
+	 */
+	if (!sensors_have_sample()) {
+		return send_error_response(request, addr, addr_len,
+					   COAP_RESPONSE_CODE_SERVICE_UNAVAILABLE, 1);
+	}
+
 	if (!coap_request_is_observe(request)) {
 		if (coap_get_option_int(request, COAP_OPTION_OBSERVE) == 1) {
-			remove_observer(addr);
+			uint8_t token[COAP_TOKEN_MAX_LEN];
+			uint8_t tkl = coap_header_get_token(request, token);
+
+			remove_observer(addr, token, tkl);
 		}
 		observe = false;
 		
 	}
 	else
 	{
-		observer = coap_observer_next_unused(observers, NUM_OBSERVERS);
+		observer = NULL;
+		if (observers_in_use() < config_get(CFG_MAX_OBSERVERS)) {
+			observer = coap_observer_next_unused(observers, NUM_OBSERVERS);
+		}
 		if (!observer) {
 			LOG_ERR("Not enough observer slots.");
-			return -ENOMEM;
+			return send_error_response(request, addr, addr_len,
+					COAP_RESPONSE_CODE_SERVICE_UNAVAILABLE,
+					sensor_max_age(resource));
 		}
 
 		coap_observer_init(observer, request, addr);
 
 		coap_register_observer(resource, observer);
+
+		template_init(resource, observer);
+		observer_store(observer, resource);
 	}
 
 	code = coap_header_get_code(request);
@@ -1002,44 +2087,339 @@ static int luminance_get(struct coap_resource *resource,
 	LOG_DBG("type: %u code %u id %u", type, code, id);
 	LOG_DBG("*******");
 
-	char luminance[5];
+	char value[MAX_PAYLOAD_LEN];
 	sensor_data_t sensor_data;
 	get_sensor_data(&sensor_data);
-	sprintf(luminance, "%d",sensor_data.luminance);
+	int len = sensor_resource_format(resource - resources, &sensor_data,
+					 value, sizeof(value));
+	if (len < 0) {
+		return len;
+	}
+	len = MIN(len, sizeof(value) - 1);
+
+	// The ETag identifies the representation, the client's copy is
+	// still valid if it matches
+	uint8_t etag[ETAG_LEN];
+	etag_calculate(value, len, etag);
 	
 	return send_notification_packet(addr, addr_len,
 					observe ? resource->age : 0,
-					id, token, tkl, true,
-				 &luminance, strlen(luminance));
+					id, token, tkl, true, etag,
+					sensor_max_age(resource),
+				 etag_matches(request, etag) ? NULL : value, len);
+}
+
+/* Starts streaming to the requester, the payload is "<rate Hz>;<duration s>",
+ * both optional. The samples arrive as NON responses with the request token.
+ */
+static int stream_post(struct coap_resource *resource,
+		       struct coap_packet *request,
+		       struct sockaddr *addr, socklen_t addr_len)
+{
+	uint8_t token[COAP_TOKEN_MAX_LEN];
+	const uint8_t *payload;
+	uint16_t payload_len;
+	char params[16] = { 0 };
+	uint32_t rate_hz = 0;
+	uint32_t duration_s = 0;
+	char *next;
+	uint8_t tkl;
+	int r;
+
+	/* A stream is for a single receiver */
+	if (request_multicast) {
+		return -EPERM;
+	}
+
+	payload = coap_packet_get_payload(request, &payload_len);
+	if (payload) {
+		memcpy(params, payload, MIN(payload_len, sizeof(params) - 1));
+		rate_hz = strtoul(params, &next, 10);
+		if (*next == ';') {
+			duration_s = strtoul(next + 1, NULL, 10);
+		}
+	}
+
+	tkl = coap_header_get_token(request, token);
+
+	r = stream_start(addr, addr_len, token, tkl, rate_hz, duration_s);
+	if (r == -EBUSY) {
+		return send_error_response(request, addr, addr_len,
+					   COAP_RESPONSE_CODE_SERVICE_UNAVAILABLE,
+					   stream_remaining());
+	} else if (r == -EINVAL) {
+		return send_error_response(request, addr, addr_len,
+					   COAP_RESPONSE_CODE_BAD_REQUEST, 0);
+	} else if (r < 0) {
+		return send_error_response(request, addr, addr_len,
+					   COAP_RESPONSE_CODE_INTERNAL_ERROR, 0);
+	}
+
+	return send_error_response(request, addr, addr_len,
+				   COAP_RESPONSE_CODE_CHANGED, 0);
+}
+
+static int stream_delete(struct coap_resource *resource,
+			 struct coap_packet *request,
+			 struct sockaddr *addr, socklen_t addr_len)
+{
+	stream_stop();
+
+	return send_error_response(request, addr, addr_len,
+				   COAP_RESPONSE_CODE_DELETED, 0);
+}
+
+/* "<active>;<packets>;<frames sent>;<frames dropped>;<send errors>" */
+static int stream_status_get(struct coap_resource *resource,
+			     struct coap_packet *request,
+			     struct sockaddr *addr, socklen_t addr_len)
+{
+	struct stream_stats stats;
+	char status[48];
+	int len;
+
+	stream_get_stats(&stats);
+
+	len = snprintk(status, sizeof(status), "%u;%u;%u;%u;%u", stats.active,
+		       stats.packets, stats.frames_sent, stats.frames_dropped,
+		       stats.send_errors);
+
+	return send_simple_response(request, addr, addr_len,
+				    COAP_RESPONSE_CODE_CONTENT, 0, status,
+				    MIN(len, sizeof(status) - 1));
+}
+
+/* Parameter of a /config/<name> resource, -1 for /config itself */
+static int config_param_of(struct coap_resource *resource)
+{
+	return (resource - resources) - COAP_RESOURCE_CONFIG - 1;
 }
 
-static void luminance_notify(struct coap_resource *resource,
+/* /config lists all parameters as "name=value" lines, /config/<name> only
+ * returns the value
+ */
+static int config_resource_get(struct coap_resource *resource,
+			       struct coap_packet *request,
+			       struct sockaddr *addr, socklen_t addr_len)
+{
+	/* Header, token and options stay below 64 bytes */
+	char body[MAX_COAP_MSG_LEN - 64];
+	int len;
+
+	len = config_format(config_param_of(resource), body, sizeof(body));
+	if (len < 0) {
+		return send_error_response(request, addr, addr_len,
+					   COAP_RESPONSE_CODE_INTERNAL_ERROR, 0);
+	}
+
+	return send_simple_response(request, addr, addr_len,
+				    COAP_RESPONSE_CODE_CONTENT, 0, body,
+				    MIN(len, sizeof(body) - 1));
+}
+
+/* PUT /config takes "name=value" items separated by ';' or newlines and
+ * applies all of them or none, PUT /config/<name> takes the value alone
+ */
+static int config_resource_put(struct coap_resource *resource,
+			       struct coap_packet *request,
+			       struct sockaddr *addr, socklen_t addr_len)
+{
+	int param = config_param_of(resource);
+	const uint8_t *payload;
+	uint16_t payload_len;
+	int r;
+
+	/* Devices are configured one by one */
+	if (request_multicast) {
+		return -EPERM;
+	}
+
+	payload = coap_packet_get_payload(request, &payload_len);
+	if (!payload) {
+		return send_error_response(request, addr, addr_len,
+					   COAP_RESPONSE_CODE_BAD_REQUEST, 0);
+	}
+
+	if (param < 0) {
+		r = config_write((const char *)payload, payload_len);
+	} else {
+		r = config_write_one(param, (const char *)payload, payload_len);
+	}
+
+	if (r < 0) {
+		LOG_WRN("Configuration rejected (%d)", r);
+		return send_error_response(request, addr, addr_len,
+					   COAP_RESPONSE_CODE_BAD_REQUEST, 0);
+	}
+
+	return send_error_response(request, addr, addr_len,
+				   COAP_RESPONSE_CODE_CHANGED, 0);
+}
+
+static void sensor_notify(struct coap_resource *resource,
 		       struct coap_observer *observer)
 {
 	if(resource == NULL || observer == NULL) return;
 
-	char luminance[5];
+	uint32_t start = k_cycle_get_32();
+	int r;
+
+#if NOTIFY_TEMPLATES
+	r = send_notification_template(resource, observer);
+#else
+	/* Baseline: every notification reads and formats the value and is
+	 * encoded with coap_packet_init, nothing is shared between observers
+	 */
+	struct payload_cache payload;
 	sensor_data_t sensor_data;
+
 	get_sensor_data(&sensor_data);
-	sprintf(luminance, "%d",sensor_data.luminance);
+	r = sensor_resource_format(resource - resources, &sensor_data,
+				   payload.data, sizeof(payload.data));
+	if (r < 0) {
+		return;
+	}
+	payload.len = MIN(r, sizeof(payload.data) - 1);
+	etag_calculate(payload.data, payload.len, payload.etag);
 
-	LOG_INF("Sending Luminance Resource Notification: %s", luminance);
-	
-	send_notification_packet(&observer->addr,
+	r = send_notification_packet(&observer->addr,
 				 sizeof(observer->addr),
 				 resource->age, 0,
 				 observer->token, observer->tkl, false,
-				 &luminance, strlen(luminance));
+				 payload.etag, sensor_max_age(resource),
+				 payload.data, payload.len);
+#endif
+	if (r < 0) {
+		LOG_ERR("Failed to send notification: %d", r);
+		return;
+	}
 
+	notify_cycles += k_cycle_get_32() - start;
+	notify_count++;
+	boot_mark(BOOT_FIRST_NOTIFICATION);
 }
 
-
 void coap_resource_update(int resource_id)
 {
-	if(resource_id > LAST_ID_RESOURCE_ID)
+	if(resource_id < 0 || resource_id >= COAP_SENSOR_RESOURCE_COUNT ||
+	   !atomic_get(&coap_initialized))
+	{
+		return;
+	}
+
+	// A sleepy device sends all changes together once per sample period
+	if(LOW_POWER_PROFILE)
 	{
+		atomic_set_bit(deferred_updates, resource_id);
 		return;
 	}
 
+	resource_send_update(resource_id);
+}
+
+void coap_flush_updates(void)
+{
+	bool sent = false;
+
+	for(int id = 0; id < COAP_SENSOR_RESOURCE_COUNT; id++)
+	{
+		if(atomic_test_and_clear_bit(deferred_updates, id))
+		{
+			resource_send_update(id);
+			sent = true;
+		}
+	}
+
+	if(sent)
+	{
+		power_radio_window();
+	}
+}
+
+static void resource_send_update(int resource_id)
+{
+	// Format the value once, all observers send the cached payload
+	struct payload_cache payload;
+	sensor_data_t sensor_data;
+	k_spinlock_key_t key;
+
+	get_sensor_data(&sensor_data);
+	int len = sensor_resource_format(resource_id, &sensor_data,
+					 payload.data, sizeof(payload.data));
+	if(len < 0)
+	{
+		return;
+	}
+	payload.len = MIN(len, sizeof(payload.data) - 1);
+	etag_calculate(payload.data, payload.len, payload.etag);
+
+	key = k_spin_lock(&payload_lock);
+	payloads[resource_id] = payload;
+	k_spin_unlock(&payload_lock, key);
+
+	observe_age_reserve(resource_id);
 	coap_resource_notify(&resources[resource_id]);
-}
\ No newline at end of file
+}
+
+//--------------------------------------------------------
+// Benchmark
+//--------------------------------------------------------
+
+/* Resolves the path of every resource with the linear matcher and with the
+ * router, the request packets are built and parsed beforehand so only the
+ * lookup is timed
+ */
+int coap_router_benchmark(uint32_t iterations, uint64_t *linear_ns,
+			  uint64_t *router_ns)
+{
+	static struct coap_option paths[COAP_RESOURCE_COUNT][MAX_PATH_SEGMENTS];
+	static int num_segments[COAP_RESOURCE_COUNT];
+	uint8_t data[MAX_COAP_MSG_LEN];
+	struct coap_packet request;
+	uint64_t linear = 0, router = 0;
+	uint64_t lookups = (uint64_t)iterations * COAP_RESOURCE_COUNT;
+	uint32_t start;
+	int r;
+
+	if (iterations == 0) {
+		return -EINVAL;
+	}
+
+	for (int i = 0; i < COAP_RESOURCE_COUNT; i++) {
+		r = coap_packet_init(&request, data, sizeof(data), COAP_VERSION_1,
+				     COAP_TYPE_CON, 0, NULL, COAP_METHOD_GET, 0);
+		for (const char * const *p = resources[i].path; r == 0 && *p; p++) {
+			r = coap_packet_append_option(&request, COAP_OPTION_URI_PATH,
+						      *p, strlen(*p));
+		}
+		if (r < 0) {
+			return r;
+		}
+
+		/* coap_find_options copies the values, data can be reused */
+		num_segments[i] = coap_find_options(&request, COAP_OPTION_URI_PATH,
+						    paths[i], MAX_PATH_SEGMENTS);
+	}
+
+	for (uint32_t n = 0; n < iterations; n++) {
+		for (int i = 0; i < COAP_RESOURCE_COUNT; i++) {
+			start = k_cycle_get_32();
+			if (coap_router_lookup_linear(resources, paths[i],
+						      num_segments[i]) != &resources[i]) {
+				return -EFAULT;
+			}
+			linear += k_cycle_get_32() - start;
+
+			start = k_cycle_get_32();
+			if (coap_router_lookup(paths[i], num_segments[i]) != &resources[i]) {
+				return -EFAULT;
+			}
+			router += k_cycle_get_32() - start;
+		}
+	}
+
+	*linear_ns = k_cyc_to_ns_floor64(linear) / lookups;
+	*router_ns = k_cyc_to_ns_floor64(router) / lookups;
+
+	return 0;
+}
@@ -7,6 +7,7 @@
 
 
 #include <zephyr/drivers/sensor.h>
+#include <zephyr/sys/util.h>
 
 
 #define COAP_PORT 5683
@@ -17,7 +18,41 @@
 
 #define THREAD_PRIORITY K_PRIO_PREEMPT(8)
 
-#define STATS_TIMER 60 /* How often to print statistics (in seconds) */
+/* Default of how often the statistics are logged (in seconds),
+ * /config/stats_s changes it at runtime and 0 turns the log off
+ */
+#define STATS_TIMER 60
+
+/* Observer slots, /config/observers limits how many of them accept new
+ * registrations
+ */
+#define NUM_OBSERVERS 10
+
+/* Default interval of the sensor sampling thread, also the Max-Age of
+ * responses, changed at runtime through /config/period_ms
+ */
+#define SAMPLE_PERIOD_MS 5000
+
+/* Zone of the room the sensor unit is placed in, published with its links so
+ * a thermostat feeds the values to the matching HVAC zone. Changed at
+ * runtime through /config/zone.
+ */
+#ifndef SENSOR_ZONE
+	#define SENSOR_ZONE 0
+#endif
+
+/* Sleepy end device build (overlay-sed.conf): the BME680 heater is duty
+ * cycled and notifications are sent in batches once per sample period
+ */
+#define LOW_POWER_PROFILE IS_ENABLED(CONFIG_OPENTHREAD_MTD_SED)
+
+/* The BME680 driver runs the gas heater on every fetch, so in the low power
+ * profile the sensor is only sampled every gas_every periods by default and
+ * the last values are kept in between
+ */
+#ifndef BME680_GAS_EVERY
+	#define BME680_GAS_EVERY (LOW_POWER_PROFILE ? 6 : 1)
+#endif
 
 #define ALL_NODES_LOCAL_COAP_MCAST \
 	{ { { 0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xfd } } }
@@ -25,14 +60,118 @@
 #define MY_IP6ADDR \
 	{ { { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x1 } } }
 
-#define COAP_RESOURCE_ECHO 1
-#define COAP_RESOURCE_TEMPERATURE 2
-#define COAP_RESOURCE_HUMIDITY 3
-#define COAP_RESOURCE_AIR_QUALITY 4
-#define COAP_RESOURCE_AIR_PRESSURE 5
-#define COAP_RESOURCE_PRESSENCE 6
-#define COAP_RESOURCE_LUMINANCE 7
-#define LAST_ID_RESOURCE_ID COAP_RESOURCE_LUMINANCE
+//--------------------------------------------------------
+// Runtime configuration
+//--------------------------------------------------------
+
+enum cfg_type {
+	CFG_TYPE_UINT,
+	CFG_TYPE_DECIMAL,	/* stored in thousandths, written as "1.5" */
+};
+
+/*
+ * X-macro of the parameters published below /config, X(ID, name, type,
+ * default, min, max). Decimal limits are given in thousandths, the deltas are
+ * the change of a sensor value that notifies its observers. A name has to fit
+ * into one Uri-Path option of 12 bytes.
+ */
+#define CFG_PARAMS(X) \
+	X(SAMPLE_PERIOD_MS, "period_ms", CFG_TYPE_UINT, SAMPLE_PERIOD_MS, 1000, 60000) \
+	X(GAS_EVERY, "gas_every", CFG_TYPE_UINT, BME680_GAS_EVERY, 1, 60) \
+	X(TEMPERATURE_DELTA, "temp_delta", CFG_TYPE_DECIMAL, 1000, 10, 10000) \
+	X(HUMIDITY_DELTA, "hum_delta", CFG_TYPE_DECIMAL, 1000, 10, 20000) \
+	X(AIR_QUALITY_DELTA, "aiq_delta", CFG_TYPE_DECIMAL, 1000, 1000, 100000) \
+	X(AIR_PRESSURE_DELTA, "press_delta", CFG_TYPE_DECIMAL, 1000, 10, 10000) \
+	X(ANALOG_DELTA, "analog_delta", CFG_TYPE_DECIMAL, 1000, 1000, 4096000) \
+	X(ZONE, "zone", CFG_TYPE_UINT, SENSOR_ZONE, 0, 31) \
+	X(STATS_TIMER, "stats_s", CFG_TYPE_UINT, STATS_TIMER, 0, 3600) \
+	X(MAX_OBSERVERS, "observers", CFG_TYPE_UINT, NUM_OBSERVERS, 1, NUM_OBSERVERS)
+
+#define CFG_PARAM_ID(ID, name, type, def, min, max) CFG_##ID,
+
+enum cfg_param {
+	CFG_PARAMS(CFG_PARAM_ID)
+	CFG_PARAM_COUNT
+};
+
+//--------------------------------------------------------
+// Sensor and resource description
+//--------------------------------------------------------
+
+#define BME680_NUM_INSTANCES DT_NUM_INST_STATUS_OKAY(bosch_bme680)
+#define ANALOG_NUM_CHANNELS DT_PROP_LEN(DT_PATH(zephyr_user), io_channels)
+
+/* The first zephyr,user io-channels entry is the luminance sensor, all other
+ * analog channels are published as raw ADC values
+ */
+#define LUMINANCE_CHANNEL 0
+#define ANALOG_CHANNEL_NAME(idx) \
+	COND_CODE_0(idx, ("luminance"), ("analog" STRINGIFY(idx)))
+/* Value the maximum ADC reading is scaled to, the luminance sensor reaches 350 lux */
+#define ANALOG_CHANNEL_FULL_SCALE(idx) \
+	COND_CODE_0(idx, (350), (4096))
+
+enum sensor_kind {
+	SENSOR_TEMPERATURE,
+	SENSOR_HUMIDITY,
+	SENSOR_AIR_QUALITY,
+	SENSOR_AIR_PRESSURE,
+	SENSOR_ANALOG,
+	SENSOR_PRESENCE,
+	SENSOR_OCCUPANCY,
+};
+
+/*
+ * X-macro describing every sensor resource, X(ID, kind, index, (path)) is
+ * expanded once per BME680 instance quantity, ADC channel and PIR resource.
+ * The path segments are appended to "sensors", further BME680 instances get
+ * their instance number as last segment (e.g. sensors/temperature/1).
+ */
+#define BME680_INSTANCE_SEGMENT(i) COND_CODE_0(i, (), (, STRINGIFY(i)))
+
+#define BME680_INSTANCE_RESOURCES(i, X) \
+	X(TEMPERATURE, SENSOR_TEMPERATURE, i, ("temperature" BME680_INSTANCE_SEGMENT(i))) \
+	X(HUMIDITY, SENSOR_HUMIDITY, i, ("humidity" BME680_INSTANCE_SEGMENT(i))) \
+	X(AIR_QUALITY, SENSOR_AIR_QUALITY, i, ("air_quality" BME680_INSTANCE_SEGMENT(i))) \
+	X(AIR_PRESSURE, SENSOR_AIR_PRESSURE, i, ("air_pressure" BME680_INSTANCE_SEGMENT(i)))
+
+#define ANALOG_CHANNEL_RESOURCES(i, X) \
+	X(ANALOG, SENSOR_ANALOG, i, (ANALOG_CHANNEL_NAME(i)))
+
+#define SENSOR_RESOURCES(X) \
+	LISTIFY(BME680_NUM_INSTANCES, BME680_INSTANCE_RESOURCES, (), X) \
+	LISTIFY(ANALOG_NUM_CHANNELS, ANALOG_CHANNEL_RESOURCES, (), X) \
+	X(PRESSENCE, SENSOR_PRESENCE, 0, ("presence")) \
+	X(OCCUPANCY, SENSOR_OCCUPANCY, 0, ("occupancy"))
+
+#define SENSOR_RESOURCE_ID(ID, kind, idx, path) COAP_RESOURCE_##ID##_##idx,
+#define CFG_RESOURCE_ID(ID, name, type, def, min, max) COAP_RESOURCE_CFG_##ID,
+
+/* Sensor resources come first so the ID indexes sensor_resources[] as well.
+ * /.well-known/core is encoded by the application, walking the whole table.
+ * Zephyr's coap_well_known_core_get() only lists the entries after its own
+ * and must not be used with this order.
+ */
+enum coap_resource_id {
+	SENSOR_RESOURCES(SENSOR_RESOURCE_ID)
+	COAP_SENSOR_RESOURCE_COUNT,
+	COAP_RESOURCE_ECHO = COAP_SENSOR_RESOURCE_COUNT,
+	COAP_RESOURCE_STREAM,
+	COAP_RESOURCE_CONFIG,
+	CFG_PARAMS(CFG_RESOURCE_ID)
+	COAP_RESOURCE_WELL_KNOWN_CORE,
+	COAP_RESOURCE_COUNT
+};
+
+#define COAP_RESOURCE_PRESSENCE COAP_RESOURCE_PRESSENCE_0
+#define COAP_RESOURCE_OCCUPANCY COAP_RESOURCE_OCCUPANCY_0
+
+struct sensor_resource {
+	uint8_t kind;
+	uint8_t index;	/* BME680 instance or ADC channel */
+};
+
+extern const struct sensor_resource sensor_resources[COAP_SENSOR_RESOURCE_COUNT];
 
 #if defined(CONFIG_USERSPACE)
 #include <zephyr/app_memory/app_memdomain.h>
@@ -50,6 +189,7 @@ struct config {
 
 	struct {
 		int sock;
+		int mcast_sock;
 		char recv_buffer[MAX_COAP_MSG_LEN];
 		uint32_t counter;
 		atomic_t bytes_received;
@@ -62,21 +202,168 @@ struct configs {
 
 extern struct configs conf;
 
-typedef struct 
+typedef struct
 {
-	int presence;
-	int luminance;
 	struct sensor_value temp;
 	struct sensor_value press;
 	struct sensor_value humidity;
 	int air_quality_index;
+} bme680_data_t;
+
+typedef struct 
+{
+	int presence;
+	int analog[ANALOG_NUM_CHANNELS];
+	bme680_data_t bme680[BME680_NUM_INSTANCES];
 } sensor_data_t;
 
+struct pir_stats {
+	uint32_t edges;		/* edges drained from the ISR ring */
+	uint32_t dropped;	/* edges lost because the ring was full */
+	uint32_t bounces;	/* edges filtered by the debounce */
+	uint32_t edge_rate;	/* edges per minute over the last window */
+};
+
+struct admission_stats {
+	uint32_t admitted;	/* requests passed to the handlers */
+	uint32_t shed_client;	/* client exceeded its rate */
+	uint32_t shed_global;	/* all clients together exceeded the rate */
+	uint32_t shed_busy;	/* pending table was full for a registration */
+	uint32_t dropped;	/* shed non-confirmable requests, not answered */
+	uint32_t evicted;	/* clients pushed out of the table */
+};
+
+struct mcast_stats {
+	uint32_t requests;	/* multicast requests received */
+	uint32_t retries;	/* retransmitted multicast requests ignored */
+	uint32_t delayed;	/* responses sent after the Leisure delay */
+	uint32_t suppressed;	/* error responses not sent */
+	uint32_t overflows;	/* responses lost, no delay slot free */
+	uint32_t avg_delay_ms;
+};
+
+struct server_stats {
+	uint32_t restarts;	 /* starts after the first one */
+	uint32_t bind_ms;	 /* start until the sockets were bound */
+	uint32_t first_request_ms; /* start until the first request was served */
+};
+
+struct stream_stats {
+	uint32_t active;
+	uint32_t packets;	/* NON frames sent */
+	uint32_t frames_sent;	/* samples of all channels */
+	uint32_t frames_dropped; /* ADC ring overflows */
+	uint32_t send_errors;
+};
+
+/* Milestones of the boot timeline, X(ID, description) in the usual order */
+#define BOOT_MILESTONES(X) \
+	X(MAIN, "main") \
+	X(CONFIG, "configuration loaded") \
+	X(FIRST_SAMPLE, "first sample") \
+	X(NETWORK, "network connected") \
+	X(COAP_BOUND, "CoAP sockets bound") \
+	X(FIRST_REQUEST, "first request served") \
+	X(FIRST_NOTIFICATION, "first notification sent")
+
+#define BOOT_MILESTONE_ID(ID, desc) BOOT_##ID,
+
+enum boot_milestone {
+	BOOT_MILESTONES(BOOT_MILESTONE_ID)
+	BOOT_MILESTONE_COUNT
+};
+
+struct config_stats {
+	uint32_t updates;	/* writes that changed at least one value */
+	uint32_t rejected;	/* writes refused by the validation */
+	uint32_t saves;		/* batches written to flash */
+	uint32_t flash_writes;	/* settings entries written or deleted */
+	uint32_t pending;	/* values not yet in flash */
+};
+
+struct power_stats {
+	uint32_t tx_packets;
+	uint32_t gas_measurements;
+	uint32_t windows;		/* fast poll windows after a batch */
+	uint32_t radio_on_ms_per_h;	/* estimated */
+	uint32_t charge_uah_per_h;	/* estimated, radio and BME680 heater */
+};
+
+void coap_init(void);
 void start_coap(void);
 void coap_resource_update(int resource_id);
+void coap_flush_updates(void);
+void coap_get_notification_stats(uint32_t *count, uint32_t *avg_cycles);
+void coap_get_mcast_stats(struct mcast_stats *stats);
+void coap_get_server_stats(struct server_stats *stats);
+int coap_router_benchmark(uint32_t iterations, uint64_t *linear_ns,
+			  uint64_t *router_ns);
+
+struct coap_resource;
+struct coap_option;
+int coap_router_init(struct coap_resource *resources);
+struct coap_resource *coap_router_lookup(const struct coap_option *options,
+					 int num);
+struct coap_resource *coap_router_lookup_linear(struct coap_resource *resources,
+						const struct coap_option *options,
+						int num);
 void stop_coap(void);
 
+struct sockaddr;
+int admission_check(const struct sockaddr *addr, bool saturated,
+		    uint32_t *retry_after);
+void admission_count_dropped(void);
+void admission_get_stats(struct admission_stats *stats);
+
 void get_sensor_data(sensor_data_t *sensor_data);
+int sensor_resource_format(int resource_id, const sensor_data_t *sensor_data,
+			   char *buf, size_t len);
 int sensors_init(void);
+void sensors_reschedule(void);
+bool sensors_have_sample(void);
+
+int pir_init(void);
+int pir_get_presence(void);
+void pir_get_stats(struct pir_stats *stats);
+
+int analog_init(void);
+int analog_read(int16_t *samples);
+int analog_start_continuous(uint32_t interval_us);
+int analog_stop_continuous(void);
+uint32_t analog_get_frames(int16_t *frames, uint32_t max_frames);
+uint32_t analog_get_dropped_frames(void);
+
+/* rate_hz or duration_s 0 selects the default */
+int stream_start(const struct sockaddr *addr, socklen_t addr_len,
+		 const uint8_t *token, uint8_t tkl,
+		 uint32_t rate_hz, uint32_t duration_s);
+void stream_stop(void);
+void stream_stop_sync(void);
+uint32_t stream_remaining(void);
+void stream_get_stats(struct stream_stats *stats);
+
+void power_init(void);
+void power_radio_window(void);
+void power_count_tx(size_t len);
+void power_count_gas_measurement(void);
+void power_get_stats(struct power_stats *stats);
+
+void config_init(void);
+int32_t config_get(enum cfg_param param);
+int config_format(int param, char *buf, size_t len);
+int config_write(const char *data, size_t len);
+int config_write_one(enum cfg_param param, const char *value, size_t len);
+void config_get_stats(struct config_stats *stats);
+
+void stats_reschedule(void);
+
+void occupancy_init(void);
+void occupancy_pir_event(int level);
+void occupancy_get(int *state, int *confidence);
+
+void boot_mark(enum boot_milestone milestone);
+/* Time since boot in microseconds, 0 if the milestone was not reached yet */
+uint32_t boot_get(enum boot_milestone milestone);
+const char *boot_milestone_name(enum boot_milestone milestone);
 
 void quit(void);
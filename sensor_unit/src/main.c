@@ -13,7 +13,10 @@ LOG_MODULE_REGISTER(sensor_unit, LOG_LEVEL_INF);
 #include <zephyr/zephyr.h>
 #include <zephyr/linker/sections.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include <zephyr/shell/shell.h>
+#include <zephyr/settings/settings.h>
 
 #include <zephyr/net/net_core.h>
 #include <zephyr/net/tls_credentials.h>
@@ -42,6 +45,7 @@ static struct net_mgmt_event_callback mgmt_cb;
 static bool connected;
 K_SEM_DEFINE(run_app, 0, 1);
 static bool want_to_quit;
+static bool stop_app;
 
 #if defined(CONFIG_USERSPACE)
 K_APPMEM_PARTITION_DEFINE(app_partition);
@@ -54,6 +58,10 @@ struct k_mem_domain app_domain;
 APP_DMEM struct configs conf = {
 	.ipv6 = {
 		.proto = "IPv6",
+		.coap = {
+			.sock = -1,
+			.mcast_sock = -1,
+		},
 	},
 };
 
@@ -62,6 +70,45 @@ void quit(void)
 	k_sem_give(&quit_lock);
 }
 
+static void stats_log(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(stats_work, stats_log);
+
+/* Counters of the server every /config/stats_s seconds */
+static void stats_log(struct k_work *work)
+{
+	struct admission_stats admission;
+	struct server_stats server;
+	struct power_stats power;
+	uint32_t interval = config_get(CFG_STATS_TIMER);
+
+	if (interval == 0) {
+		return;
+	}
+
+	admission_get_stats(&admission);
+	coap_get_server_stats(&server);
+	power_get_stats(&power);
+
+	LOG_INF("admitted %u, shed %u, restarts %u, packets sent %u",
+		admission.admitted,
+		admission.shed_client + admission.shed_global + admission.shed_busy,
+		server.restarts, power.tx_packets);
+
+	k_work_schedule(&stats_work, K_SECONDS(interval));
+}
+
+void stats_reschedule(void)
+{
+	uint32_t interval = config_get(CFG_STATS_TIMER);
+
+	if (interval == 0) {
+		k_work_cancel_delayable(&stats_work);
+		return;
+	}
+
+	k_work_reschedule(&stats_work, K_SECONDS(interval));
+}
+
 static void event_handler(struct net_mgmt_event_callback *cb,
 			  uint32_t mgmt_event, struct net_if *iface)
 {
@@ -76,6 +123,7 @@ static void event_handler(struct net_mgmt_event_callback *cb,
 
 	if (mgmt_event == NET_EVENT_L4_CONNECTED) {
 		LOG_INF("Network connected");
+		boot_mark(BOOT_NETWORK);
 
 		connected = true;
 		k_sem_give(&run_app);
@@ -89,6 +137,8 @@ static void event_handler(struct net_mgmt_event_callback *cb,
 		} else {
 			LOG_INF("Network disconnected");
 			connected = false;
+			/* Stop the server, it is started again on reconnect */
+			quit();
 		}
 
 		k_sem_reset(&run_app);
@@ -130,6 +180,7 @@ static int cmd_sample_quit(const struct shell *shell,
 			  size_t argc, char *argv[])
 {
 	want_to_quit = true;
+	stop_app = true;
 
 	net_conn_mgr_resend_status();
 
@@ -138,10 +189,211 @@ static int cmd_sample_quit(const struct shell *shell,
 	return 0;
 }
 
+static int cmd_sample_pir(const struct shell *shell,
+			  size_t argc, char *argv[])
+{
+	struct pir_stats stats;
+
+	pir_get_stats(&stats);
+
+	shell_print(shell, "presence:  %d", pir_get_presence());
+	shell_print(shell, "edges:     %u", stats.edges);
+	shell_print(shell, "dropped:   %u", stats.dropped);
+	shell_print(shell, "bounces:   %u", stats.bounces);
+	shell_print(shell, "edge rate: %u/min", stats.edge_rate);
+
+	return 0;
+}
+
+static int cmd_sample_bench_router(const struct shell *shell,
+			  size_t argc, char *argv[])
+{
+	uint32_t iterations = 1000;
+	uint64_t linear_ns, router_ns;
+	char *end;
+	int ret;
+
+	if (argc > 1) {
+		iterations = strtoul(argv[1], &end, 10);
+		if (*end != '\0' || iterations == 0) {
+			shell_error(shell, "Iterations have to be a positive number");
+			return -EINVAL;
+		}
+	}
+
+	ret = coap_router_benchmark(iterations, &linear_ns, &router_ns);
+	if (ret < 0) {
+		shell_error(shell, "Benchmark failed: %d", ret);
+		return ret;
+	}
+
+	shell_print(shell, "linear match: %llu ns/lookup", linear_ns);
+	shell_print(shell, "hash router:  %llu ns/lookup", router_ns);
+
+	return 0;
+}
+
+static int cmd_sample_notify_stats(const struct shell *shell,
+			  size_t argc, char *argv[])
+{
+	uint32_t count, avg_cycles;
+
+	coap_get_notification_stats(&count, &avg_cycles);
+
+	shell_print(shell, "notifications: %u", count);
+	shell_print(shell, "cycles/notification: %u (%u ns)", avg_cycles,
+		    (uint32_t)k_cyc_to_ns_floor64(avg_cycles));
+
+	return 0;
+}
+
+static int cmd_sample_admission(const struct shell *shell,
+			  size_t argc, char *argv[])
+{
+	struct admission_stats stats;
+
+	admission_get_stats(&stats);
+
+	shell_print(shell, "admitted:    %u", stats.admitted);
+	shell_print(shell, "shed client: %u", stats.shed_client);
+	shell_print(shell, "shed global: %u", stats.shed_global);
+	shell_print(shell, "shed busy:   %u", stats.shed_busy);
+	shell_print(shell, "dropped:     %u", stats.dropped);
+	shell_print(shell, "evicted:     %u", stats.evicted);
+
+	return 0;
+}
+
+static int cmd_sample_mcast(const struct shell *shell,
+			  size_t argc, char *argv[])
+{
+	struct mcast_stats stats;
+
+	coap_get_mcast_stats(&stats);
+
+	shell_print(shell, "requests:   %u", stats.requests);
+	shell_print(shell, "retries:    %u", stats.retries);
+	shell_print(shell, "delayed:    %u (avg %u ms)", stats.delayed,
+		    stats.avg_delay_ms);
+	shell_print(shell, "suppressed: %u", stats.suppressed);
+	shell_print(shell, "overflows:  %u", stats.overflows);
+
+	return 0;
+}
+
+static int cmd_sample_server(const struct shell *shell,
+			  size_t argc, char *argv[])
+{
+	struct server_stats stats;
+
+	coap_get_server_stats(&stats);
+
+	shell_print(shell, "restarts:      %u", stats.restarts);
+	shell_print(shell, "bind:          %u ms", stats.bind_ms);
+	shell_print(shell, "first request: %u ms", stats.first_request_ms);
+
+	return 0;
+}
+
+static int cmd_sample_power(const struct shell *shell,
+			  size_t argc, char *argv[])
+{
+	struct power_stats stats;
+
+	power_get_stats(&stats);
+
+	shell_print(shell, "profile:          %s",
+		    LOW_POWER_PROFILE ? "sleepy end device" : "router");
+	shell_print(shell, "packets sent:     %u", stats.tx_packets);
+	shell_print(shell, "gas measurements: %u", stats.gas_measurements);
+	shell_print(shell, "radio windows:    %u", stats.windows);
+	shell_print(shell, "radio on:         %u ms/h (estimated)",
+		    stats.radio_on_ms_per_h);
+	shell_print(shell, "charge:           %u uAh/h (estimated)",
+		    stats.charge_uah_per_h);
+
+	return 0;
+}
+
+static int cmd_sample_config(const struct shell *shell,
+			  size_t argc, char *argv[])
+{
+	struct config_stats stats;
+	char values[256];
+	int r;
+
+	if (argc > 1) {
+		r = config_write(argv[1], strlen(argv[1]));
+		if (r < 0) {
+			shell_error(shell, "Invalid configuration (%d)", r);
+			return r;
+		}
+	}
+
+	config_format(-1, values, sizeof(values));
+	config_get_stats(&stats);
+
+	shell_fprintf(shell, SHELL_NORMAL, "%s", values);
+	shell_print(shell, "updates:      %u", stats.updates);
+	shell_print(shell, "rejected:     %u", stats.rejected);
+	shell_print(shell, "saves:        %u", stats.saves);
+	shell_print(shell, "flash writes: %u", stats.flash_writes);
+	shell_print(shell, "pending:      %u", stats.pending);
+
+	return 0;
+}
+
+static int cmd_sample_boot(const struct shell *shell,
+			  size_t argc, char *argv[])
+{
+	for (int i = 0; i < BOOT_MILESTONE_COUNT; i++) {
+		uint32_t us = boot_get(i);
+
+		if (us == 0) {
+			shell_print(shell, "%-24s -", boot_milestone_name(i));
+			continue;
+		}
+
+		shell_print(shell, "%-24s %u.%03u ms", boot_milestone_name(i),
+			    us / USEC_PER_MSEC, us % USEC_PER_MSEC);
+	}
+
+	return 0;
+}
+
 SHELL_STATIC_SUBCMD_SET_CREATE(sample_commands,
 	SHELL_CMD(quit, NULL,
 		  "Quit the sample application\n",
 		  cmd_sample_quit),
+	SHELL_CMD(pir, NULL,
+		  "Show PIR edge statistics\n",
+		  cmd_sample_pir),
+	SHELL_CMD_ARG(bench_router, NULL,
+		  "Compare linear and hashed URI path lookup\n"
+		  "bench_router [iterations]",
+		  cmd_sample_bench_router, 1, 1),
+	SHELL_CMD(notify_stats, NULL,
+		  "Show the cost of sending notifications\n",
+		  cmd_sample_notify_stats),
+	SHELL_CMD(admission, NULL,
+		  "Show rate limiting and load shedding counters\n",
+		  cmd_sample_admission),
+	SHELL_CMD(mcast, NULL,
+		  "Show multicast Leisure and suppression counters\n",
+		  cmd_sample_mcast),
+	SHELL_CMD(server, NULL,
+		  "Show CoAP server restarts and time to first request\n",
+		  cmd_sample_server),
+	SHELL_CMD(power, NULL,
+		  "Show estimated radio-on time and charge per hour\n",
+		  cmd_sample_power),
+	SHELL_CMD_ARG(config, NULL,
+		  "Show or change the runtime configuration\n"
+		  "config [name=value;...]",
+		  cmd_sample_config, 1, 1),
+	SHELL_CMD(boot, NULL,
+		  "Show the boot timeline\n",
+		  cmd_sample_boot),
 	SHELL_SUBCMD_SET_END
 );
 
@@ -150,6 +402,8 @@ SHELL_CMD_REGISTER(sample, &sample_commands,
 
 void main(void)
 {
+	boot_mark(BOOT_MAIN);
+
 	init_app();
 
 	if (!IS_ENABLED(CONFIG_NET_CONNECTION_MANAGER)) {
@@ -160,21 +414,48 @@ void main(void)
 		k_sem_give(&run_app);
 	}
 	
+	/* Sampling starts right away with the default configuration, so the
+	 * first sample is cached while the settings load and the network joins
+	 */
 	sensors_init();
-	
-	/* Wait for the connection. */
-	k_sem_take(&run_app, K_FOREVER);
 
-	LOG_INF("Starting...");
+	if (IS_ENABLED(CONFIG_SETTINGS) && settings_subsys_init() < 0) {
+		LOG_ERR("Settings could not be initialized");
+	}
 
-	start_coap();
+	config_init();
+	boot_mark(BOOT_CONFIG);
+	stats_reschedule();
+	power_init();
+	/* Only binding the sockets waits for the network */
+	coap_init();
 	
-	k_sem_take(&quit_lock, K_FOREVER);
+	while (!stop_app) {
+		/* Wait for the connection. */
+		k_sem_take(&run_app, K_FOREVER);
+		if (stop_app) {
+			break;
+		}
+
+		LOG_INF("Starting...");
+
+		k_sem_reset(&quit_lock);
+		start_coap();
+
+		/* Disconnect, server error or quit command */
+		k_sem_take(&quit_lock, K_FOREVER);
 
-	if (connected) {
 		LOG_INF("Stopping...");
 		if (IS_ENABLED(CONFIG_NET_UDP)) {
 			stop_coap();
 		}
+
+		/* The server failed while the network is still up, restart
+		 * after a short pause so a persistent error does not spin
+		 */
+		if (connected && !stop_app) {
+			k_sleep(K_MSEC(100));
+			k_sem_give(&run_app);
+		}
 	}
 }
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/util.h>
+#include <stdlib.h>
+
+#include "common.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(occupancy, LOG_LEVEL_DBG);
+
+//--------------------------------------------------------
+// Estimator parameters
+//--------------------------------------------------------
+
+/* Motion events are counted in a sliding window made of buckets */
+#ifndef OCCUPANCY_BUCKET_MS
+	#define OCCUPANCY_BUCKET_MS (30 * MSEC_PER_SEC)
+#endif
+
+#ifndef OCCUPANCY_NUM_BUCKETS
+	#define OCCUPANCY_NUM_BUCKETS 10
+#endif
+
+/* Events within the window needed to declare the room occupied */
+#ifndef OCCUPANCY_ENTER_EVENTS
+	#define OCCUPANCY_ENTER_EVENTS 2
+#endif
+
+/* Time without any event before the room is declared vacant */
+#ifndef OCCUPANCY_HOLD_MS
+	#define OCCUPANCY_HOLD_MS (10 * 60 * MSEC_PER_SEC)
+#endif
+
+/* Confidence change (percent) that notifies observers without a state change */
+#ifndef OCCUPANCY_CONFIDENCE_STEP
+	#define OCCUPANCY_CONFIDENCE_STEP 10
+#endif
+
+//--------------------------------------------------------
+// Static helper functions
+//--------------------------------------------------------
+
+static void occupancy_tick(struct k_work *work);
+static void occupancy_evaluate(uint32_t now);
+
+//--------------------------------------------------------
+// Runtime Variables
+//--------------------------------------------------------
+
+/* All state is only touched from the system work queue (PIR edge handler and
+ * the bucket tick), so no locking is required
+ */
+static uint16_t buckets[OCCUPANCY_NUM_BUCKETS];
+static uint8_t current_bucket;
+static uint32_t window_events;
+static uint32_t last_event;
+static bool has_event;
+static int notified_confidence;
+
+static atomic_t occupancy_state;
+static atomic_t occupancy_confidence;
+
+static K_WORK_DELAYABLE_DEFINE(tick_work, occupancy_tick);
+
+//--------------------------------------------------------
+// Function Implementations
+//--------------------------------------------------------
+
+void occupancy_init(void)
+{
+	/* Nothing has been seen yet. This is what occupancy_evaluate() gives for
+	 * an empty window, so the first tick does not change the confidence.
+	 */
+	atomic_set(&occupancy_state, 0);
+	atomic_set(&occupancy_confidence, 100);
+	notified_confidence = 100;
+
+	k_work_schedule(&tick_work, K_MSEC(OCCUPANCY_BUCKET_MS));
+}
+
+void occupancy_pir_event(int level)
+{
+	uint32_t now = k_uptime_get_32();
+
+	/* Only rising edges count as motion events */
+	if (level == 0) {
+		return;
+	}
+
+	buckets[current_bucket]++;
+	window_events++;
+	last_event = now;
+	has_event = true;
+
+	occupancy_evaluate(now);
+}
+
+static void occupancy_tick(struct k_work *work)
+{
+	current_bucket = (current_bucket + 1) % OCCUPANCY_NUM_BUCKETS;
+	window_events -= buckets[current_bucket];
+	buckets[current_bucket] = 0;
+
+	occupancy_evaluate(k_uptime_get_32());
+
+	k_work_schedule(&tick_work, K_MSEC(OCCUPANCY_BUCKET_MS));
+}
+
+static void occupancy_evaluate(uint32_t now)
+{
+	int state = atomic_get(&occupancy_state);
+	uint32_t idle = now - last_event;
+	int confidence;
+
+	if (state == 0) {
+		if (window_events >= OCCUPANCY_ENTER_EVENTS) {
+			state = 1;
+		}
+	} else if (!has_event || idle >= OCCUPANCY_HOLD_MS) {
+		state = 0;
+	}
+
+	if (state == 1) {
+		if (window_events > 0) {
+			// grows with the activity in the window
+			confidence = 50 + 25 * window_events / OCCUPANCY_ENTER_EVENTS;
+		} else {
+			// decays while the hold-off timer runs down
+			confidence = 50 * (OCCUPANCY_HOLD_MS - idle) / OCCUPANCY_HOLD_MS;
+		}
+	} else {
+		confidence = 100 - 50 * window_events / OCCUPANCY_ENTER_EVENTS;
+	}
+	confidence = CLAMP(confidence, 0, 100);
+
+	atomic_set(&occupancy_confidence, confidence);
+
+	if (state != atomic_get(&occupancy_state)) {
+		atomic_set(&occupancy_state, state);
+		LOG_INF("Occupancy changed: %d (confidence %d%%, %u events)",
+			state, confidence, window_events);
+	} else if (abs(confidence - notified_confidence) < OCCUPANCY_CONFIDENCE_STEP) {
+		return;
+	}
+
+	// The payload carries the confidence, so larger changes are published too
+	notified_confidence = confidence;
+	coap_resource_update(COAP_RESOURCE_OCCUPANCY);
+}
+
+void occupancy_get(int *state, int *confidence)
+{
+	*state = atomic_get(&occupancy_state);
+	*confidence = atomic_get(&occupancy_confidence);
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2016 Open-RnD Sp. z o.o.
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/util.h>
+
+#include "common.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(pir, LOG_LEVEL_DBG);
+
+//--------------------------------------------------------
+// Alias definitions
+//--------------------------------------------------------
+/*
+ * Get pir_sensor configuration from the devicetree pir0 alias. This is mandatory.
+ */
+#define PIR0_NODE	DT_ALIAS(pir0)
+#if !DT_NODE_HAS_STATUS(PIR0_NODE, okay)
+#error "Unsupported board: pir0 devicetree alias is not defined"
+#endif
+static const struct gpio_dt_spec pir_sensor = GPIO_DT_SPEC_GET_OR(PIR0_NODE, gpios,
+							      {0});
+static struct gpio_callback pir_cb_data;
+
+/* Number of edges the ISR can queue before the consumer drains them,
+ * has to be a power of two
+ */
+#define PIR_EDGE_RING_SIZE 32
+BUILD_ASSERT((PIR_EDGE_RING_SIZE & (PIR_EDGE_RING_SIZE - 1)) == 0,
+	     "PIR_EDGE_RING_SIZE has to be a power of two");
+
+/* Level has to be stable for this long before it is published */
+#ifndef PIR_DEBOUNCE_MS
+	#define PIR_DEBOUNCE_MS 50
+#endif
+
+/* Window over which the edge rate is calculated */
+#define PIR_RATE_WINDOW_MS (60 * MSEC_PER_SEC)
+
+//--------------------------------------------------------
+// Static helper functions
+//--------------------------------------------------------
+
+static void pir_changed(const struct device *dev, struct gpio_callback *cb,
+			uint32_t pins);
+static void pir_process_edges(struct k_work *work);
+
+//--------------------------------------------------------
+// Runtime Variables
+//--------------------------------------------------------
+
+struct pir_edge {
+	uint32_t timestamp;
+	uint8_t level;
+};
+
+/* Single producer (ISR) / single consumer (work item) ring, the indices are
+ * free running and only masked on access
+ */
+static struct pir_edge edge_ring[PIR_EDGE_RING_SIZE];
+static atomic_t edge_head;
+static atomic_t edge_tail;
+static atomic_t edges_dropped;
+
+static K_WORK_DELAYABLE_DEFINE(pir_work, pir_process_edges);
+
+static atomic_t presence_state;
+static struct pir_stats stats;
+static uint32_t rate_window_start;
+static uint32_t rate_window_edges;
+
+//--------------------------------------------------------
+// Function Implementations
+//--------------------------------------------------------
+
+/* Runs in interrupt context: only record the edge and (re)arm the debounce
+ * timer, the I2C transfers of the sampling thread are not disturbed
+ */
+static void pir_changed(const struct device *dev, struct gpio_callback *cb,
+			uint32_t pins)
+{
+	atomic_val_t head = atomic_get(&edge_head);
+
+	if (head - atomic_get(&edge_tail) >= PIR_EDGE_RING_SIZE) {
+		atomic_inc(&edges_dropped);
+	} else {
+		struct pir_edge *edge = &edge_ring[head & (PIR_EDGE_RING_SIZE - 1)];
+
+		edge->timestamp = k_uptime_get_32();
+		edge->level = gpio_pin_get_dt(&pir_sensor);
+		atomic_set(&edge_head, head + 1);
+	}
+
+	k_work_reschedule(&pir_work, K_MSEC(PIR_DEBOUNCE_MS));
+}
+
+static void pir_process_edges(struct k_work *work)
+{
+	atomic_val_t tail = atomic_get(&edge_tail);
+	atomic_val_t head = atomic_get(&edge_head);
+	uint32_t now = k_uptime_get_32();
+	uint32_t drained = 0;
+	int level;
+
+	while (tail != head) {
+		struct pir_edge *edge = &edge_ring[tail & (PIR_EDGE_RING_SIZE - 1)];
+
+		LOG_DBG("PIR edge: level %d at %u ms", edge->level, edge->timestamp);
+		drained++;
+		tail++;
+	}
+	atomic_set(&edge_tail, tail);
+
+	/* The debounce timer expired, so the pin is stable now */
+	level = gpio_pin_get_dt(&pir_sensor);
+
+	stats.edges += drained;
+	stats.dropped = atomic_get(&edges_dropped);
+
+	if ((int)atomic_get(&presence_state) != level) {
+		stats.bounces += drained > 0 ? drained - 1 : 0;
+		atomic_set(&presence_state, level);
+		LOG_INF("Presence changed: %d", level);
+		coap_resource_update(COAP_RESOURCE_PRESSENCE);
+		occupancy_pir_event(level);
+	} else {
+		stats.bounces += drained;
+	}
+
+	rate_window_edges += drained;
+	if (now - rate_window_start >= PIR_RATE_WINDOW_MS) {
+		stats.edge_rate = rate_window_edges * PIR_RATE_WINDOW_MS /
+				  (now - rate_window_start);
+		rate_window_start = now;
+		rate_window_edges = 0;
+	}
+}
+
+int pir_get_presence(void)
+{
+	return atomic_get(&presence_state);
+}
+
+void pir_get_stats(struct pir_stats *pir_stats)
+{
+	*pir_stats = stats;
+	pir_stats->dropped = atomic_get(&edges_dropped);
+}
+
+int pir_init(void)
+{
+	int ret=device_is_ready(pir_sensor.port);
+
+	if (!ret) {
+		LOG_ERR("Error: pir_sensor device %s is not ready\n",
+		       pir_sensor.port->name);
+		return -ENODEV;
+	}
+
+	ret = gpio_pin_configure_dt(&pir_sensor, GPIO_INPUT);
+	if (ret != 0) {
+		LOG_ERR("Error %d: failed to configure %s pin %d\n",
+		       ret, pir_sensor.port->name, pir_sensor.pin);
+		return ret;
+	}
+
+	atomic_set(&presence_state, gpio_pin_get_dt(&pir_sensor));
+	rate_window_start = k_uptime_get_32();
+
+	gpio_init_callback(&pir_cb_data, pir_changed, BIT(pir_sensor.pin));
+	gpio_add_callback(pir_sensor.port, &pir_cb_data);
+
+	ret = gpio_pin_interrupt_configure_dt(&pir_sensor,
+					      GPIO_INT_EDGE_BOTH);
+	if (ret != 0) {
+		LOG_ERR("Error %d: failed to configure interrupt on %s pin %d\n",
+			ret, pir_sensor.port->name, pir_sensor.pin);
+		return ret;
+	}
+
+	LOG_INF("Set up pir_sensor at %s pin %d\n", pir_sensor.port->name, pir_sensor.pin);
+
+	return 0;
+}
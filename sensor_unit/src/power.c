@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/util.h>
+
+#if defined(CONFIG_OPENTHREAD_MTD_SED)
+#include <zephyr/net/openthread.h>
+#include <openthread/link.h>
+#endif
+
+#include "common.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(power, LOG_LEVEL_INF);
+
+//--------------------------------------------------------
+// Power model
+//--------------------------------------------------------
+
+/* Poll period while notifications may be acknowledged, the parent forwards
+ * the ACKs of a batch before the retransmission timeout expires
+ */
+#ifndef POWER_FAST_POLL_MS
+	#define POWER_FAST_POLL_MS 250
+#endif
+
+#ifndef POWER_WINDOW_MS
+	#define POWER_WINDOW_MS 2000
+#endif
+
+/* Outside of the windows the parent is polled once per sample period */
+#define POWER_SLOW_POLL_MS config_get(CFG_SAMPLE_PERIOD_MS)
+
+/* Estimates for the nRF52840 at 0 dBm and the BME680 with its default heater
+ * profile, only used for the energy report
+ */
+#define RADIO_CURRENT_UA	6500
+#define POLL_RADIO_US		2500	/* data request, ACK and empty frame */
+#define PACKET_RADIO_US		2000	/* CSMA backoff and ACK turnaround */
+#define BYTE_RADIO_US		32	/* 250 kbit/s */
+#define BME680_GAS_CURRENT_UA	12000
+#define BME680_GAS_MS		150
+
+//--------------------------------------------------------
+// Static helper functions
+//--------------------------------------------------------
+
+static void window_close(struct k_work *work);
+
+//--------------------------------------------------------
+// Runtime Variables
+//--------------------------------------------------------
+
+static uint32_t start_time;
+static atomic_t tx_packets;
+static atomic_t tx_bytes;
+static atomic_t gas_measurements;
+static atomic_t windows;
+
+static K_WORK_DELAYABLE_DEFINE(window_work, window_close);
+
+//--------------------------------------------------------
+// Function Implementations
+//--------------------------------------------------------
+
+#if defined(CONFIG_OPENTHREAD_MTD_SED)
+static void set_poll_period(uint32_t period_ms)
+{
+	struct openthread_context *ot = openthread_get_default_context();
+	otError err;
+
+	if (!ot) {
+		return;
+	}
+
+	openthread_api_mutex_lock(ot);
+	err = otLinkSetPollPeriod(ot->instance, period_ms);
+	openthread_api_mutex_unlock(ot);
+
+	if (err != OT_ERROR_NONE) {
+		LOG_ERR("Failed to set poll period %u ms: %d", period_ms, err);
+	}
+}
+#else
+static void set_poll_period(uint32_t period_ms)
+{
+	ARG_UNUSED(period_ms);
+}
+#endif
+
+void power_init(void)
+{
+	start_time = k_uptime_get_32();
+
+	/* The parent is polled when the next batch of notifications is due */
+	set_poll_period(POWER_SLOW_POLL_MS);
+}
+
+/* Called after a batch of notifications was sent */
+void power_radio_window(void)
+{
+	atomic_inc(&windows);
+
+	set_poll_period(POWER_FAST_POLL_MS);
+	k_work_reschedule(&window_work, K_MSEC(POWER_WINDOW_MS));
+}
+
+static void window_close(struct k_work *work)
+{
+	set_poll_period(POWER_SLOW_POLL_MS);
+}
+
+void power_count_tx(size_t len)
+{
+	atomic_inc(&tx_packets);
+	atomic_add(&tx_bytes, len);
+}
+
+void power_count_gas_measurement(void)
+{
+	atomic_inc(&gas_measurements);
+}
+
+void power_get_stats(struct power_stats *stats)
+{
+	uint32_t elapsed = MAX(1, k_uptime_get_32() - start_time);
+	uint64_t radio_us;
+	uint64_t charge;
+
+	if (LOW_POWER_PROFILE) {
+		uint32_t window_ms = MIN(elapsed, atomic_get(&windows) * POWER_WINDOW_MS);
+		uint64_t polls = (elapsed - window_ms) / POWER_SLOW_POLL_MS +
+				 window_ms / POWER_FAST_POLL_MS;
+
+		radio_us = polls * POLL_RADIO_US +
+			   (uint64_t)atomic_get(&tx_packets) * PACKET_RADIO_US +
+			   (uint64_t)atomic_get(&tx_bytes) * BYTE_RADIO_US;
+	} else {
+		/* A router keeps its receiver on all the time */
+		radio_us = (uint64_t)elapsed * USEC_PER_MSEC;
+	}
+
+	/* Charge in uA * ms, divided by the elapsed time it is the average
+	 * current, which equals the charge per hour in uAh
+	 */
+	charge = radio_us * RADIO_CURRENT_UA / USEC_PER_MSEC +
+		 (uint64_t)atomic_get(&gas_measurements) * BME680_GAS_MS *
+		 BME680_GAS_CURRENT_UA;
+
+	stats->tx_packets = atomic_get(&tx_packets);
+	stats->gas_measurements = atomic_get(&gas_measurements);
+	stats->windows = atomic_get(&windows);
+	stats->radio_on_ms_per_h = radio_us * 3600 / elapsed;
+	stats->charge_uah_per_h = charge / elapsed;
+}
@@ -0,0 +1,151 @@
+/* router.c - Hash based URI path dispatch for the CoAP server */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(router, LOG_LEVEL_INF);
+
+#include <zephyr/zephyr.h>
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/net/coap.h>
+
+#include "common.h"
+
+/* Open addressing table, kept at most half full */
+#define ROUTER_TABLE_SIZE 64
+BUILD_ASSERT((ROUTER_TABLE_SIZE & (ROUTER_TABLE_SIZE - 1)) == 0,
+	     "ROUTER_TABLE_SIZE has to be a power of two");
+BUILD_ASSERT(2 * COAP_RESOURCE_COUNT <= ROUTER_TABLE_SIZE,
+	     "ROUTER_TABLE_SIZE too small for the resource table");
+
+#define FNV_OFFSET_BASIS 2166136261U
+#define FNV_PRIME 16777619U
+
+struct route {
+	uint32_t hash;
+	struct coap_resource *resource;
+};
+
+static struct route routes[ROUTER_TABLE_SIZE];
+
+//--------------------------------------------------------
+// Hashing
+//--------------------------------------------------------
+
+/* FNV-1a over all segments, every segment is terminated by '/' so that
+ * "a/bc" and "ab/c" hash differently
+ */
+static uint32_t hash_segment(uint32_t hash, const uint8_t *segment, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ segment[i]) * FNV_PRIME;
+	}
+
+	return (hash ^ '/') * FNV_PRIME;
+}
+
+static uint32_t hash_path(const char * const *path)
+{
+	uint32_t hash = FNV_OFFSET_BASIS;
+
+	for (; path && *path; path++) {
+		hash = hash_segment(hash, (const uint8_t *)*path, strlen(*path));
+	}
+
+	return hash;
+}
+
+static uint32_t hash_options(const struct coap_option *options, int num)
+{
+	uint32_t hash = FNV_OFFSET_BASIS;
+
+	for (int i = 0; i < num; i++) {
+		hash = hash_segment(hash, options[i].value, options[i].len);
+	}
+
+	return hash;
+}
+
+/* Only the candidate found through the hash is compared segment by segment */
+static bool path_matches(const char * const *path,
+			 const struct coap_option *options, int num)
+{
+	int i;
+
+	for (i = 0; i < num && path[i]; i++) {
+		if (options[i].len != strlen(path[i]) ||
+		    memcmp(options[i].value, path[i], options[i].len) != 0) {
+			return false;
+		}
+	}
+
+	return i == num && path[i] == NULL;
+}
+
+//--------------------------------------------------------
+// Router
+//--------------------------------------------------------
+
+int coap_router_init(struct coap_resource *resources)
+{
+	struct coap_resource *r;
+
+	memset(routes, 0, sizeof(routes));
+
+	for (r = resources; r && r->path; r++) {
+		uint32_t hash = hash_path(r->path);
+		uint32_t slot = hash & (ROUTER_TABLE_SIZE - 1);
+
+		while (routes[slot].resource) {
+			if (routes[slot].hash == hash) {
+				LOG_WRN("Hash collision for resource %d",
+					(int)(r - resources));
+			}
+			slot = (slot + 1) & (ROUTER_TABLE_SIZE - 1);
+		}
+
+		routes[slot].hash = hash;
+		routes[slot].resource = r;
+	}
+
+	return 0;
+}
+
+struct coap_resource *coap_router_lookup(const struct coap_option *options,
+					 int num)
+{
+	uint32_t hash = hash_options(options, num);
+	uint32_t slot = hash & (ROUTER_TABLE_SIZE - 1);
+
+	while (routes[slot].resource) {
+		if (routes[slot].hash == hash &&
+		    path_matches(routes[slot].resource->path, options, num)) {
+			return routes[slot].resource;
+		}
+		slot = (slot + 1) & (ROUTER_TABLE_SIZE - 1);
+	}
+
+	return NULL;
+}
+
+/* Same matching as coap_handle_request does, kept for the benchmark */
+struct coap_resource *coap_router_lookup_linear(struct coap_resource *resources,
+						const struct coap_option *options,
+						int num)
+{
+	struct coap_resource *r;
+
+	for (r = resources; r && r->path; r++) {
+		if (path_matches(r->path, options, num)) {
+			return r;
+		}
+	}
+
+	return NULL;
+}
@@ -9,13 +9,13 @@
 #include <zephyr/device.h>
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/drivers/sensor.h>
-#include <zephyr/drivers/adc.h>
 
 #include <zephyr/sys/util.h>
 #include <zephyr/sys/printk.h>
 #include <inttypes.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 #include "common.h"
 
@@ -25,57 +25,15 @@ LOG_MODULE_REGISTER(sensors, LOG_LEVEL_DBG);
 //--------------------------------------------------------
 // Alias definitions 
 //--------------------------------------------------------
-/*
- * Get pir_sensor configuration from the devicetree sw0 alias. This is mandatory.
- */
-#define PIR0_NODE	DT_ALIAS(pir0)
-#if !DT_NODE_HAS_STATUS(PIR0_NODE, okay)
-#error "Unsupported board: sw0 devicetree alias is not defined"
-#endif
-static const struct gpio_dt_spec pir_sensor = GPIO_DT_SPEC_GET_OR(PIR0_NODE, gpios,
-							      {0});
-static struct gpio_callback button_cb_data;
-
-
-#if !DT_NODE_EXISTS(DT_PATH(zephyr_user)) || \
-	!DT_NODE_HAS_PROP(DT_PATH(zephyr_user), io_channels)
-#error "No suitable devicetree overlay specified"
-#endif
-
-#define ADC_NUM_CHANNELS	DT_PROP_LEN(DT_PATH(zephyr_user), io_channels)
-
-#if ADC_NUM_CHANNELS > 2
-#error "Currently only 1 or 2 channels supported"
-#endif
-
-#if ADC_NUM_CHANNELS == 2 && !DT_SAME_NODE( \
-	DT_PHANDLE_BY_IDX(DT_PATH(zephyr_user), io_channels, 0), \
-	DT_PHANDLE_BY_IDX(DT_PATH(zephyr_user), io_channels, 1))
-#error "Channels have to use the same ADC."
-#endif
-
-#define ADC_NODE		DT_PHANDLE(DT_PATH(zephyr_user), io_channels)
 
-/* Common settings supported by most ADCs */
-#define ADC_RESOLUTION		12
-#define ADC_GAIN		ADC_GAIN_1
-#define ADC_REFERENCE		ADC_REF_INTERNAL
-#define ADC_ACQUISITION_TIME	ADC_ACQ_TIME_DEFAULT
-
-#ifdef CONFIG_ADC_NRFX_SAADC
-#define ADC_INPUT_POS_OFFSET SAADC_CH_PSELP_PSELP_AnalogInput0
-#else
-#define ADC_INPUT_POS_OFFSET 0
-#endif
+#define BME680_DEVICE(node_id) DEVICE_DT_GET(node_id),
 
 //--------------------------------------------------------
 // Static helper functions 
 //--------------------------------------------------------
 
-int get_luminance_value(uint8_t channel);
-int pir_init(void);
-int get_pir_value(void);
-void bme680_get_sensor_data(sensor_data_t *sensor_data);
+int get_analog_value(uint8_t channel, int16_t raw_value);
+void bme680_get_sensor_data(const struct device *dev, bme680_data_t *bme680_data);
 static void query_sensor_data(void);
 void notify_observers(void);
 
@@ -85,34 +43,26 @@ void notify_observers(void);
 
 static uint8_t current_id=0; 
 static uint8_t last_id=1;
+static atomic_t sample_count;
 static sensor_data_t gathered_sensor_data[2];
+static int32_t notified_values[COAP_SENSOR_RESOURCE_COUNT];
 
-/* Get the numbers of up to two channels */
-static uint8_t channel_ids[ADC_NUM_CHANNELS] = {
-	DT_IO_CHANNELS_INPUT_BY_IDX(DT_PATH(zephyr_user), 0),
-#if ADC_NUM_CHANNELS == 2
-	DT_IO_CHANNELS_INPUT_BY_IDX(DT_PATH(zephyr_user), 1)
-#endif
-};
+static int16_t analog_samples[ANALOG_NUM_CHANNELS];
 
-static int16_t sample_buffer[ADC_NUM_CHANNELS];
+static const struct device *const bme680_devs[BME680_NUM_INSTANCES] = {
+	DT_FOREACH_STATUS_OKAY(bosch_bme680, BME680_DEVICE)
+};
 
-struct adc_channel_cfg channel_cfg = {
-	.gain = ADC_GAIN,
-	.reference = ADC_REFERENCE,
-	.acquisition_time = ADC_ACQUISITION_TIME,
-	/* channel ID will be overwritten below */
-	.channel_id = 0,
-	.differential = 0
+#define ANALOG_FULL_SCALE_ENTRY(idx, _) ANALOG_CHANNEL_FULL_SCALE(idx)
+static const uint16_t analog_full_scale[ANALOG_NUM_CHANNELS] = {
+	LISTIFY(ANALOG_NUM_CHANNELS, ANALOG_FULL_SCALE_ENTRY, (,), _)
 };
 
-struct adc_sequence sequence = {
-	/* individual channels will be added below */
-	.channels    = 0,
-	.buffer      = sample_buffer,
-	/* buffer size in bytes, not number of samples */
-	.buffer_size = sizeof(sample_buffer),
-	.resolution  = ADC_RESOLUTION,
+#define SENSOR_RESOURCE_DESC(ID, _kind, idx, path) \
+	[COAP_RESOURCE_##ID##_##idx] = { .kind = _kind, .index = idx },
+
+const struct sensor_resource sensor_resources[COAP_SENSOR_RESOURCE_COUNT] = {
+	SENSOR_RESOURCES(SENSOR_RESOURCE_DESC)
 };
 
 // Thread definitions to query the sensor data
@@ -133,7 +83,15 @@ int sensors_init(void)
 		return ret;
 	}
 
+	ret = analog_init();
+	if(ret < 0)
+	{
+		return ret;
+	}
+
 	LOG_DBG("pir_init done");
+
+	occupancy_init();
 #if defined(CONFIG_USERSPACE)
 		k_mem_domain_add_thread(&app_domain, sensor_thread_id);	
 #endif
@@ -153,157 +111,190 @@ static void query_sensor_data(void)
 		current_id = last_id;
 		last_id=temp_id;
 
-		// The interrupt for the PIR Sensor needs to be disabled, otherwise the 
-		// I2C throws an error
-		int ret = gpio_pin_interrupt_configure_dt(&pir_sensor,
-					      GPIO_INT_DISABLE);
-		if (ret != 0) {
-			LOG_ERR("Error %d: failed to disable interrupt on %s pin %d\n",
-				ret, pir_sensor.port->name, pir_sensor.pin);
-			return;
-		}
+		sensor_data_t *data = &gathered_sensor_data[current_id];
 
-		gathered_sensor_data[current_id].luminance = get_luminance_value(0);
-		gathered_sensor_data[current_id].presence =  get_pir_value();
-		bme680_get_sensor_data(&gathered_sensor_data[current_id]);
-		
-		LOG_DBG("lux:%i;pir:%i;T:%d.%06d;P:%d.%06d;H:%d.%06d;AQI:%d\n",
-				gathered_sensor_data[current_id].luminance, gathered_sensor_data[current_id].presence,
-				gathered_sensor_data[current_id].temp.val1, gathered_sensor_data[current_id].temp.val2, 
-				gathered_sensor_data[current_id].press.val1, gathered_sensor_data[current_id].press.val2,
-				gathered_sensor_data[current_id].humidity.val1, gathered_sensor_data[current_id].humidity.val2, 
-				gathered_sensor_data[current_id].air_quality_index);
-		
-		ret = gpio_pin_interrupt_configure_dt(&pir_sensor,
-					      GPIO_INT_EDGE_BOTH);
-		if (ret != 0) {
-			LOG_ERR("Error %d: failed to enable interrupt on %s pin %d\n",
-				ret, pir_sensor.port->name, pir_sensor.pin);
-			return;
+		// all analog channels are converted in a single sequence
+		if(analog_read(analog_samples) == 0)
+		{
+			for(int i = 0; i < ANALOG_NUM_CHANNELS; i++)
+			{
+				data->analog[i] = get_analog_value(i, analog_samples[i]);
+			}
+		}
+		// PIR edges are captured by the PIR ISR, the interrupt can stay
+		// enabled during the I2C transfers
+		data->presence =  pir_get_presence();
+
+		for(int i = 0; i < BME680_NUM_INSTANCES; i++)
+		{
+			if(atomic_get(&sample_count) % config_get(CFG_GAS_EVERY) != 0)
+			{
+				data->bme680[i] = gathered_sensor_data[last_id].bme680[i];
+				continue;
+			}
+
+			bme680_get_sensor_data(bme680_devs[i], &data->bme680[i]);
+			power_count_gas_measurement();
+
+			LOG_DBG("BME680 %d: T:%d.%06d;P:%d.%06d;H:%d.%06d;AQI:%d\n", i,
+					data->bme680[i].temp.val1, data->bme680[i].temp.val2,
+					data->bme680[i].press.val1, data->bme680[i].press.val2,
+					data->bme680[i].humidity.val1, data->bme680[i].humidity.val2,
+					data->bme680[i].air_quality_index);
 		}
+		LOG_DBG("lux:%i;pir:%i\n", data->analog[LUMINANCE_CHANNEL], data->presence);
 
 		notify_observers();
+		// sends the batch of the low power profile, nothing otherwise
+		coap_flush_updates();
+		atomic_inc(&sample_count);
+		boot_mark(BOOT_FIRST_SAMPLE);
 		
-		k_sleep(K_MSEC(5000));
+		// woken up early when the period is changed
+		k_sleep(K_MSEC(config_get(CFG_SAMPLE_PERIOD_MS)));
 	} while (true);
 	
 }
 
-void notify_observers(void)
+void sensors_reschedule(void)
 {
-	int value_diff = gathered_sensor_data[current_id].temp.val1 - gathered_sensor_data[last_id].temp.val1;
-	if(value_diff <= -1 || value_diff >= 1)
-	{
-		LOG_INF("Temperature changed:%d.%06d -%d.%06d", 
-			gathered_sensor_data[current_id].temp.val1, gathered_sensor_data[current_id].temp.val2, 
-			gathered_sensor_data[last_id].temp.val1, gathered_sensor_data[last_id].temp.val2 );
-		coap_resource_update(COAP_RESOURCE_TEMPERATURE);
-	}
-
-	value_diff = gathered_sensor_data[current_id].humidity.val1 - gathered_sensor_data[last_id].humidity.val1;
-	if(value_diff <= -1 || value_diff >= 1)
-	{
-		LOG_INF("Humidity changed: %d.%06d -%d.%06d", 
-			gathered_sensor_data[current_id].humidity.val1, gathered_sensor_data[current_id].humidity.val2, 
-			gathered_sensor_data[last_id].humidity.val1, gathered_sensor_data[last_id].humidity.val2 );
-		coap_resource_update(COAP_RESOURCE_HUMIDITY);
-	}
+	k_wakeup(sensor_thread_id);
+}
 
-	value_diff = gathered_sensor_data[current_id].press.val1 - gathered_sensor_data[last_id].press.val1;
-	if(value_diff <= -1 || value_diff >= 1)
-	{
-		LOG_INF("Air Pressure changed:%d.%06d -%d.%06d", 
-			gathered_sensor_data[current_id].press.val1, gathered_sensor_data[current_id].press.val2, 
-			gathered_sensor_data[last_id].press.val1, gathered_sensor_data[last_id].press.val2 );
-		coap_resource_update(COAP_RESOURCE_AIR_PRESSURE);
-	}
+bool sensors_have_sample(void)
+{
+	return atomic_get(&sample_count) > 0;
+}
 
-	value_diff = round(gathered_sensor_data[current_id].air_quality_index) - round(gathered_sensor_data[last_id].air_quality_index);
-	if( value_diff <= -1 || value_diff >= 1)
-	{
-		LOG_INF("Air Quality changed:%d -%d", 
-			gathered_sensor_data[current_id].air_quality_index,
-			gathered_sensor_data[last_id].air_quality_index );
-		coap_resource_update(COAP_RESOURCE_AIR_QUALITY);
-	}
+static int32_t sensor_value_milli(const struct sensor_value *value)
+{
+	return value->val1 * 1000 + value->val2 / 1000;
+}
 
-	value_diff = gathered_sensor_data[current_id].luminance - gathered_sensor_data[last_id].luminance;
-	if(value_diff <= -1 || value_diff >= 1)
-	{
-		LOG_INF("Luminance changed: %d - %d", 
-			gathered_sensor_data[current_id].luminance,
-			gathered_sensor_data[last_id].luminance);
-		coap_resource_update(COAP_RESOURCE_LUMINANCE);
-	}
+/* Three fraction digits, e.g. "23.050", the thermostat parses them into
+ * thousandths without floating point
+ */
+static int format_milli(char *buf, size_t len, int32_t value)
+{
+	return snprintf(buf, len, "%s%d.%03d", value < 0 ? "-" : "",
+			abs(value) / 1000, abs(value) % 1000);
+}
 
-	value_diff = gathered_sensor_data[current_id].presence - gathered_sensor_data[last_id].presence;
-	if(value_diff <= -1 || value_diff >= 1)
+/* Resource value in thousandths, observers are notified when it changed by
+ * the configured delta of its kind
+ */
+static int32_t sensor_resource_value(const struct sensor_resource *desc,
+				     const sensor_data_t *data)
+{
+	switch(desc->kind)
 	{
-		LOG_INF("Presence changed: %d - %d", 
-			gathered_sensor_data[current_id].presence,
-			gathered_sensor_data[last_id].presence);
-		coap_resource_update(COAP_RESOURCE_PRESSENCE);
+	case SENSOR_TEMPERATURE:
+		return sensor_value_milli(&data->bme680[desc->index].temp);
+	case SENSOR_HUMIDITY:
+		return sensor_value_milli(&data->bme680[desc->index].humidity);
+	case SENSOR_AIR_QUALITY:
+		return data->bme680[desc->index].air_quality_index * 1000;
+	case SENSOR_AIR_PRESSURE:
+		return sensor_value_milli(&data->bme680[desc->index].press);
+	case SENSOR_ANALOG:
+		return data->analog[desc->index] * 1000;
+	default:
+		return 0;
 	}
 }
 
-void get_sensor_data(sensor_data_t *sensor_data)
+static int32_t sensor_resource_delta(const struct sensor_resource *desc)
 {
-	*sensor_data = gathered_sensor_data[current_id];
+	switch(desc->kind)
+	{
+	case SENSOR_TEMPERATURE:
+		return config_get(CFG_TEMPERATURE_DELTA);
+	case SENSOR_HUMIDITY:
+		return config_get(CFG_HUMIDITY_DELTA);
+	case SENSOR_AIR_QUALITY:
+		return config_get(CFG_AIR_QUALITY_DELTA);
+	case SENSOR_AIR_PRESSURE:
+		return config_get(CFG_AIR_PRESSURE_DELTA);
+	default:
+		return config_get(CFG_ANALOG_DELTA);
+	}
 }
 
-
-void pir_changed(const struct device *dev, struct gpio_callback *cb,
-		    uint32_t pins)
+void notify_observers(void)
 {
-    int value = gpio_pin_get(pir_sensor.port, pir_sensor.pin);
-	LOG_DBG("Intr:  PIR value: %i, Dev: %s, Pin %i\n", value,pir_sensor.port->name, pir_sensor.pin);
-	k_wakeup(sensor_thread_id);
-}
+	for(int id = 0; id < COAP_SENSOR_RESOURCE_COUNT; id++)
+	{
+		const struct sensor_resource *desc = &sensor_resources[id];
 
+		// Presence and occupancy changes are published by the PIR edge handler directly
+		if(desc->kind == SENSOR_PRESENCE || desc->kind == SENSOR_OCCUPANCY)
+		{
+			continue;
+		}
 
-int get_pir_value(void)
-{
-    int value = gpio_pin_get(pir_sensor.port, pir_sensor.pin);
-    return value;
+		// Compared with the last published value, so slow drifts
+		// are reported once they add up to the delta
+		int32_t current = sensor_resource_value(desc, &gathered_sensor_data[current_id]);
+		int32_t last = notified_values[id];
+		int32_t delta = sensor_resource_delta(desc);
+		int32_t value_diff = current - last;
+		if(value_diff <= -delta || value_diff >= delta)
+		{
+			LOG_INF("Resource %d changed: %d - %d", id, current, last);
+			notified_values[id] = current;
+			coap_resource_update(id);
+		}
+	}
 }
 
-int pir_init(void)
+int sensor_resource_format(int resource_id, const sensor_data_t *data,
+			   char *buf, size_t len)
 {
-	int ret=device_is_ready(pir_sensor.port);
+	const struct sensor_resource *desc;
+	int state, confidence;
 
-	if (!ret) {
-		LOG_ERR("Error: pir_sensor device %s is not ready\n",
-		       pir_sensor.port->name);
-		return ret;
+	if(resource_id < 0 || resource_id >= COAP_SENSOR_RESOURCE_COUNT)
+	{
+		return -EINVAL;
 	}
 
-	ret = gpio_pin_configure_dt(&pir_sensor, GPIO_INPUT);
-	if (ret != 0) {
-		LOG_ERR("Error %d: failed to configure %s pin %d\n",
-		       ret, pir_sensor.port->name, pir_sensor.pin);
-		return ret;
-	}
-	
-	ret = gpio_pin_interrupt_configure_dt(&pir_sensor,
-					      GPIO_INT_EDGE_BOTH);
-	if (ret != 0) {
-		LOG_ERR("Error %d: failed to configure interrupt on %s pin %d\n",
-			ret, pir_sensor.port->name, pir_sensor.pin);
-		return ret;
-	}
+	desc = &sensor_resources[resource_id];
 
-	gpio_init_callback(&button_cb_data, pir_changed, BIT(pir_sensor.pin));
-	gpio_add_callback(pir_sensor.port, &button_cb_data);
-	
-	LOG_INF("Set up pir_sensor at %s pin %d\n", pir_sensor.port->name, pir_sensor.pin);
+	switch(desc->kind)
+	{
+	case SENSOR_TEMPERATURE:
+		return format_milli(buf, len,
+				    sensor_value_milli(&data->bme680[desc->index].temp));
+	case SENSOR_HUMIDITY:
+		return format_milli(buf, len,
+				    sensor_value_milli(&data->bme680[desc->index].humidity));
+	case SENSOR_AIR_QUALITY:
+		return snprintf(buf, len, "%d", data->bme680[desc->index].air_quality_index);
+	case SENSOR_AIR_PRESSURE:
+		return format_milli(buf, len,
+				    sensor_value_milli(&data->bme680[desc->index].press));
+	case SENSOR_ANALOG:
+		return snprintf(buf, len, "%d", data->analog[desc->index]);
+	case SENSOR_PRESENCE:
+		return snprintf(buf, len, "%d", data->presence);
+	case SENSOR_OCCUPANCY:
+		// payload is "<state>;<confidence in percent>"
+		occupancy_get(&state, &confidence);
+		return snprintf(buf, len, "%d;%d", state, confidence);
+	default:
+		return -EINVAL;
+	}
+}
 
-	return 0;
+void get_sensor_data(sensor_data_t *sensor_data)
+{
+	*sensor_data = gathered_sensor_data[current_id];
+	sensor_data->presence = pir_get_presence();
 }
 
 
-void bme680_get_sensor_data(sensor_data_t *sensor_data)
+void bme680_get_sensor_data(const struct device *dev, bme680_data_t *sensor_data)
 {
-	const struct device *dev = device_get_binding(DT_LABEL(DT_INST(0, bosch_bme680)));
 	LOG_DBG("Device %p name is %s\n", dev, dev->name);
 	int ret = device_is_ready(dev);
 	if(!ret )
@@ -359,53 +350,18 @@ void bme680_get_sensor_data(sensor_data_t *sensor_data)
 	sensor_data->air_quality_index = log(gas_res_2) + 0.4 * sensor_value_to_double(&sensor_data->humidity);
 }
 
-int get_luminance_value(uint8_t channel)
+int get_analog_value(uint8_t channel, int16_t raw_value)
 {
-	int err;
-	const struct device *dev_adc = DEVICE_DT_GET(ADC_NODE);
-
-	if (!device_is_ready(dev_adc)) {
-		LOG_ERR("ADC device not found");
-		return -1;
-	}
-
-	if (channel > ADC_NUM_CHANNELS - 1) {
-			LOG_ERR("Channel %d was not configured!", channel);
-			return -1;
-	}
-
-	/*
-	 * Configure channels individually prior to sampling
-	 */
-        channel_cfg.channel_id = channel_ids[channel];
-#ifdef CONFIG_ADC_CONFIGURABLE_INPUTS
-        channel_cfg.input_positive = ADC_INPUT_POS_OFFSET + channel_ids[channel];
-#endif
-
-	adc_channel_setup(dev_adc, &channel_cfg);
-
-	sequence.channels |= BIT(channel_ids[channel]);
-
-	/*
-		* Read sequence of channels (fails if not supported by MCU)
-		*/
-	err = adc_read(dev_adc, &sequence);
-	if (err != 0) {
-		LOG_ERR("ADC reading failed with error %d", err);
-		return -1;
-	}
-
-	int32_t raw_value = sample_buffer[channel];
-	int32_t luminance_value = raw_value;
+	int32_t value;
 
-	LOG_DBG("ADC reading: %d", raw_value);
+	LOG_DBG("ADC reading channel %d: %d", channel, raw_value);
 	
-	// maximum value of luminance sensor is 350 lux
 	// ADC has 12 bit resolution, approximate value
-	// with ADC-value*350/4096
-	luminance_value = raw_value * 350;
-	luminance_value >>=12;	    
+	// with ADC-value*full_scale/4096, e.g. the maximum
+	// value of the luminance sensor is 350 lux
+	value = raw_value * analog_full_scale[channel];
+	value >>=12;	    
 	
-	return luminance_value;
+	return value;
 	
 }
@@ -0,0 +1,254 @@
+/* stream.c - Time limited high rate streaming of the analog channels */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(stream, LOG_LEVEL_INF);
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/byteorder.h>
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/net/socket.h>
+#include <zephyr/net/coap.h>
+
+#include "common.h"
+
+//--------------------------------------------------------
+// Stream parameters
+//--------------------------------------------------------
+
+#ifndef STREAM_MIN_RATE_HZ
+	#define STREAM_MIN_RATE_HZ 10
+#endif
+
+#ifndef STREAM_MAX_RATE_HZ
+	#define STREAM_MAX_RATE_HZ 50
+#endif
+
+#ifndef STREAM_MAX_DURATION_S
+	#define STREAM_MAX_DURATION_S 300
+#endif
+
+/* Used when the start request leaves rate or duration out */
+#define STREAM_DEFAULT_RATE_HZ 20
+#define STREAM_DEFAULT_DURATION_S 30
+
+/* Collected frames are sent this often, every packet carries many samples */
+#ifndef STREAM_FLUSH_MS
+	#define STREAM_FLUSH_MS 500
+#endif
+
+/* Header, token, Content-Format and payload marker */
+#define STREAM_COAP_OVERHEAD (4 + COAP_TOKEN_MAX_LEN + 2 + 1)
+/* seq (2), channels (1), frames (1), index of the first frame (4), presence (1) */
+#define STREAM_HEADER_LEN 9
+#define STREAM_FRAME_LEN (ANALOG_NUM_CHANNELS * sizeof(int16_t))
+#define STREAM_MAX_FRAMES \
+	((MAX_COAP_MSG_LEN - STREAM_COAP_OVERHEAD - STREAM_HEADER_LEN) / STREAM_FRAME_LEN)
+BUILD_ASSERT(STREAM_MAX_FRAMES > 0 && STREAM_MAX_FRAMES <= UINT8_MAX,
+	     "A stream packet has to hold at least one frame");
+
+//--------------------------------------------------------
+// Static helper functions
+//--------------------------------------------------------
+
+static void stream_flush(struct k_work *work);
+static int stream_send(const int16_t *frames, uint8_t count);
+
+//--------------------------------------------------------
+// Runtime Variables
+//--------------------------------------------------------
+
+/* Receiver, taken from the request that started the stream */
+static struct sockaddr_in6 stream_addr;
+static uint8_t stream_token[COAP_TOKEN_MAX_LEN];
+static uint8_t stream_tkl;
+
+static atomic_t stream_active;
+static uint32_t stream_end;
+static uint16_t stream_seq;
+static uint32_t stream_frame_index;
+static struct stream_stats stats;
+
+static int16_t frame_buffer[STREAM_MAX_FRAMES * ANALOG_NUM_CHANNELS];
+static uint8_t packet_buffer[MAX_COAP_MSG_LEN];
+
+static K_WORK_DELAYABLE_DEFINE(stream_work, stream_flush);
+
+//--------------------------------------------------------
+// Function Implementations
+//--------------------------------------------------------
+
+int stream_start(const struct sockaddr *addr, socklen_t addr_len,
+		 const uint8_t *token, uint8_t tkl,
+		 uint32_t rate_hz, uint32_t duration_s)
+{
+	int r;
+
+	rate_hz = rate_hz ? rate_hz : STREAM_DEFAULT_RATE_HZ;
+	duration_s = duration_s ? duration_s : STREAM_DEFAULT_DURATION_S;
+
+	if (rate_hz < STREAM_MIN_RATE_HZ || rate_hz > STREAM_MAX_RATE_HZ ||
+	    duration_s > STREAM_MAX_DURATION_S ||
+	    addr_len > sizeof(stream_addr) || tkl > COAP_TOKEN_MAX_LEN) {
+		return -EINVAL;
+	}
+
+	if (atomic_get(&stream_active)) {
+		return -EBUSY;
+	}
+
+	memcpy(&stream_addr, addr, addr_len);
+	memcpy(stream_token, token, tkl);
+	stream_tkl = tkl;
+
+	stream_seq = 0;
+	stream_frame_index = 0;
+	memset(&stats, 0, sizeof(stats));
+
+	r = analog_start_continuous(USEC_PER_SEC / rate_hz);
+	if (r < 0) {
+		return r;
+	}
+
+	stream_end = k_uptime_get_32() + duration_s * MSEC_PER_SEC;
+	atomic_set(&stream_active, 1);
+	k_work_schedule(&stream_work, K_MSEC(STREAM_FLUSH_MS));
+
+	LOG_INF("Streaming at %u Hz for %u s", rate_hz, duration_s);
+
+	return 0;
+}
+
+void stream_stop(void)
+{
+	if (!atomic_cas(&stream_active, 1, 0)) {
+		return;
+	}
+
+	k_work_cancel_delayable(&stream_work);
+	if (analog_stop_continuous() < 0) {
+		LOG_WRN("ADC still sampling after the stream");
+	}
+
+	stats.frames_dropped = analog_get_dropped_frames();
+
+	LOG_INF("Stream stopped: %u packets, %u frames, %u dropped, %u send errors",
+		stats.packets, stats.frames_sent, stats.frames_dropped,
+		stats.send_errors);
+}
+
+/* Also waits for a flush that is still sending, afterwards the socket may
+ * be closed. Not to be called from the system work queue.
+ */
+void stream_stop_sync(void)
+{
+	struct k_work_sync sync;
+
+	stream_stop();
+	(void)k_work_cancel_delayable_sync(&stream_work, &sync);
+}
+
+uint32_t stream_remaining(void)
+{
+	int32_t remaining = stream_end - k_uptime_get_32();
+
+	if (!atomic_get(&stream_active) || remaining <= 0) {
+		return 0;
+	}
+
+	return DIV_ROUND_UP(remaining, MSEC_PER_SEC);
+}
+
+void stream_get_stats(struct stream_stats *stream_stats)
+{
+	*stream_stats = stats;
+	stream_stats->active = atomic_get(&stream_active);
+	if (stream_stats->active) {
+		stream_stats->frames_dropped = analog_get_dropped_frames();
+	}
+}
+
+/* Drains the ADC ring into as few packets as possible */
+static void stream_flush(struct k_work *work)
+{
+	uint32_t count;
+
+	if (!atomic_get(&stream_active)) {
+		return;
+	}
+
+	do {
+		count = analog_get_frames(frame_buffer, STREAM_MAX_FRAMES);
+		if (count > 0 && stream_send(frame_buffer, count) < 0) {
+			stats.send_errors++;
+		}
+		stream_frame_index += count;
+	} while (count == STREAM_MAX_FRAMES);
+
+	if ((int32_t)(stream_end - k_uptime_get_32()) <= 0) {
+		stream_stop();
+		return;
+	}
+
+	k_work_schedule(&stream_work, K_MSEC(STREAM_FLUSH_MS));
+}
+
+/* NON 2.05 with the token of the start request, the payload is
+ * seq | channels | frames | first frame index | presence | samples,
+ * all in network byte order
+ */
+static int stream_send(const int16_t *frames, uint8_t count)
+{
+	struct coap_packet packet;
+	uint8_t *p;
+	int r;
+
+	r = coap_packet_init(&packet, packet_buffer, sizeof(packet_buffer),
+			     COAP_VERSION_1, COAP_TYPE_NON_CON,
+			     stream_tkl, stream_token,
+			     COAP_RESPONSE_CODE_CONTENT, coap_next_id());
+	if (r == 0) {
+		r = coap_append_option_int(&packet, COAP_OPTION_CONTENT_FORMAT,
+					   COAP_CONTENT_FORMAT_APP_OCTET_STREAM);
+	}
+	if (r == 0) {
+		r = coap_packet_append_payload_marker(&packet);
+	}
+	if (r < 0) {
+		return r;
+	}
+
+	p = &packet.data[packet.offset];
+	sys_put_be16(stream_seq, p);
+	p[2] = ANALOG_NUM_CHANNELS;
+	p[3] = count;
+	sys_put_be32(stream_frame_index, &p[4]);
+	p[8] = pir_get_presence();
+	p += STREAM_HEADER_LEN;
+
+	for (int i = 0; i < count * ANALOG_NUM_CHANNELS; i++) {
+		sys_put_be16(frames[i], p);
+		p += sizeof(int16_t);
+	}
+
+	packet.offset = p - packet.data;
+	stream_seq++;
+
+	r = sendto(conf.ipv6.coap.sock, packet.data, packet.offset, 0,
+		   (struct sockaddr *)&stream_addr, sizeof(stream_addr));
+	if (r < 0) {
+		return -errno;
+	}
+
+	stats.packets++;
+	stats.frames_sent += count;
+
+	return 0;
+}
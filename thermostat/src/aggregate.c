@@ -0,0 +1,242 @@
+/* aggregate.c - Control inputs combined from several sensor units */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(aggregate, LOG_LEVEL_INF);
+
+#include <zephyr/zephyr.h>
+#include <string.h>
+
+#include "common.h"
+
+//--------------------------------------------------------
+// Runtime Variables
+//--------------------------------------------------------
+
+/* Last value of one resource of one sensor unit, in thousandths. Occupancy
+ * is 0 or 1.
+ */
+struct source_value {
+	int32_t value;
+	uint32_t time;
+	uint32_t zones;		/* bit per HVAC zone the value counts in */
+	bool valid;
+};
+
+/* The valid values of the sources of one HVAC zone are kept sorted, a notification moves
+ * one of them and the median or maximum is read off directly
+ */
+struct aggregate {
+	int32_t sorted[DIRECTORY_MAX_SERVERS];
+	uint8_t count;
+	int32_t result;
+	bool published;
+	bool stale;
+};
+
+#define RESOURCE_TYPE_MODE(ID, rt, mode) [RESOURCE_##ID] = mode,
+
+static const uint8_t modes[RESOURCE_TYPE_COUNT] = {
+	RESOURCE_TYPES(RESOURCE_TYPE_MODE)
+};
+
+/* Only touched by the CoAP client thread, a source is the directory entry
+ * of the sensor unit
+ */
+static struct source_value sources[DIRECTORY_MAX_SERVERS][RESOURCE_TYPE_COUNT];
+static struct aggregate aggregates[HVAC_ZONE_COUNT][RESOURCE_TYPE_COUNT];
+
+BUILD_ASSERT(HVAC_ZONE_COUNT <= 32, "zones of a source are kept in a bitmask");
+
+//--------------------------------------------------------
+// Function Implementations
+//--------------------------------------------------------
+
+static void sorted_insert(struct aggregate *agg, int32_t value)
+{
+	int i = agg->count;
+
+	while (i > 0 && agg->sorted[i - 1] > value) {
+		agg->sorted[i] = agg->sorted[i - 1];
+		i--;
+	}
+
+	agg->sorted[i] = value;
+	agg->count++;
+}
+
+static void sorted_remove(struct aggregate *agg, int32_t value)
+{
+	int i = 0;
+
+	while (i < agg->count && agg->sorted[i] != value) {
+		i++;
+	}
+
+	if (i == agg->count) {
+		return;
+	}
+
+	memmove(&agg->sorted[i], &agg->sorted[i + 1],
+		(agg->count - i - 1) * sizeof(agg->sorted[0]));
+	agg->count--;
+}
+
+static int32_t aggregate_result(const struct aggregate *agg, uint8_t mode)
+{
+	int n = agg->count;
+
+	if (mode == AGGREGATE_MAX) {
+		return agg->sorted[n - 1];
+	}
+
+	if (n & 1) {
+		return agg->sorted[n / 2];
+	}
+
+	return ((int64_t)agg->sorted[n / 2 - 1] + agg->sorted[n / 2]) / 2;
+}
+
+static void aggregate_set_stale(int zone, enum resource_type type, bool stale)
+{
+	struct aggregate *agg = &aggregates[zone][type];
+
+	if (agg->stale == stale) {
+		return;
+	}
+
+	agg->stale = stale;
+	if (stale) {
+		LOG_WRN("No sensor unit of zone %d confirms %s", zone,
+			resource_type_name(type));
+	}
+
+	hvac_set_stale(zone, type, stale);
+	// the display shows the first zone
+	if (zone == 0) {
+		display_set_stale(type, stale);
+	}
+}
+
+/* Hands a changed result to hvac and display, they are only told about
+ * staleness once every source of a resource in the zone failed
+ */
+static void aggregate_publish(int zone, enum resource_type type)
+{
+	struct aggregate *agg = &aggregates[zone][type];
+	int32_t result;
+
+	if (agg->count == 0) {
+		if (agg->published) {
+			aggregate_set_stale(zone, type, true);
+		}
+		return;
+	}
+
+	aggregate_set_stale(zone, type, false);
+
+	result = aggregate_result(agg, modes[type]);
+	if (agg->published && result == agg->result) {
+		return;
+	}
+
+	agg->result = result;
+	agg->published = true;
+
+	LOG_DBG("Zone %d %s %d from %u sensor units", zone,
+		resource_type_name(type), result, agg->count);
+
+	switch (type) {
+	case RESOURCE_TEMPERATURE:
+		hvac_update_temperatur(zone, result);
+		if (zone == 0) {
+			display_update_temperatur(result);
+		}
+		break;
+	case RESOURCE_HUMIDITY:
+		hvac_update_humidity(zone, result);
+		if (zone == 0) {
+			display_update_humidity(result);
+		}
+		break;
+	case RESOURCE_AIR_QUALITY:
+		hvac_update_air_quality(zone, result / 1000);
+		if (zone == 0) {
+			display_update_air_quality(result / 1000);
+		}
+		break;
+	case RESOURCE_OCCUPANCY:
+		hvac_update_pressence(zone, result != 0);
+		break;
+	default:
+		break;
+	}
+}
+
+/* A sensor unit moved to another zone is taken out of the zones it fed */
+void aggregate_update(int source, enum resource_type type, int32_t value)
+{
+	struct source_value *v = &sources[source][type];
+	uint32_t zones = hvac_zones_of(directory_zone(source));
+	uint32_t changed = zones;
+
+	if (zones == 0) {
+		LOG_DBG("No HVAC zone for sensor unit %d in zone %d", source,
+			directory_zone(source));
+	}
+
+	if (v->valid) {
+		for (int zone = 0; zone < HVAC_ZONE_COUNT; zone++) {
+			if (v->zones & BIT(zone)) {
+				sorted_remove(&aggregates[zone][type], v->value);
+			}
+		}
+		changed |= v->zones;
+	}
+
+	v->value = value;
+	v->time = k_uptime_get_32();
+	v->zones = zones;
+	v->valid = true;
+
+	for (int zone = 0; zone < HVAC_ZONE_COUNT; zone++) {
+		if (zones & BIT(zone)) {
+			sorted_insert(&aggregates[zone][type], value);
+		}
+	}
+
+	for (int zone = 0; zone < HVAC_ZONE_COUNT; zone++) {
+		if (changed & BIT(zone)) {
+			aggregate_publish(zone, type);
+		}
+	}
+}
+
+/* The value of a source that went stale or was dropped no longer counts,
+ * the others of its zones take over
+ */
+void aggregate_invalidate(int source, enum resource_type type)
+{
+	struct source_value *v = &sources[source][type];
+
+	if (!v->valid) {
+		return;
+	}
+
+	LOG_INF("Sensor unit %d leaves the %s aggregate, last value %u ms ago",
+		source, resource_type_name(type), k_uptime_get_32() - v->time);
+
+	v->valid = false;
+
+	for (int zone = 0; zone < HVAC_ZONE_COUNT; zone++) {
+		if (v->zones & BIT(zone)) {
+			sorted_remove(&aggregates[zone][type], v->value);
+			aggregate_publish(zone, type);
+		}
+	}
+}
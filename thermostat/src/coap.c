@@ -15,6 +15,7 @@ LOG_MODULE_REGISTER(coap, LOG_LEVEL_INF);
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <zephyr/net/socket.h>
 #include <zephyr/net/net_mgmt.h>
@@ -28,30 +29,135 @@ LOG_MODULE_REGISTER(coap, LOG_LEVEL_INF);
 #include "common.h"
 #include "net_private.h"
 
-#define UDP_SLEEP K_MSEC(150)
-#define UDP_WAIT K_SECONDS(10)
-#define NUM_REPLIES 10
+/* Discovery is repeated with exponential backoff until a sensor unit with
+ * all resources answered. The first timeout covers the Leisure the sensor
+ * units spread their multicast responses over.
+ */
+#ifndef DISCOVERY_TIMEOUT_MS
+	#define DISCOVERY_TIMEOUT_MS 2000
+#endif
+
+#ifndef DISCOVERY_MAX_TIMEOUT_MS
+	#define DISCOVERY_MAX_TIMEOUT_MS 60000
+#endif
 
-static const char * const echo_path[] = { "echo", NULL };
-static const char * const temperature_path[] = {"sensors", "temperature", NULL };
-static const char * const humidity_path[] = {"sensors",  "humidity", NULL };
-static const char * const air_quality_path[] = {"sensors",  "air_quality", NULL };
-static const char * const presence_path[] = {"sensors",  "presence", NULL };
+/* RFC 7252 5.10.5, Max-Age of a response without the option */
+#define COAP_DEFAULT_MAX_AGE 60
 
-// currently not used
-// static const char * const air_pressure_path[] = {"sensors",  "air_pressure", NULL };
-// static const char * const luminance_path[] = {"sensors",  "luminance", NULL };
+/* Registrations are CON requests kept in the pending table, the first
+ * timeout is CONFIG_COAP_INIT_ACK_TIMEOUT_MS. A sensor unit that does not
+ * acknowledge the last retransmission, or refuses a registration this often
+ * in a row, is dropped.
+ */
+#ifndef REGISTER_MAX_RETRANSMIT
+	#define REGISTER_MAX_RETRANSMIT 4
+#endif
+
+/* Values are stale once their Max-Age passed without a notification
+ * (RFC 7641 3.3.1). The sensor units only notify changes beyond a delta, so
+ * a quiet resource is registered again no more often than this.
+ */
+#ifndef OBSERVE_REFRESH_MIN_MS
+	#define OBSERVE_REFRESH_MIN_MS 30000
+#endif
 
-static bool echo_received;
-static struct coap_reply replies[NUM_REPLIES];
-static int reply_acks[NUM_REPLIES];
-static int reply_acks_wr_ptr;
+/* RFC 7641 3.4, a notification arriving this much later is newer whatever
+ * its sequence number
+ */
+#define OBSERVE_FRESHNESS_MS (128 * MSEC_PER_SEC)
+
+#define UDP_SLEEP K_MSEC(150)
+#define UDP_WAIT K_SECONDS(10)
+/* Every registration of every sensor unit can wait for its ACK at once,
+ * e.g. right after coap_register_observers()
+ */
+#define NUM_PENDINGS (DIRECTORY_MAX_SERVERS * RESOURCE_TYPE_COUNT)
+
+/* Pending requests keep their k_malloc buffer until the ACK arrives. A few
+ * more are in use at once while a packet is received, answered or sent.
+ * The margin covers the allocator's chunk header.
+ */
+#define HEAP_TRANSIENT_BUFFERS 4
+BUILD_ASSERT(CONFIG_HEAP_MEM_POOL_SIZE >=
+	     (NUM_PENDINGS + HEAP_TRANSIENT_BUFFERS) * (MAX_COAP_MSG_LEN + 16),
+	     "CONFIG_HEAP_MEM_POOL_SIZE cannot hold all pending requests");
+
+static const char * const well_known_core_path[] = { ".well-known", "core", NULL };
+
+static const struct sockaddr_in6 mcast_addr = {
+	.sin6_family = AF_INET6,
+	.sin6_addr = ALL_NODES_LOCAL_COAP_MCAST,
+	.sin6_port = htons(COAP_PORT) };
+
+static struct coap_pending pendings[NUM_PENDINGS];
+
+/* Kept after the discovery, late answers still fill the directory */
+static uint8_t discovery_token[COAP_TOKEN_MAX_LEN];
+static struct subscription *discovery;
+
+static int notification_cb_temp(const struct coap_packet *response, int source);
+static int notification_cb_humidity(const struct coap_packet *response, int source);
+static int notification_cb_air_quality(const struct coap_packet *response, int source);
+static int notification_cb_occupancy(const struct coap_packet *response, int source);
+static void notification_cb(const struct coap_packet *response,
+			    void *user_data,
+			    const struct sockaddr_in6 *from);
+static void release_pending(struct coap_pending *pending);
+
+/* One Observe registration, all of them are sent back to back and matched
+ * by token through the subscription table. The path is the one the sensor
+ * unit published for the type. refresh is when the value expires without
+ * another notification.
+ */
+struct registration {
+	enum resource_type type;
+	uint8_t source;		/* session and directory entry */
+	struct subscription *subscription;
+	struct coap_pending *pending;
+	uint8_t token[COAP_TOKEN_MAX_LEN];
+	int32_t seq;		/* Observe value of the last notification, -1 before */
+	uint32_t seq_time;
+	uint32_t refresh;
+	uint8_t refusals;
+	bool active;
+	bool refreshing;
+	bool stale;
+};
+
+/* Unicast session with one observed sensor unit, indexed like its directory
+ * entry. The address is the one its answers come from, everything after the
+ * discovery is sent there and multicast is only used to find sensor units.
+ */
+struct session {
+	struct sockaddr_in6 addr;
+	struct registration registrations[RESOURCE_TYPE_COUNT];
+	uint32_t links_refresh;	/* next validation of its links */
+	bool used;
+};
+
+static struct session sessions[DIRECTORY_MAX_SERVERS];
+
+static void registration_cancel(struct config *cfg, struct registration *reg,
+				bool deregister);
+static int sessions_sync(struct config *cfg);
+
+static int (* const handlers[RESOURCE_TYPE_COUNT])(const struct coap_packet *response,
+						    int source) = {
+	[RESOURCE_TEMPERATURE] = notification_cb_temp,
+	[RESOURCE_HUMIDITY] = notification_cb_humidity,
+	[RESOURCE_AIR_QUALITY] = notification_cb_air_quality,
+	[RESOURCE_OCCUPANCY] = notification_cb_occupancy,
+};
 
 //----------------------------------------------------------------
 // Notification/Reply Callbacks
 //----------------------------------------------------------------
 
-static void send_obs_reply_ack(struct coap_packet *reply)
+/* ACK or RST to the sender of a CON message, a notification nobody asked
+ * for is rejected so the sensor unit removes the stale observer
+ */
+static void send_empty_reply(struct config *cfg, struct coap_packet *reply,
+			     const struct sockaddr_in6 *to, uint8_t type)
 {
 	struct coap_packet request;
 	uint8_t *data;
@@ -62,44 +168,45 @@ static void send_obs_reply_ack(struct coap_packet *reply)
 		return;
 	}
 
-	r = coap_ack_init(&request, reply, data, MAX_COAP_MSG_LEN, COAP_CODE_EMPTY);
+	r = coap_packet_init(&request, data, MAX_COAP_MSG_LEN, COAP_VERSION_1,
+			     type, 0, NULL, COAP_CODE_EMPTY,
+			     coap_header_get_id(reply));
 	if (r < 0) {
 		LOG_ERR("Failed to init CoAP message");
 	}
 	else
 	{
+		net_hexdump(type == COAP_TYPE_ACK ? "ACK" : "RST",
+			    request.data, request.offset);
 
-		net_hexdump("ACK", request.data, request.offset);
-
-		static struct sockaddr_in6 mcast_addr = {
-							.sin6_family = AF_INET6,
-							.sin6_addr = ALL_NODES_LOCAL_COAP_MCAST,
-							.sin6_port = htons(COAP_PORT) };
-
-		r = sendto(conf.ipv6.coap.sock, request.data, request.offset, 0, (struct sockaddr *) &mcast_addr, sizeof(mcast_addr));
-
+		r = sendto(cfg->coap.sock, request.data, request.offset, 0,
+			   (const struct sockaddr *)to, sizeof(*to));
 		if (r < 0) {
-			LOG_ERR("Failed to send CoAP ACK: %i", -r);
+			LOG_ERR("Failed to send CoAP %s: %d",
+				type == COAP_TYPE_ACK ? "ACK" : "RST", errno);
 		}
 	}
 
 	k_free(data);
 }
 
-static int echo_request_cb(const struct coap_packet *response,
-			       struct coap_reply *reply,
-			       const struct sockaddr *from)
+/* Follows the sensor unit if its answers come from another address, e.g.
+ * after it attached to a different parent
+ */
+static void session_update(struct session *session,
+			   const struct sockaddr_in6 *from)
 {
-	
-	echo_received = true;
-	coap_reply_clear(reply);
-	
-	return 0;
+	if (net_ipv6_addr_cmp(&session->addr.sin6_addr, &from->sin6_addr) &&
+	    session->addr.sin6_port == from->sin6_port) {
+		return;
+	}
+
+	LOG_INF("Sensor unit %d answers from a new address",
+		(int)(session - sessions));
+	session->addr = *from;
 }
 
-static int notification_cb_temp(const struct coap_packet *response,
-			       struct coap_reply *reply,
-			       const struct sockaddr *from)
+static int notification_cb_temp(const struct coap_packet *response, int source)
 {
 	const uint8_t *payload;
 	uint16_t payload_len;
@@ -110,18 +217,21 @@ static int notification_cb_temp(const struct coap_packet *response,
 	}
 	else
 	{
-		double result = atof(payload);
-		LOG_DBG("Tempereature %lf", result);
-		hvac_update_temperatur(result);
-		display_update_temperatur(result);
+		int32_t result;
+
+		if (config_parse_decimal((const char *)payload, payload_len,
+					 &result) < 0) {
+			LOG_WRN("Malformed temperature from %d", source);
+			return 0;
+		}
+		LOG_DBG("Temperature %d thousandths from %d", result, source);
+		aggregate_update(source, RESOURCE_TEMPERATURE, result);
 	}
 
 	return 0;
 }
 
-static int notification_cb_humidity(const struct coap_packet *response,
-			       struct coap_reply *reply,
-			       const struct sockaddr *from)
+static int notification_cb_humidity(const struct coap_packet *response, int source)
 {
 	const uint8_t *payload;
 	uint16_t payload_len;
@@ -132,18 +242,21 @@ static int notification_cb_humidity(const struct coap_packet *response,
 	}
 	else
 	{
-		double result = atof(payload);
-		LOG_DBG("Humidity %lf", result);
-		hvac_update_humidity(result);
-		display_update_humidity(result);
+		int32_t result;
+
+		if (config_parse_decimal((const char *)payload, payload_len,
+					 &result) < 0) {
+			LOG_WRN("Malformed humidity from %d", source);
+			return 0;
+		}
+		LOG_DBG("Humidity %d thousandths from %d", result, source);
+		aggregate_update(source, RESOURCE_HUMIDITY, result);
 	}
 
 	return 0;
 }
 
-static int notification_cb_air_quality(const struct coap_packet *response,
-			       struct coap_reply *reply,
-			       const struct sockaddr *from)
+static int notification_cb_air_quality(const struct coap_packet *response, int source)
 {
 	const uint8_t *payload;
 	uint16_t payload_len;
@@ -154,18 +267,21 @@ static int notification_cb_air_quality(const struct coap_packet *response,
 	}
 	else
 	{
-		double result = atof(payload);
-		LOG_DBG("Air Quality %lf", result);
-		hvac_update_air_quality(result);
-		display_update_air_quality(result);
+		int32_t result;
+
+		if (config_parse_decimal((const char *)payload, payload_len,
+					 &result) < 0) {
+			LOG_WRN("Malformed air quality from %d", source);
+			return 0;
+		}
+		LOG_DBG("Air Quality %d thousandths from %d", result, source);
+		aggregate_update(source, RESOURCE_AIR_QUALITY, result);
 	}
 	
 	return 0;
 }
 
-static int notification_cb_presence(const struct coap_packet *response,
-			       struct coap_reply *reply,
-			       const struct sockaddr *from)
+static int notification_cb_occupancy(const struct coap_packet *response, int source)
 {
 	const uint8_t *payload;
 	uint16_t payload_len;
@@ -176,25 +292,189 @@ static int notification_cb_presence(const struct coap_packet *response,
 	}
 	else
 	{
-		// simple conversion between char and int
+		// payload is "<state>;<confidence>", the estimated occupancy
+		// replaces the raw PIR level as presence input
 		int result = payload[0] == '0' ? 0 :1;
-		LOG_DBG("Presence %i", result);
-		hvac_update_pressence(result);
+		LOG_DBG("Occupancy %i from %d", result, source);
+		aggregate_update(source, RESOURCE_OCCUPANCY, result);
 	}
 	
 	return 0;
 }
 
+//----------------------------------------------------------------
+// Configuration resource
+//----------------------------------------------------------------
+
+/* Piggybacked response with an optional text/plain payload */
+static int send_config_response(struct config *cfg, struct coap_packet *request,
+				const struct sockaddr *addr, socklen_t addr_len,
+				uint8_t code, const char *payload, uint16_t payload_len)
+{
+	struct coap_packet response;
+	uint8_t token[COAP_TOKEN_MAX_LEN];
+	uint8_t *data;
+	uint8_t tkl;
+	bool con;
+	int r;
+
+	data = (uint8_t *)k_malloc(MAX_COAP_MSG_LEN);
+	if (!data) {
+		return -ENOMEM;
+	}
+
+	tkl = coap_header_get_token(request, token);
+	con = coap_header_get_type(request) == COAP_TYPE_CON;
+
+	r = coap_packet_init(&response, data, MAX_COAP_MSG_LEN, COAP_VERSION_1,
+			     con ? COAP_TYPE_ACK : COAP_TYPE_NON_CON, tkl, token,
+			     code, con ? coap_header_get_id(request) : coap_next_id());
+
+	if (r == 0 && payload) {
+		r = coap_append_option_int(&response, COAP_OPTION_CONTENT_FORMAT,
+					   COAP_CONTENT_FORMAT_TEXT_PLAIN);
+		if (r == 0) {
+			r = coap_packet_append_payload_marker(&response);
+		}
+		if (r == 0) {
+			r = coap_packet_append_payload(&response, (uint8_t *)payload,
+						       payload_len);
+		}
+	}
+
+	if (r == 0) {
+		net_hexdump("Response", response.data, response.offset);
+
+		r = sendto(cfg->coap.sock, response.data, response.offset, 0,
+			   addr, addr_len);
+		if (r < 0) {
+			LOG_ERR("Failed to send CoAP response: %d", errno);
+			r = -errno;
+		}
+	}
+
+	k_free(data);
+
+	return r;
+}
+
+/* GET /config lists all limits as "name=value" lines, GET /config/<name>
+ * only returns the value. PUT /config takes "name=value" items separated by
+ * ';' and applies all of them or none, PUT /config/<name> the value alone.
+ * Requests for other resources are not answered, the thermostat is a client.
+ */
+static int handle_config_request(struct config *cfg, struct coap_packet *request,
+				 const struct sockaddr *addr, socklen_t addr_len)
+{
+	struct coap_option path[3];
+	const uint8_t *payload;
+	uint16_t payload_len;
+	/* Header, token, Content-Format and payload marker take 14 bytes */
+	char body[MAX_COAP_MSG_LEN - 16];
+	int param = -1;
+	int num;
+	int r;
+
+	num = coap_find_options(request, COAP_OPTION_URI_PATH, path, ARRAY_SIZE(path));
+	if (num < 1 || path[0].len != strlen("config") ||
+	    memcmp(path[0].value, "config", path[0].len) != 0) {
+		return -ENOENT;
+	}
+
+	if (num > 2) {
+		return send_config_response(cfg, request, addr, addr_len,
+					    COAP_RESPONSE_CODE_NOT_FOUND, NULL, 0);
+	}
+
+	if (num == 2) {
+		param = config_find((const char *)path[1].value, path[1].len);
+		if (param < 0) {
+			return send_config_response(cfg, request, addr, addr_len,
+						    COAP_RESPONSE_CODE_NOT_FOUND, NULL, 0);
+		}
+	}
+
+	switch (coap_header_get_code(request)) {
+	case COAP_METHOD_GET:
+		/* A listing that does not fit is an error, never a cut 2.05 */
+		r = config_format(param, body, sizeof(body));
+		if (r < 0) {
+			LOG_ERR("Configuration does not fit the response (%d)", r);
+			return send_config_response(cfg, request, addr, addr_len,
+						    COAP_RESPONSE_CODE_INTERNAL_ERROR,
+						    NULL, 0);
+		}
+
+		return send_config_response(cfg, request, addr, addr_len,
+					    COAP_RESPONSE_CODE_CONTENT, body, r);
+	case COAP_METHOD_PUT:
+		payload = coap_packet_get_payload(request, &payload_len);
+		if (!payload) {
+			r = -EINVAL;
+		} else if (param < 0) {
+			r = config_write((const char *)payload, payload_len);
+		} else {
+			r = config_write_one(param, (const char *)payload, payload_len);
+		}
+
+		if (r < 0) {
+			LOG_WRN("Configuration rejected (%d)", r);
+			return send_config_response(cfg, request, addr, addr_len,
+						    COAP_RESPONSE_CODE_BAD_REQUEST,
+						    NULL, 0);
+		}
+
+		return send_config_response(cfg, request, addr, addr_len,
+					    COAP_RESPONSE_CODE_CHANGED, NULL, 0);
+	default:
+		return send_config_response(cfg, request, addr, addr_len,
+					    COAP_RESPONSE_CODE_NOT_ALLOWED, NULL, 0);
+	}
+}
+
 //----------------------------------------------------------------
 // CoAP Send and Receive Functions
 //----------------------------------------------------------------,
 
-static int coap_send_echo_request(struct config *cfg)
+/* One Uri-Path option per segment of a discovered path */
+static int append_path(struct coap_packet *request, const char *path)
+{
+	const char *segment;
+	int r;
+
+	while (*path) {
+		segment = path;
+		while (*path && *path != '/') {
+			path++;
+		}
+		r = coap_packet_append_option(request, COAP_OPTION_URI_PATH,
+					      segment, path - segment);
+		if (r < 0) {
+			return r;
+		}
+		if (*path == '/') {
+			path++;
+		}
+	}
+
+	return 0;
+}
+
+/* GET /.well-known/core with one rt filter per resource type the thermostat
+ * observes, the sensor units only answer with the matching links. Sent as
+ * NON to the multicast group (RFC 7252 8.1), further blocks of an answer are
+ * requested from the sensor unit that sent it. With an ETag the links of a
+ * known sensor unit are validated, it answers 2.03 if they did not change.
+ */
+static int coap_send_discovery_request(struct config *cfg,
+				       const struct sockaddr_in6 *addr, int block2,
+				       const uint8_t *etag, uint8_t etag_len)
 {
-	uint8_t payload[] = "Hello World!\n";
 	struct coap_packet request;
 	const char * const *p;
+	char query[24];
 	uint8_t *data;
+	int len;
 	int r;
 
 	data = (uint8_t *)k_malloc(MAX_COAP_MSG_LEN);
@@ -203,72 +483,176 @@ static int coap_send_echo_request(struct config *cfg)
 	}
 
 	r = coap_packet_init(&request, data, MAX_COAP_MSG_LEN,
-			     COAP_VERSION_1, COAP_TYPE_CON,
-			     COAP_TOKEN_MAX_LEN, coap_next_token(),
-			     COAP_METHOD_PUT, coap_next_id());
-	if (r < 0) {
-		LOG_ERR("Failed to init CoAP message");
+			     COAP_VERSION_1, COAP_TYPE_NON_CON,
+			     COAP_TOKEN_MAX_LEN, discovery_token,
+			     COAP_METHOD_GET, coap_next_id());
+
+	if (r == 0 && etag_len > 0) {
+		r = coap_packet_append_option(&request, COAP_OPTION_ETAG,
+					      etag, etag_len);
 	}
-	else
-	{
-		// Iterate over path
-		for (p = echo_path; p && *p; p++) {
-			r = coap_packet_append_option(&request, COAP_OPTION_URI_PATH,
-							*p, strlen(*p));
-			if (r < 0) {
-				break;
-			}
-		}
-		
+
+	for (p = well_known_core_path; r == 0 && *p; p++) {
+		r = coap_packet_append_option(&request, COAP_OPTION_URI_PATH,
+					      *p, strlen(*p));
+	}
+
+	for (int i = 0; r == 0 && i < RESOURCE_TYPE_COUNT; i++) {
+		len = snprintk(query, sizeof(query), "rt=%s", resource_type_name(i));
+		r = coap_packet_append_option(&request, COAP_OPTION_URI_QUERY,
+					      query, len);
+	}
+
+	if (r == 0 && block2 >= 0) {
+		r = coap_append_option_int(&request, COAP_OPTION_BLOCK2, block2);
+	}
+
+	if (r < 0) {
+		LOG_ERR("Failed to build the discovery request");
+	} else {
+		net_hexdump("Request", request.data, request.offset);
+
+		r = sendto(cfg->coap.sock, request.data, request.offset, 0,
+			   (const struct sockaddr *)addr, sizeof(*addr));
 		if (r < 0) {
-			LOG_ERR("Unable add option to request");
+			LOG_ERR("Failed to send discovery request: %d", errno);
+			r = -errno;
+		} else {
+			r = 0;
 		}
-		else
-		{
-			r = coap_packet_append_payload_marker(&request);
-			if (r < 0) {
-				LOG_ERR("Unable to append payload marker");
-			}
-			else
-			{
-				r = coap_packet_append_payload(&request, (uint8_t *)payload,
-									sizeof(payload) - 1);
-				if (r < 0) {
-					LOG_ERR("Not able to append payload");
-				}
-				else
-				{
-					net_hexdump("Request", request.data, request.offset);
+	}
 
+	k_free(data);
 
-					struct coap_reply *reply =coap_reply_next_unused((struct coap_reply *)&replies, sizeof(replies));
-					coap_reply_init(reply, &request);
-					reply->reply = echo_request_cb;
+	return r;
+}
 
-					static struct sockaddr_in6 mcast_addr = {
-						.sin6_family = AF_INET6,
-						.sin6_addr = ALL_NODES_LOCAL_COAP_MCAST,
-						.sin6_port = htons(COAP_PORT) };
+/* Adds the links of a discovery answer to the directory and asks the same
+ * sensor unit for the next block if there is one
+ */
+static void discovery_response(const struct coap_packet *response,
+			       void *user_data,
+			       const struct sockaddr_in6 *from)
+{
+	struct config *cfg = user_data;
+	struct coap_option etag;
+	const uint8_t *payload;
+	uint16_t payload_len = 0;
+	uint8_t code = coap_header_get_code(response);
+	int format;
+	int block2;
+	int max_age;
+	bool changed;
+	bool more;
+	int r;
 
-					r = sendto(cfg->coap.sock, request.data, request.offset, 0, (struct sockaddr *) &mcast_addr, sizeof(mcast_addr));
-				}
-			}
+	max_age = coap_get_option_int(response, COAP_OPTION_MAX_AGE);
+	if (max_age < 0) {
+		max_age = COAP_DEFAULT_MAX_AGE;
+	}
+
+	if (code == COAP_RESPONSE_CODE_VALID) {
+		(void)directory_valid(from, max_age);
+		return;
+	}
+
+	// sensor units without a matching link answer unicast requests
+	// with 4.04 and stay silent on multicast
+	if (code != COAP_RESPONSE_CODE_CONTENT) {
+		return;
+	}
+
+	format = coap_get_option_int(response, COAP_OPTION_CONTENT_FORMAT);
+	if (format >= 0 && format != COAP_CONTENT_FORMAT_APP_LINK_FORMAT) {
+		return;
+	}
+
+	payload = coap_packet_get_payload(response, &payload_len);
+	if (!payload) {
+		payload_len = 0;
+	}
+
+	if (coap_find_options(response, COAP_OPTION_ETAG, &etag, 1) != 1) {
+		etag.len = 0;
+	}
+
+	block2 = coap_get_option_int(response, COAP_OPTION_BLOCK2);
+	more = block2 >= 0 && (block2 & 0x8);
+
+	r = directory_links(from, block2 < 0 ? 0 : block2 >> 4, payload,
+			    payload_len, more, max_age, etag.value, etag.len,
+			    &changed);
+	if (r < 0) {
+		return;
+	}
+
+	// the observed paths moved or went away, the old registrations are
+	// dropped without a deregistration (their notifications get an RST)
+	// and the new paths are observed if the sensor unit is still complete
+	if (changed && sessions[r].used) {
+		LOG_INF("Links of sensor unit %d changed", r);
+		for (int i = 0; i < RESOURCE_TYPE_COUNT; i++) {
+			registration_cancel(cfg, &sessions[r].registrations[i], false);
 		}
+		sessions[r].used = false;
+		directory_hold(r, false);
+		(void)sessions_sync(cfg);
 	}
 
-	k_free(data);
+	if (!more) {
+		return;
+	}
 
-	return 0;
+	(void)coap_send_discovery_request(cfg, from,
+					  (((block2 >> 4) + 1) << 4) | (block2 & 0x7),
+					  NULL, 0);
 }
 
+/* Answers are matched by the token of the discovery, a renewed token leaves
+ * those to an older discovery unmatched
+ */
+static int discovery_subscribe(bool renew)
+{
+	if (discovery && !renew) {
+		return 0;
+	}
+
+	if (discovery) {
+		subscription_remove(discovery);
+	}
+
+	memcpy(discovery_token, coap_next_token(), COAP_TOKEN_MAX_LEN);
+	discovery = subscription_add(discovery_token, COAP_TOKEN_MAX_LEN,
+				     discovery_response, &conf.ipv6);
 
-static int coap_send_observer_request(struct config *cfg, const char * const path[], coap_reply_t reply_cb)
+	return discovery ? 0 : -ENOMEM;
+}
+
+/* Builds the registration into a buffer owned by a pending entry, it is
+ * sent again from there until the sensor unit acknowledges it
+ */
+static int coap_send_observer_request(struct config *cfg, struct registration *reg)
 {
+	struct session *session = &sessions[reg->source];
+	const char *path = directory_path(reg->source, reg->type);
+	struct coap_pending *pending;
 	struct coap_packet request;
-	const char * const *p;
 	uint8_t *data;
 	int r;
 
+	// answered or not, the value is looked at again after this
+	reg->refresh = k_uptime_get_32() + OBSERVE_REFRESH_MIN_MS;
+
+	if (reg->pending) {
+		release_pending(reg->pending);
+	}
+
+	pending = coap_pending_next_unused(pendings, NUM_PENDINGS);
+	if (!pending) {
+		LOG_ERR("No free pending slot");
+		return -ENOMEM;
+	}
+
 	data = (uint8_t *)k_malloc(MAX_COAP_MSG_LEN);
 	if (!data) {
 		return -ENOMEM;
@@ -276,7 +660,7 @@ static int coap_send_observer_request(struct config *cfg, const char * const pat
 
 	r = coap_packet_init(&request, data, MAX_COAP_MSG_LEN,
 			     COAP_VERSION_1, COAP_TYPE_CON,
-			     COAP_TOKEN_MAX_LEN, coap_next_token(),
+			     COAP_TOKEN_MAX_LEN, reg->token,
 			     COAP_METHOD_GET, coap_next_id());
 	if (r < 0) {
 		LOG_ERR("Failed to init CoAP message");
@@ -289,49 +673,477 @@ static int coap_send_observer_request(struct config *cfg, const char * const pat
 		}
 		else
 		{
-			// iterate over path and add to request
-			for (p = path; p && *p; p++) {
-				r = coap_packet_append_option(&request, COAP_OPTION_URI_PATH,
-								*p, strlen(*p));
-				if (r < 0) {
-					LOG_ERR("Unable add option to request");
-					break;
+			r = append_path(&request, path);
+			if (r < 0) {
+				LOG_ERR("Unable add option to request");
+			}
+			if (r == 0 && reg->subscription == NULL) {
+				// the handler of the replies and notifications, it
+				// stays subscribed during retransmissions and refreshes
+				reg->subscription = subscription_add(reg->token,
+								     COAP_TOKEN_MAX_LEN,
+								     notification_cb, reg);
+				if (reg->subscription == NULL) {
+					r = -ENOMEM;
 				}
 			}
 			if (r == 0) {
-			
-				if(reply_acks_wr_ptr < NUM_REPLIES)
-				{
-					net_hexdump("Request", request.data, request.offset);
-
-					// Register a handler for the CoAP replies and notifications
-					struct coap_reply *reply =coap_reply_next_unused((struct coap_reply *)&replies, sizeof(replies));
-					coap_reply_init(reply, &request);
-					reply->reply = reply_cb;
-					reply_acks[reply_acks_wr_ptr] = -1;
-					reply->user_data = &reply_acks[reply_acks_wr_ptr];
-					reply_acks_wr_ptr++;
-
-					static struct sockaddr_in6 mcast_addr = {
-										.sin6_family = AF_INET6,
-										.sin6_addr = ALL_NODES_LOCAL_COAP_MCAST,
-										.sin6_port = htons(COAP_PORT) };
-
-					r = sendto(cfg->coap.sock, request.data, request.offset, 0, (struct sockaddr *) &mcast_addr, sizeof(mcast_addr));
+				r = coap_pending_init(pending, &request,
+						      (struct sockaddr *)&session->addr,
+						      REGISTER_MAX_RETRANSMIT);
+			}
+			if (r == 0) {
+				coap_pending_cycle(pending);
+				reg->pending = pending;
+				data = NULL;
+
+				net_hexdump("Request", request.data, request.offset);
+
+				// unicast to the session, not the group
+				r = sendto(cfg->coap.sock, request.data, request.offset, 0,
+					   (const struct sockaddr *)&session->addr,
+					   sizeof(session->addr));
+				if (r < 0) {
+					LOG_ERR("Failed to send registration: %d", errno);
+					r = -errno;
+				} else {
+					r = 0;
 				}
 			}
 		}
 	}
-	
+
+	// kept by the pending entry once it was sent
+	k_free(data);
+
+	return r;
+}
+
+/* Cancels an observation (RFC 7641 3.6), a GET with Observe 1 and the
+ * token of the registration. Sent as NON, a sensor unit that misses it
+ * removes the observer on the RST to its next notification.
+ */
+static int coap_send_deregistration(struct config *cfg, struct registration *reg)
+{
+	struct session *session = &sessions[reg->source];
+	struct coap_packet request;
+	uint8_t *data;
+	int r;
+
+	data = (uint8_t *)k_malloc(MAX_COAP_MSG_LEN);
+	if (!data) {
+		return -ENOMEM;
+	}
+
+	r = coap_packet_init(&request, data, MAX_COAP_MSG_LEN,
+			     COAP_VERSION_1, COAP_TYPE_NON_CON,
+			     COAP_TOKEN_MAX_LEN, reg->token,
+			     COAP_METHOD_GET, coap_next_id());
+	if (r == 0) {
+		r = coap_append_option_int(&request, COAP_OPTION_OBSERVE, 1);
+	}
+	if (r == 0) {
+		r = append_path(&request, directory_path(reg->source, reg->type));
+	}
+
+	if (r < 0) {
+		LOG_ERR("Failed to build the deregistration");
+	} else {
+		net_hexdump("Request", request.data, request.offset);
+
+		r = sendto(cfg->coap.sock, request.data, request.offset, 0,
+			   (const struct sockaddr *)&session->addr,
+			   sizeof(session->addr));
+		if (r < 0) {
+			LOG_ERR("Failed to send deregistration: %d", errno);
+			r = -errno;
+		} else {
+			r = 0;
+		}
+	}
+
 	k_free(data);
 
 	return r;
 }
 
+/* Starts a new exchange, the token is kept so late notifications and the
+ * answer to a re-registration still match
+ */
+static int registration_start(struct config *cfg, struct registration *reg)
+{
+	if (reg->subscription == NULL) {
+		memcpy(reg->token, coap_next_token(), COAP_TOKEN_MAX_LEN);
+	}
+
+	return coap_send_observer_request(cfg, reg);
+}
+
+static struct registration *registration_of_pending(struct coap_pending *pending)
+{
+	for (int s = 0; s < DIRECTORY_MAX_SERVERS; s++) {
+		for (int i = 0; i < RESOURCE_TYPE_COUNT; i++) {
+			if (sessions[s].registrations[i].pending == pending) {
+				return &sessions[s].registrations[i];
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void release_pending(struct coap_pending *pending)
+{
+	struct registration *reg = registration_of_pending(pending);
+
+	if (reg) {
+		reg->pending = NULL;
+	}
+
+	k_free(pending->data);
+	coap_pending_clear(pending);
+}
+
+/* Unsubscribes the token, notifications still on their way are answered
+ * with RST. The slot is free for the next registration. The value no longer
+ * counts for the aggregate.
+ */
+static void registration_cancel(struct config *cfg, struct registration *reg,
+				bool deregister)
+{
+	if (reg->pending) {
+		release_pending(reg->pending);
+	}
+
+	aggregate_invalidate(reg->source, reg->type);
+
+	if (reg->subscription == NULL) {
+		return;
+	}
+
+	if (reg->active && deregister) {
+		(void)coap_send_deregistration(cfg, reg);
+	}
+
+	subscription_remove(reg->subscription);
+	reg->subscription = NULL;
+	reg->active = false;
+}
+
+/* A stale value leaves the aggregate, the other sensor units take over */
+static void registration_set_stale(struct registration *reg, bool stale)
+{
+	if (reg->stale == stale) {
+		return;
+	}
+
+	reg->stale = stale;
+	if (stale) {
+		LOG_WRN("%s of sensor unit %d is stale",
+			resource_type_name(reg->type), reg->source);
+		aggregate_invalidate(reg->source, reg->type);
+	} else {
+		LOG_INF("%s of sensor unit %d is fresh again",
+			resource_type_name(reg->type), reg->source);
+	}
+}
+
+/* Registers all resource types on a complete sensor unit of the directory */
+static int session_start(struct config *cfg, int server)
+{
+	struct session *session = &sessions[server];
+	int ret;
+
+	LOG_INF("Observing sensor unit %d", server);
+
+	session->addr = *directory_addr(server);
+	session->links_refresh = k_uptime_get_32() + DIRECTORY_REVALIDATE_MS;
+	session->used = true;
+	directory_hold(server, true);
+
+	for (int i = 0; i < RESOURCE_TYPE_COUNT; i++) {
+		struct registration *reg = &session->registrations[i];
+
+		reg->type = i;
+		reg->source = server;
+		reg->seq = -1;
+		reg->refusals = 0;
+		reg->refreshing = false;
+		reg->active = false;
+		reg->stale = false;
+	}
+
+	for (int i = 0; i < RESOURCE_TYPE_COUNT; i++) {
+		ret = registration_start(cfg, &session->registrations[i]);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/* Ends all observations of a sensor unit. One that is given up on is not
+ * deregistered and removed from the directory.
+ */
+static void session_stop(struct config *cfg, int server, bool drop)
+{
+	struct session *session = &sessions[server];
+
+	for (int i = 0; i < RESOURCE_TYPE_COUNT; i++) {
+		registration_cancel(cfg, &session->registrations[i], !drop);
+	}
+
+	session->used = false;
+
+	if (drop) {
+		directory_remove(server);
+	} else {
+		directory_hold(server, false);
+	}
+}
+
+/* Observes the complete sensor units of the directory that are not yet,
+ * e.g. ones answering the discovery late. Returns the number of sessions.
+ */
+static int sessions_sync(struct config *cfg)
+{
+	int count = 0;
+
+	for (int i = 0; i < DIRECTORY_MAX_SERVERS; i++) {
+		if (!sessions[i].used && directory_complete(i) &&
+		    session_start(cfg, i) < 0) {
+			session_stop(cfg, i, false);
+		}
+
+		count += sessions[i].used;
+	}
+
+	return count;
+}
+
+/* Gives up on a sensor unit that does not answer, the others keep feeding
+ * the aggregates while a new discovery looks for a replacement. Returns
+ * -EHOSTUNREACH once none is left.
+ */
+static int session_lost(struct config *cfg, int server)
+{
+	LOG_WRN("Dropping sensor unit %d", server);
+
+	session_stop(cfg, server, true);
+
+	for (int i = 0; i < DIRECTORY_MAX_SERVERS; i++) {
+		if (sessions[i].used) {
+			if (discovery_subscribe(false) == 0) {
+				(void)coap_send_discovery_request(cfg, &mcast_addr, -1,
+								  NULL, 0);
+			}
+			return 0;
+		}
+	}
+
+	return -EHOSTUNREACH;
+}
+
+/* Tried again after a back off, e.g. after a 5.03 of a busy sensor unit */
+static void registration_refused(struct registration *reg, uint8_t code)
+{
+	LOG_WRN("Registration of %s refused (%d.%02d)",
+		directory_path(reg->source, reg->type), code >> 5, code & 0x1f);
+
+	reg->active = false;
+	reg->refusals++;
+	reg->refresh = k_uptime_get_32() +
+		       (CONFIG_COAP_INIT_ACK_TIMEOUT_MS << MIN(reg->refusals, 5));
+}
+
+/* RFC 7641 3.4, sequence numbers are compared in a 2^23 window */
+static bool notification_is_fresh(struct registration *reg, int seq, uint32_t now)
+{
+	if (reg->seq < 0) {
+		return true;
+	}
+
+	return (reg->seq < seq && seq - reg->seq < (1 << 23)) ||
+	       (reg->seq > seq && reg->seq - seq > (1 << 23)) ||
+	       now - reg->seq_time > OBSERVE_FRESHNESS_MS;
+}
+
+/* Called for the answer to a registration and for every notification,
+ * reordered notifications are dropped before they reach the aggregates
+ */
+static void notification_cb(const struct coap_packet *response,
+			    void *user_data,
+			    const struct sockaddr_in6 *from)
+{
+	struct registration *reg = user_data;
+	struct session *session = &sessions[reg->source];
+	uint8_t code = coap_header_get_code(response);
+	uint32_t now = k_uptime_get_32();
+	bool all_active = true;
+	int max_age;
+	int seq;
+
+	// also ends the retransmissions if the ACK was lost
+	if (reg->pending) {
+		release_pending(reg->pending);
+	}
+
+	seq = coap_get_option_int(response, COAP_OPTION_OBSERVE);
+	if (code != COAP_RESPONSE_CODE_CONTENT || seq < 0) {
+		registration_refused(reg, code);
+		return;
+	}
+
+	session_update(session, from);
+	boot_mark(BOOT_FIRST_NOTIFICATION);
+
+	if (!notification_is_fresh(reg, seq, now)) {
+		LOG_DBG("Dropped reordered notification of %s (%d after %d)",
+			resource_type_name(reg->type), seq, reg->seq);
+		return;
+	}
+
+	reg->seq = seq;
+	reg->seq_time = now;
+
+	max_age = coap_get_option_int(response, COAP_OPTION_MAX_AGE);
+	if (max_age < 0) {
+		max_age = COAP_DEFAULT_MAX_AGE;
+	}
+	reg->refresh = now + MAX(max_age * MSEC_PER_SEC, OBSERVE_REFRESH_MIN_MS);
+	reg->refreshing = false;
+	reg->refusals = 0;
+	registration_set_stale(reg, false);
+
+	if (!reg->active) {
+		reg->active = true;
+		LOG_INF("Observing %s of sensor unit %d",
+			directory_path(reg->source, reg->type), reg->source);
+
+		for (int i = 0; i < RESOURCE_TYPE_COUNT; i++) {
+			all_active &= session->registrations[i].active;
+		}
+
+		if (all_active) {
+			boot_mark(BOOT_OBSERVING);
+		}
+	}
+
+	(void)handlers[reg->type](response, reg->source);
+}
+
+/* Retransmits the due registrations, next is set to the time until the
+ * next retransmission or -1 if nothing is pending. A sensor unit that did
+ * not acknowledge the last retransmission is dropped, -EHOSTUNREACH is
+ * returned once none is left.
+ */
+static int pendings_check(struct config *cfg, int32_t *next)
+{
+	struct coap_pending *pending;
+	struct registration *reg;
+	int32_t remaining;
+	int r;
+
+	while ((pending = coap_pending_next_to_expire(pendings, NUM_PENDINGS))) {
+		remaining = pending->t0 + pending->timeout - k_uptime_get_32();
+		if (remaining > 0) {
+			*next = remaining;
+			return 0;
+		}
+
+		if (!coap_pending_cycle(pending)) {
+			reg = registration_of_pending(pending);
+			release_pending(pending);
+			if (!reg) {
+				continue;
+			}
+
+			LOG_WRN("Registration of %s timed out",
+				directory_path(reg->source, reg->type));
+			r = session_lost(cfg, reg->source);
+			if (r < 0) {
+				return r;
+			}
+			continue;
+		}
+
+		net_hexdump("Retransmit", pending->data, pending->len);
+
+		r = sendto(cfg->coap.sock, pending->data, pending->len, 0,
+			   &pending->addr, sizeof(struct sockaddr_in6));
+		if (r < 0) {
+			LOG_ERR("Failed to send %d", errno);
+		}
+	}
+
+	*next = -1;
+
+	return 0;
+}
+
+/* Registers again the resources whose value expired, next is set to the
+ * time until the next expiry. A value is stale once the re-registration
+ * was not answered either. A sensor unit that keeps refusing a
+ * registration is dropped, -EHOSTUNREACH is returned once none is left.
+ */
+static int registrations_check(struct config *cfg, int32_t *next)
+{
+	uint32_t now = k_uptime_get_32();
+	int32_t remaining;
+	int r;
+
+	*next = -1;
+
+	for (int s = 0; s < DIRECTORY_MAX_SERVERS; s++) {
+		for (int i = 0; sessions[s].used && i < RESOURCE_TYPE_COUNT; i++) {
+			struct registration *reg = &sessions[s].registrations[i];
+
+			if (reg->refusals > REGISTER_MAX_RETRANSMIT) {
+				LOG_WRN("Registration of %s refused too often",
+					directory_path(s, reg->type));
+				r = session_lost(cfg, s);
+				if (r < 0) {
+					return r;
+				}
+				break;
+			}
+
+			// retransmitted by pendings_check() until acknowledged
+			if (reg->pending) {
+				continue;
+			}
+
+			remaining = reg->refresh - now;
+			if (remaining <= 0) {
+				if (reg->refreshing && reg->seq >= 0) {
+					registration_set_stale(reg, true);
+				}
+
+				LOG_INF("No notification of %s within Max-Age, registering again",
+					directory_path(s, reg->type));
+				reg->refreshing = true;
+				(void)coap_send_observer_request(cfg, reg);
+				remaining = reg->refresh - now;
+			}
+
+			if (*next < 0 || remaining < *next) {
+				*next = remaining;
+			}
+		}
+	}
+
+	return 0;
+}
+
 int process_coap_reply(struct config *cfg, int flags)
 {
 	struct coap_packet reply;
+	struct sockaddr_in6 from;
+	socklen_t from_len = sizeof(from);
 	uint8_t *data;
+	uint8_t code;
+	bool matched;
 	int rcvd;
 	int ret;
 
@@ -340,7 +1152,8 @@ int process_coap_reply(struct config *cfg, int flags)
 		return -ENOMEM;
 	}
 	LOG_INF("Waiting for Reception");
-	rcvd = recv(cfg->coap.sock, data, MAX_COAP_MSG_LEN, flags);
+	rcvd = recvfrom(cfg->coap.sock, data, MAX_COAP_MSG_LEN, flags,
+			(struct sockaddr *)&from, &from_len);
 	if (rcvd == 0) {
 		ret = -EIO;
 	}
@@ -361,14 +1174,38 @@ int process_coap_reply(struct config *cfg, int flags)
 			ret = coap_packet_parse(&reply, data, rcvd, NULL, 0);
 			if (ret < 0) {
 				LOG_ERR("Invalid data received");
+			}else if((code = coap_header_get_code(&reply)) != COAP_CODE_EMPTY &&
+				 (code >> 5) == 0){
+				// requests share the socket with the notifications
+				(void) handle_config_request(cfg, &reply,
+							     (struct sockaddr *)&from, from_len);
 			}else{
-				(void) coap_response_received(&reply, NULL, (struct coap_reply *) &replies, sizeof(replies));
 				uint8_t type = coap_header_get_type(&reply);
 
+				// an ACK or RST ends the retransmissions of a
+				// registration, piggybacked answers are matched below
+				if (type == COAP_TYPE_ACK || type == COAP_TYPE_RESET) {
+					struct coap_pending *pending = coap_pending_received(&reply, pendings, NUM_PENDINGS);
+					struct registration *reg = pending ? registration_of_pending(pending) : NULL;
+
+					if (pending) {
+						release_pending(pending);
+					}
+					if (reg && type == COAP_TYPE_RESET) {
+						registration_refused(reg, COAP_CODE_EMPTY);
+					}
+				}
+
+				// one lookup by token whatever the number of
+				// subscriptions, every sensor unit answers the
+				// discovery with the same token
+				matched = subscription_dispatch(&reply, &from);
+
+				// answered to the sender, not the group
 				if( type == COAP_TYPE_CON )
 				{
-					send_obs_reply_ack(&reply);
-					
+					send_empty_reply(cfg, &reply, &from,
+							 matched ? COAP_TYPE_ACK : COAP_TYPE_RESET);
 				}
 			}
 		}
@@ -428,95 +1265,189 @@ int start_coap(void)
 	return ret;
 }
 
+/* Returns as soon as a sensor unit offering all resource types is known,
+ * the discovery stays subscribed so the answers of further ones are still
+ * taken. One found on an earlier connection is used right away, it is
+ * dropped again if it does not answer the registrations.
+ */
 int coap_find_server(void)
 {
-	int ret = 0;
-	echo_received = false;
-	while(ret == 0 && echo_received == false)
-	{
-		ret = coap_send_echo_request(&conf.ipv6);
-		if (ret < 0) {
-			return ret;
-		}
+	struct pollfd fds = {
+		.fd = conf.ipv6.coap.sock,
+		.events = POLLIN,
+	};
+	uint32_t timeout = DISCOVERY_TIMEOUT_MS;
+	uint32_t deadline;
+	int32_t remaining;
+	int ret;
+
+	directory_expire();
+	if (directory_select() >= 0) {
+		LOG_INF("Using the known sensor unit");
+		return 0;
+	}
 
-		k_sleep(K_MSEC(5000));
+	ret = discovery_subscribe(true);
+	if (ret < 0) {
+		return ret;
+	}
 
-		ret = process_coap_reply(&conf.ipv6, MSG_DONTWAIT);
+	while (directory_select() < 0) {
+		ret = coap_send_discovery_request(&conf.ipv6, &mcast_addr, -1,
+						  NULL, 0);
 		if (ret < 0) {
 			return ret;
 		}
 
+		// randomized like a CON retransmission, so thermostats
+		// started by the same power cycle do not stay in step
+		deadline = k_uptime_get_32() + timeout +
+			   sys_rand32_get() % (timeout / 2);
+		timeout = MIN(timeout * 2, DISCOVERY_MAX_TIMEOUT_MS);
+
+		// answers are processed as they arrive, the first complete
+		// one ends the discovery
+		while (directory_select() < 0) {
+			remaining = deadline - k_uptime_get_32();
+			if (remaining <= 0) {
+				break;
+			}
+
+			ret = poll(&fds, 1, remaining);
+			if (ret < 0) {
+				LOG_ERR("Poll error %d", errno);
+				return -errno;
+			}
+			if (ret == 0) {
+				break;
+			}
+
+			ret = process_coap_reply(&conf.ipv6, MSG_DONTWAIT);
+			if (ret < 0) {
+				return ret;
+			}
+		}
 	}
-	return ret;
+
+	return 0;
 }
 
+/* Sends all registrations back to back to every complete sensor unit of
+ * the directory without waiting for the replies, they are confirmed and
+ * retransmitted by coap_process(). Sensor units found later are added there.
+ */
 int coap_register_observers(void)
 {
-	int ret = 0;
-	
-	ret = coap_send_observer_request(&conf.ipv6, temperature_path, notification_cb_temp);
-	if (ret < 0) {
-		return ret;
+	// sensor units of a former run, if they are still there, stop
+	// notifying the old tokens. Their values left the aggregates and
+	// count again with the first notification of the new registration.
+	for (int i = 0; i < DIRECTORY_MAX_SERVERS; i++) {
+		if (sessions[i].used) {
+			session_stop(&conf.ipv6, i, false);
+		}
 	}
 
-	ret = process_coap_reply(&conf.ipv6, 0);
-	if (ret < 0) {
-		LOG_ERR("process_coap_replD");
-		return ret;
+	if (sessions_sync(&conf.ipv6) == 0) {
+		return -EHOSTUNREACH;
 	}
 
-	ret = coap_send_observer_request(&conf.ipv6, humidity_path, notification_cb_humidity);
-	if (ret < 0) {
-		return ret;
-	}
+	return 0;
+}
 
-	ret = process_coap_reply(&conf.ipv6, 0);
-	if (ret < 0) {
-		LOG_ERR("process_coap_replD");
-		return ret;
-	}
+/* Validates the links of the observed sensor units with their ETag, a
+ * changed answer updates the directory, e.g. the zone. next is set to the
+ * time until the next validation or -1 without sessions. The answer goes to
+ * discovery_response(), a lost one is asked for again next time.
+ */
+static void links_check(struct config *cfg, int32_t *next)
+{
+	uint8_t etag[DIRECTORY_ETAG_LEN];
+	uint32_t now = k_uptime_get_32();
+	int32_t remaining;
 
-	ret = coap_send_observer_request(&conf.ipv6, air_quality_path, notification_cb_air_quality);
-	if (ret < 0) {
-		return ret;
+	*next = -1;
+
+	for (int s = 0; s < DIRECTORY_MAX_SERVERS; s++) {
+		if (!sessions[s].used) {
+			continue;
+		}
+
+		remaining = sessions[s].links_refresh - now;
+		if (remaining <= 0 && discovery_subscribe(false) == 0) {
+			(void)coap_send_discovery_request(cfg, &sessions[s].addr, -1,
+							  etag, directory_etag(s, etag));
+			sessions[s].links_refresh = now + DIRECTORY_REVALIDATE_MS;
+			remaining = DIRECTORY_REVALIDATE_MS;
+		}
+
+		if (*next < 0 || MAX(remaining, 0) < *next) {
+			*next = MAX(remaining, 0);
+		}
 	}
+}
+
+/* Waits for the next packet, retransmission or expiry, whatever comes first */
+int coap_process(void)
+{
+	struct pollfd fds = {
+		.fd = conf.ipv6.coap.sock,
+		.events = POLLIN,
+	};
+	int32_t timeout;
+	int32_t refresh;
+	int32_t revalidate;
+	int ret = 0;
 
-	ret = process_coap_reply(&conf.ipv6, 0);
+	ret = pendings_check(&conf.ipv6, &timeout);
+	if (ret == 0) {
+		ret = registrations_check(&conf.ipv6, &refresh);
+	}
 	if (ret < 0) {
-		LOG_ERR("process_coap_replD");
 		return ret;
 	}
 
-	ret = coap_send_observer_request(&conf.ipv6, presence_path, notification_cb_presence);
-	if (ret < 0) {
-		return ret;
+	links_check(&conf.ipv6, &revalidate);
+
+	if (timeout < 0 || (refresh >= 0 && refresh < timeout)) {
+		timeout = refresh;
+	}
+	if (timeout < 0 || (revalidate >= 0 && revalidate < timeout)) {
+		timeout = revalidate;
 	}
 
-	ret = process_coap_reply(&conf.ipv6, 0);
+	ret = poll(&fds, 1, timeout);
 	if (ret < 0) {
-		LOG_ERR("process_coap_replD");
-		return ret;
+		LOG_ERR("Poll error %d", errno);
+		return -errno;
 	}
 
-	return ret;
-}
-
-int coap_process(void)
-{
-	int ret = 0;
+	if (ret == 0) {
+		return 0;
+	}
 
-	ret = process_coap_reply(&conf.ipv6, 0);
+	ret = process_coap_reply(&conf.ipv6, MSG_DONTWAIT);
 	if (ret < 0) {
 		LOG_ERR("process_coap_replD");
 		return ret;
 	}
 
+	// a late answer to the discovery may have completed another one
+	(void)sessions_sync(&conf.ipv6);
+
 	return ret;
 }
 
 
 void stop_coap(void)
 {
+	// values of sensor units behind a lost connection no longer count,
+	// the directory is kept to find them again after reconnecting
+	for (int i = 0; i < DIRECTORY_MAX_SERVERS; i++) {
+		if (sessions[i].used) {
+			session_stop(&conf.ipv6, i, false);
+		}
+	}
+
 	if (conf.ipv6.coap.sock >= 0) {
 		(void)close(conf.ipv6.coap.sock);
 	}
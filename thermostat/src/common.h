@@ -31,6 +31,197 @@ extern struct k_mem_domain app_domain;
 #endif
 
 
+//--------------------------------------------------------
+// Runtime configuration
+//--------------------------------------------------------
+
+/* Defaults of the control limits, changed at runtime through /config */
+#ifndef TEMP_MIN
+	#define TEMP_MIN 24.0
+#endif
+
+#ifndef TEMP_MAX
+	#define TEMP_MAX 28.0
+#endif
+
+#ifndef TEMP_MIN_PRESENCE
+	#define TEMP_MIN_PRESENCE 25.0
+#endif
+
+#ifndef TEMP_MAX_PRESENCE
+	#define TEMP_MAX_PRESENCE 27.0
+#endif
+
+#ifndef HUMIDITY_MAX
+	#define HUMIDITY_MAX 75.0
+#endif
+
+#ifndef AIQ_MAX
+	#define AIQ_MAX 100
+#endif
+
+/* Defaults of the heating and cooling controller, see controller.c */
+#ifndef CONTROLLER_DEFAULT
+	#define CONTROLLER_DEFAULT CONTROLLER_HYSTERESIS
+#endif
+
+#ifndef HYSTERESIS
+	#define HYSTERESIS 0.5
+#endif
+
+/* Compressor protection in seconds, an output stays on and off at least
+ * this long and heating and cooling are apart by the dwell time
+ */
+#ifndef MIN_ON_TIME
+	#define MIN_ON_TIME 180
+#endif
+
+#ifndef MIN_OFF_TIME
+	#define MIN_OFF_TIME 300
+#endif
+
+#ifndef DWELL_TIME
+	#define DWELL_TIME 300
+#endif
+
+/* PI mode, duty cycle per degree off the band, integral time and the period
+ * the duty cycle is spread over in seconds
+ */
+#ifndef PI_KP
+	#define PI_KP 0.5
+#endif
+
+#ifndef PI_TI
+	#define PI_TI 1800
+#endif
+
+#ifndef PI_PERIOD
+	#define PI_PERIOD 600
+#endif
+
+/* Controllers deciding on heating and cooling, X(ID, name) */
+#define CONTROLLERS(X) \
+	X(HYSTERESIS, "hysteresis") \
+	X(PI, "pi")
+
+#define CONTROLLER_ID(ID, name) CONTROLLER_##ID,
+
+enum controller_type {
+	CONTROLLERS(CONTROLLER_ID)
+	CONTROLLER_COUNT
+};
+
+enum cfg_type {
+	CFG_TYPE_UINT,
+	CFG_TYPE_DECIMAL,	/* stored in thousandths, written as "24.5" */
+};
+
+#define CFG_MILLI(value) ((int32_t)((value) * 1000))
+
+/*
+ * X-macro of the parameters published below /config, X(ID, name, type,
+ * default, min, max). Decimal limits are given in thousandths. A name has to
+ * fit into one Uri-Path option of 12 bytes.
+ */
+#define CFG_PARAMS(X) \
+	X(TEMP_MIN, "temp_min", CFG_TYPE_DECIMAL, CFG_MILLI(TEMP_MIN), 5000, 35000) \
+	X(TEMP_MAX, "temp_max", CFG_TYPE_DECIMAL, CFG_MILLI(TEMP_MAX), 5000, 35000) \
+	X(TEMP_MIN_PRESENCE, "temp_min_occ", CFG_TYPE_DECIMAL, \
+	  CFG_MILLI(TEMP_MIN_PRESENCE), 5000, 35000) \
+	X(TEMP_MAX_PRESENCE, "temp_max_occ", CFG_TYPE_DECIMAL, \
+	  CFG_MILLI(TEMP_MAX_PRESENCE), 5000, 35000) \
+	X(HUMIDITY_MAX, "hum_max", CFG_TYPE_DECIMAL, CFG_MILLI(HUMIDITY_MAX), 0, 100000) \
+	X(AIQ_MAX, "aiq_max", CFG_TYPE_UINT, AIQ_MAX, 0, 500) \
+	X(CONTROLLER, "controller", CFG_TYPE_UINT, CONTROLLER_DEFAULT, 0, \
+	  CONTROLLER_COUNT - 1) \
+	X(HYSTERESIS, "hysteresis", CFG_TYPE_DECIMAL, CFG_MILLI(HYSTERESIS), 0, 5000) \
+	X(MIN_ON_TIME, "min_on", CFG_TYPE_UINT, MIN_ON_TIME, 0, 3600) \
+	X(MIN_OFF_TIME, "min_off", CFG_TYPE_UINT, MIN_OFF_TIME, 0, 3600) \
+	X(DWELL_TIME, "dwell", CFG_TYPE_UINT, DWELL_TIME, 0, 3600) \
+	X(PI_KP, "pi_kp", CFG_TYPE_DECIMAL, CFG_MILLI(PI_KP), 0, 10000) \
+	X(PI_TI, "pi_ti", CFG_TYPE_UINT, PI_TI, 0, 86400) \
+	X(PI_PERIOD, "pi_period", CFG_TYPE_UINT, PI_PERIOD, 60, 3600)
+
+#define CFG_PARAM_ID(ID, name, type, def, min, max) CFG_##ID,
+
+enum cfg_param {
+	CFG_PARAMS(CFG_PARAM_ID)
+	CFG_PARAM_COUNT
+};
+
+//--------------------------------------------------------
+// Resource discovery
+//--------------------------------------------------------
+
+/* Sensor units remembered at the same time, all complete ones are observed.
+ * Further ones replace the unobserved entry that expires first.
+ */
+#ifndef DIRECTORY_MAX_SERVERS
+	#define DIRECTORY_MAX_SERVERS 4
+#endif
+
+/* Links of observed sensor units are validated this often with their
+ * ETag, a zone written through /config/zone is picked up within it instead
+ * of the Max-Age of the links
+ */
+#ifndef DIRECTORY_REVALIDATE_MS
+	#define DIRECTORY_REVALIDATE_MS (120 * MSEC_PER_SEC)
+#endif
+
+/* Longest ETag of a link-format answer (RFC 7252 5.10.6) */
+#define DIRECTORY_ETAG_LEN 8
+
+enum aggregate_mode {
+	AGGREGATE_MEDIAN,	/* robust against a single sensor off the mark */
+	AGGREGATE_MAX,		/* worst reading, or occupied if any unit says so */
+};
+
+/* Resources the thermostat observes, X(ID, rt, mode) with the resource type
+ * the sensor units publish in /.well-known/core and how the values of
+ * several sensor units are combined
+ */
+#define RESOURCE_TYPES(X) \
+	X(TEMPERATURE, "temperature", AGGREGATE_MEDIAN) \
+	X(HUMIDITY, "humidity", AGGREGATE_MEDIAN) \
+	X(AIR_QUALITY, "air_quality", AGGREGATE_MAX) \
+	X(OCCUPANCY, "occupancy", AGGREGATE_MAX)
+
+#define RESOURCE_TYPE_ID(ID, rt, mode) RESOURCE_##ID,
+
+enum resource_type {
+	RESOURCE_TYPES(RESOURCE_TYPE_ID)
+	RESOURCE_TYPE_COUNT
+};
+
+//--------------------------------------------------------
+// HVAC zones
+//--------------------------------------------------------
+
+#include <zephyr/devicetree.h>
+
+/* Zones declared as thermostat,hvac-zone nodes in the devicetree, boards
+ * without them drive a single zone from the led0, led1 and led2 aliases
+ */
+#define HVAC_ZONE_COUNT MAX(DT_NUM_INST_STATUS_OKAY(thermostat_hvac_zone), 1)
+
+/* Milestones of the boot timeline, X(ID, description) in the usual order */
+#define BOOT_MILESTONES(X) \
+	X(MAIN, "main") \
+	X(CONFIG, "configuration loaded") \
+	X(COAP_BOUND, "CoAP socket bound") \
+	X(NETWORK, "network connected") \
+	X(SERVER_FOUND, "sensor unit found") \
+	X(OBSERVING, "observers registered") \
+	X(FIRST_NOTIFICATION, "first notification") \
+	X(FIRST_ACTUATION, "first actuation")
+
+#define BOOT_MILESTONE_ID(ID, desc) BOOT_##ID,
+
+enum boot_milestone {
+	BOOT_MILESTONES(BOOT_MILESTONE_ID)
+	BOOT_MILESTONE_COUNT
+};
+
 struct config {
 	const char *proto;
 
@@ -67,20 +258,116 @@ extern int buffer_len;
 extern struct configs conf;
 
 
+void boot_mark(enum boot_milestone milestone);
+
 void init_display(void);
 
+struct sockaddr_in6;
+
+void directory_expire(void);
+int directory_links(const struct sockaddr_in6 *addr, uint32_t block,
+		    const uint8_t *data, size_t len, bool more, uint32_t max_age,
+		    const uint8_t *etag, uint8_t etag_len, bool *changed);
+int directory_valid(const struct sockaddr_in6 *addr, uint32_t max_age);
+uint8_t directory_etag(int server, uint8_t *etag);
+int directory_select(void);
+bool directory_complete(int server);
+void directory_hold(int server, bool hold);
+void directory_remove(int server);
+const struct sockaddr_in6 *directory_addr(int server);
+int directory_zone(int server);
+const char *directory_path(int server, enum resource_type type);
+const char *resource_type_name(enum resource_type type);
+
+struct coap_packet;
+struct subscription;
+
+typedef void (*subscription_cb_t)(const struct coap_packet *response,
+				  void *user_data,
+				  const struct sockaddr_in6 *from);
+
+struct subscription *subscription_add(const uint8_t *token, uint8_t tkl,
+				      subscription_cb_t cb, void *user_data);
+struct subscription *subscription_find(const uint8_t *token, uint8_t tkl);
+void subscription_remove(struct subscription *s);
+bool subscription_dispatch(const struct coap_packet *response,
+			   const struct sockaddr_in6 *from);
+
+void aggregate_update(int source, enum resource_type type, int32_t value);
+void aggregate_invalidate(int source, enum resource_type type);
+
 int start_coap(void);
 int coap_find_server(void);
 int coap_register_observers(void);
 int coap_process(void);
 void stop_coap(void);
 
-int hvac_init(double temp_min, double temp_max, double temp_min_presence, double temp_max_presence, double hum_max, int air_qual_max);
-void hvac_update_temperatur(double temp);
-void hvac_update_humidity(double hum);
-void hvac_update_air_quality(int air_qual);
-void hvac_update_pressence(int presence);
+void config_init(void);
+int config_find(const char *name, size_t len);
+int32_t config_get(enum cfg_param param);
+void config_snapshot(int32_t *values);
+int config_format(int param, char *buf, size_t len);
+int config_write(const char *data, size_t len);
+int config_write_one(enum cfg_param param, const char *value, size_t len);
+int config_parse_decimal(const char *value, size_t len, int32_t *result);
+
+/* Outputs of an HVAC zone */
+enum hvac_output {
+	HVAC_HEATING,
+	HVAC_COOLING,
+	HVAC_VENTING,
+	HVAC_OUTPUT_COUNT
+};
+
+/* Tuning of the controller, times in ms and temperatures in thousandths */
+struct controller_params {
+	uint8_t type;
+	int32_t hysteresis;
+	uint32_t min_on_ms;
+	uint32_t min_off_ms;
+	uint32_t dwell_ms;
+	int32_t kp;		/* thousandths of duty cycle per degree */
+	uint32_t ti_ms;
+	uint32_t period_ms;
+};
+
+/* Heating and cooling of one zone as the controller left them */
+struct controller_state {
+	int64_t integral[2];	/* heating and cooling, thousandths of a degree times ms */
+	uint32_t last_time;
+	uint32_t cycle_start;
+	uint32_t changed_at[2];	/* uptime of the last switch of heating and cooling */
+	uint8_t demand;		/* outputs the controller asked for */
+	uint8_t outputs;	/* outputs switched on after the protection times */
+	uint8_t switched;	/* outputs switched at least once since boot */
+	uint8_t type;
+};
+
+const char *controller_name(enum controller_type type);
+uint8_t controller_run(struct controller_state *state,
+		       const struct controller_params *params,
+		       int32_t temperature, int32_t band_min, int32_t band_max,
+		       bool stale, uint32_t now, uint32_t *wait_ms);
+
+struct hvac_stats {
+	uint32_t changes;		/* inputs and limits that woke the loop */
+	uint32_t evaluations;		/* control passes run for them */
+	uint64_t latency_cycles;	/* sum from change to actuation */
+	uint32_t max_latency_cycles;
+	uint32_t max_control_cycles;	/* longest controller_run() */
+};
+
+int hvac_init(void);
+void hvac_limits_changed(void);
+void hvac_get_stats(struct hvac_stats *stats);
+uint32_t hvac_zones_of(int sensor_zone);
+void hvac_update_temperatur(int zone, int32_t temp);
+void hvac_update_humidity(int zone, int32_t hum);
+void hvac_update_air_quality(int zone, int air_qual);
+void hvac_update_pressence(int zone, int presence);
+void hvac_set_stale(int zone, enum resource_type type, bool stale);
 
-void display_update_temperatur(double temp);
-void display_update_humidity(double hum);
-void display_update_air_quality(int air_qual);
\ No newline at end of file
+void display_update_temperatur(int32_t temp);
+void display_update_humidity(int32_t hum);
+void display_update_air_quality(int air_qual);
+void display_set_stale(enum resource_type type, bool stale);
\ No newline at end of file
@@ -0,0 +1,486 @@
+/* config.c - Runtime configuration published below /config */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(config, LOG_LEVEL_INF);
+
+#include <zephyr/zephyr.h>
+#include <zephyr/settings/settings.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+//--------------------------------------------------------
+// Storage parameters
+//--------------------------------------------------------
+
+/* Changes are collected this long before they are written to flash, a client
+ * tuning several values only costs one batch of writes
+ */
+#ifndef CFG_SAVE_DELAY_MS
+	#define CFG_SAVE_DELAY_MS 10000
+#endif
+
+/* Longest "name=value" item of a write */
+#define CFG_ITEM_LEN 40
+
+BUILD_ASSERT(CFG_PARAM_COUNT <= 32, "changed masks are 32 bit");
+
+#define CFG_NAME_CHECK(ID, name, type, def, min, max) \
+	BUILD_ASSERT(sizeof(name) - 1 <= 12, "/config/" name " does not fit into a Uri-Path option");
+
+CFG_PARAMS(CFG_NAME_CHECK)
+
+//--------------------------------------------------------
+// Static helper functions
+//--------------------------------------------------------
+
+static void config_save(struct k_work *work);
+
+//--------------------------------------------------------
+// Runtime Variables
+//--------------------------------------------------------
+
+struct cfg_desc {
+	const char *name;
+	uint8_t type;
+	int32_t def;
+	int32_t min;
+	int32_t max;
+};
+
+#define CFG_PARAM_DESC(ID, _name, _type, _def, _min, _max) \
+	[CFG_##ID] = { .name = _name, .type = _type, .def = _def, \
+		       .min = _min, .max = _max },
+
+static const struct cfg_desc params[CFG_PARAM_COUNT] = {
+	CFG_PARAMS(CFG_PARAM_DESC)
+};
+
+#define CFG_PARAM_DEFAULT(ID, name, type, def, min, max) [CFG_##ID] = def,
+
+/* Single values are read without the lock, writers hold it while all values
+ * of a request are stored. The defaults are valid before config_init().
+ */
+static atomic_t values[CFG_PARAM_COUNT] = {
+	CFG_PARAMS(CFG_PARAM_DEFAULT)
+};
+/* Value in flash, the default if there is no entry */
+static int32_t stored[CFG_PARAM_COUNT] = {
+	CFG_PARAMS(CFG_PARAM_DEFAULT)
+};
+static ATOMIC_DEFINE(dirty, CFG_PARAM_COUNT);
+
+static K_MUTEX_DEFINE(config_lock);
+static K_WORK_DELAYABLE_DEFINE(save_work, config_save);
+
+//--------------------------------------------------------
+// Function Implementations
+//--------------------------------------------------------
+
+int config_find(const char *name, size_t len)
+{
+	for (int i = 0; i < CFG_PARAM_COUNT; i++) {
+		if (strlen(params[i].name) == len &&
+		    memcmp(params[i].name, name, len) == 0) {
+			return i;
+		}
+	}
+
+	return -ENOENT;
+}
+
+/* Decimals take up to three fraction digits, further digits are cut off */
+static int parse_decimal(const char *s, int32_t *value)
+{
+	bool negative = *s == '-';
+	int32_t scale = 1000;
+	int64_t v = 0;
+
+	if (*s == '-' || *s == '+') {
+		s++;
+	}
+
+	if (*s < '0' || *s > '9') {
+		return -EINVAL;
+	}
+
+	for (; *s >= '0' && *s <= '9'; s++) {
+		v = v * 10 + (*s - '0');
+		if (v > INT32_MAX / 1000) {
+			return -EINVAL;
+		}
+	}
+	v *= 1000;
+
+	if (*s == '.') {
+		for (s++; *s >= '0' && *s <= '9'; s++) {
+			if (scale > 1) {
+				scale /= 10;
+				v += (*s - '0') * scale;
+			}
+		}
+	}
+
+	if (*s != '\0') {
+		return -EINVAL;
+	}
+
+	*value = negative ? -v : v;
+
+	return 0;
+}
+
+/* A decimal of a sensor unit payload, e.g. "23.500", in thousandths */
+int config_parse_decimal(const char *value, size_t len, int32_t *result)
+{
+	char buf[16];
+
+	if (len == 0 || len >= sizeof(buf)) {
+		return -EINVAL;
+	}
+
+	memcpy(buf, value, len);
+	buf[len] = '\0';
+
+	return parse_decimal(buf, result);
+}
+
+static int parse_value(int param, const char *value, size_t len,
+		       int32_t *result)
+{
+	const struct cfg_desc *desc = &params[param];
+	char buf[16];
+	char *end;
+	int r = 0;
+
+	if (len == 0 || len >= sizeof(buf)) {
+		return -EINVAL;
+	}
+
+	memcpy(buf, value, len);
+	buf[len] = '\0';
+
+	switch (desc->type) {
+	case CFG_TYPE_UINT:
+		if (buf[0] < '0' || buf[0] > '9') {
+			return -EINVAL;
+		}
+		*result = strtoul(buf, &end, 10);
+		if (*end != '\0') {
+			r = -EINVAL;
+		}
+		break;
+	case CFG_TYPE_DECIMAL:
+		r = parse_decimal(buf, result);
+		break;
+	default:
+		r = -EINVAL;
+	}
+
+	if (r == 0 && (*result < desc->min || *result > desc->max)) {
+		r = -ERANGE;
+	}
+
+	return r;
+}
+
+static int format_value(int param, int32_t value, char *buf, size_t len)
+{
+	if (params[param].type == CFG_TYPE_DECIMAL) {
+		return snprintk(buf, len, "%s%d.%03d", value < 0 ? "-" : "",
+				abs(value) / 1000, abs(value) % 1000);
+	}
+
+	return snprintk(buf, len, "%d", value);
+}
+
+/* A lower limit has to stay below its upper limit by more than the
+ * hysteresis, otherwise heating would run on into the cooling threshold
+ * and the other way round. Checked for both bands, the hysteresis is never
+ * negative.
+ */
+static bool config_consistent(const int32_t *candidate)
+{
+	int32_t hysteresis = candidate[CFG_HYSTERESIS];
+
+	return hysteresis < candidate[CFG_TEMP_MAX] - candidate[CFG_TEMP_MIN] &&
+	       hysteresis < candidate[CFG_TEMP_MAX_PRESENCE] -
+			    candidate[CFG_TEMP_MIN_PRESENCE];
+}
+
+/* Stores the values marked in written, called with the lock held. Either all
+ * of them are taken or none.
+ */
+static int config_apply(int32_t *candidate, uint32_t written)
+{
+	uint32_t changed = 0;
+
+	for (int i = 0; i < CFG_PARAM_COUNT; i++) {
+		if (!(written & BIT(i))) {
+			candidate[i] = atomic_get(&values[i]);
+		} else if (candidate[i] != atomic_get(&values[i])) {
+			changed |= BIT(i);
+		}
+	}
+
+	if (!config_consistent(candidate)) {
+		return -EINVAL;
+	}
+
+	if (!changed) {
+		return 0;
+	}
+
+	for (int i = 0; i < CFG_PARAM_COUNT; i++) {
+		if (changed & BIT(i)) {
+			atomic_set(&values[i], candidate[i]);
+			atomic_set_bit(dirty, i);
+			LOG_INF("%s = %d", params[i].name, candidate[i]);
+		}
+	}
+
+	hvac_limits_changed();
+
+	/* Not rescheduled while pending, the batch is written
+	 * CFG_SAVE_DELAY_MS after its first change
+	 */
+	k_work_schedule(&save_work, K_MSEC(CFG_SAVE_DELAY_MS));
+
+	return 0;
+}
+
+int32_t config_get(enum cfg_param param)
+{
+	return atomic_get(&values[param]);
+}
+
+/* A single value, or "name=value" lines of all parameters if param is
+ * negative. Returns -ENOMEM if the text does not fit into buf.
+ */
+int config_format(int param, char *buf, size_t len)
+{
+	int pos = 0;
+
+	if (param >= CFG_PARAM_COUNT) {
+		return -EINVAL;
+	}
+
+	if (param >= 0) {
+		pos = format_value(param, config_get(param), buf, len);
+		return pos < len ? pos : -ENOMEM;
+	}
+
+	k_mutex_lock(&config_lock, K_FOREVER);
+
+	for (int i = 0; i < CFG_PARAM_COUNT && pos < len; i++) {
+		pos += snprintk(&buf[pos], len - pos, "%s=", params[i].name);
+		if (pos < len) {
+			pos += format_value(i, atomic_get(&values[i]),
+					    &buf[pos], len - pos);
+		}
+		if (pos < len) {
+			pos += snprintk(&buf[pos], len - pos, "\n");
+		}
+	}
+
+	k_mutex_unlock(&config_lock);
+
+	return pos < len ? pos : -ENOMEM;
+}
+
+/* Takes "name=value" items separated by ';' or newlines, nothing is changed
+ * if one of them is invalid
+ */
+int config_write(const char *data, size_t len)
+{
+	int32_t candidate[CFG_PARAM_COUNT];
+	uint32_t written = 0;
+	int r = 0;
+
+	k_mutex_lock(&config_lock, K_FOREVER);
+
+	while (len > 0) {
+		size_t item_len = 0;
+		const char *eq;
+		int param;
+
+		while (item_len < len && data[item_len] != ';' &&
+		       data[item_len] != '\n') {
+			item_len++;
+		}
+
+		eq = memchr(data, '=', item_len);
+		if (item_len > 0) {
+			if (!eq || item_len > CFG_ITEM_LEN) {
+				r = -EINVAL;
+				break;
+			}
+
+			param = config_find(data, eq - data);
+			if (param < 0) {
+				r = param;
+				break;
+			}
+
+			r = parse_value(param, eq + 1, item_len - (eq - data) - 1,
+					&candidate[param]);
+			if (r < 0) {
+				break;
+			}
+
+			written |= BIT(param);
+		}
+
+		data += MIN(item_len + 1, len);
+		len -= MIN(item_len + 1, len);
+	}
+
+	if (r == 0) {
+		r = config_apply(candidate, written);
+	}
+
+	k_mutex_unlock(&config_lock);
+
+	return r;
+}
+
+int config_write_one(enum cfg_param param, const char *value, size_t len)
+{
+	int32_t candidate[CFG_PARAM_COUNT];
+	int r;
+
+	k_mutex_lock(&config_lock, K_FOREVER);
+
+	r = parse_value(param, value, len, &candidate[param]);
+	if (r == 0) {
+		r = config_apply(candidate, BIT(param));
+	}
+
+	k_mutex_unlock(&config_lock);
+
+	return r;
+}
+
+/* All values of one configuration, never a mix of two writes */
+void config_snapshot(int32_t *snapshot)
+{
+	k_mutex_lock(&config_lock, K_FOREVER);
+
+	for (int i = 0; i < CFG_PARAM_COUNT; i++) {
+		snapshot[i] = atomic_get(&values[i]);
+	}
+
+	k_mutex_unlock(&config_lock);
+}
+
+//--------------------------------------------------------
+// Persistence
+//--------------------------------------------------------
+
+/* Writes the values changed since the last batch, a value set back to its
+ * default removes the entry instead
+ */
+static void config_save(struct k_work *work)
+{
+	char key[sizeof("cfg/") + CFG_ITEM_LEN];
+	int32_t value;
+	int r;
+
+	k_mutex_lock(&config_lock, K_FOREVER);
+
+	for (int i = 0; i < CFG_PARAM_COUNT; i++) {
+		if (!atomic_test_and_clear_bit(dirty, i)) {
+			continue;
+		}
+
+		value = atomic_get(&values[i]);
+		if (value == stored[i]) {
+			continue;
+		}
+
+		snprintk(key, sizeof(key), "cfg/%s", params[i].name);
+		if (value == params[i].def) {
+			r = settings_delete(key);
+		} else {
+			r = settings_save_one(key, &value, sizeof(value));
+		}
+
+		if (r < 0) {
+			LOG_WRN("Failed to store %s: %d", params[i].name, r);
+			continue;
+		}
+
+		stored[i] = value;
+	}
+
+	k_mutex_unlock(&config_lock);
+}
+
+static int config_settings_set(const char *name, size_t len,
+			       settings_read_cb read_cb, void *cb_arg)
+{
+	const char *next;
+	int32_t value;
+	int r;
+
+	for (int i = 0; i < CFG_PARAM_COUNT; i++) {
+		if (!settings_name_steq(name, params[i].name, &next) || next) {
+			continue;
+		}
+
+		if (len != sizeof(value)) {
+			return -EINVAL;
+		}
+
+		r = read_cb(cb_arg, &value, sizeof(value));
+		if (r < 0) {
+			return r;
+		}
+
+		/* Limits may have changed with the firmware */
+		if (value < params[i].min || value > params[i].max) {
+			LOG_WRN("Stored %s out of range, using the default",
+				params[i].name);
+			return 0;
+		}
+
+		atomic_set(&values[i], value);
+		stored[i] = value;
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(cfg, "cfg", NULL, config_settings_set, NULL, NULL);
+
+void config_init(void)
+{
+	int r;
+
+	r = settings_load_subtree("cfg");
+	if (r < 0) {
+		LOG_WRN("Failed to load the configuration: %d", r);
+	}
+
+	/* Stored limits may contradict each other with changed defaults */
+	int32_t loaded[CFG_PARAM_COUNT];
+
+	config_snapshot(loaded);
+	if (!config_consistent(loaded)) {
+		LOG_WRN("Stored configuration inconsistent, using the defaults");
+		for (int i = 0; i < CFG_PARAM_COUNT; i++) {
+			atomic_set(&values[i], params[i].def);
+			atomic_set_bit(dirty, i);
+		}
+		k_work_schedule(&save_work, K_MSEC(CFG_SAVE_DELAY_MS));
+	}
+}
@@ -0,0 +1,257 @@
+/* controller.c - Heating and cooling decisions of a zone */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(controller, LOG_LEVEL_INF);
+
+#include <zephyr/zephyr.h>
+#include <string.h>
+
+#include "common.h"
+
+//--------------------------------------------------------
+// Runtime Variables
+//--------------------------------------------------------
+
+/* Index 0 is heating and 1 cooling in the per output arrays of the state */
+#define OUTPUT_MASK (BIT(HVAC_HEATING) | BIT(HVAC_COOLING))
+
+BUILD_ASSERT(HVAC_HEATING == 0 && HVAC_COOLING == 1,
+	     "heating and cooling index the controller state");
+
+/* Only integer arithmetic and no data dependent loops, every controller
+ * takes the same time on each call
+ */
+typedef uint8_t (*controller_demand_t)(struct controller_state *state,
+				       const struct controller_params *params,
+				       int32_t temperature, int32_t band_min,
+				       int32_t band_max, uint32_t now,
+				       uint32_t *wait_ms);
+
+static uint8_t hysteresis_demand(struct controller_state *state,
+				 const struct controller_params *params,
+				 int32_t temperature, int32_t band_min,
+				 int32_t band_max, uint32_t now,
+				 uint32_t *wait_ms);
+static uint8_t pi_demand(struct controller_state *state,
+			 const struct controller_params *params,
+			 int32_t temperature, int32_t band_min,
+			 int32_t band_max, uint32_t now, uint32_t *wait_ms);
+
+#define CONTROLLER_NAME(ID, name) [CONTROLLER_##ID] = name,
+
+static const char * const controller_names[CONTROLLER_COUNT] = {
+	CONTROLLERS(CONTROLLER_NAME)
+};
+
+static const controller_demand_t controllers[CONTROLLER_COUNT] = {
+	[CONTROLLER_HYSTERESIS] = hysteresis_demand,
+	[CONTROLLER_PI] = pi_demand,
+};
+
+//--------------------------------------------------------
+// Function Implementations
+//--------------------------------------------------------
+
+const char *controller_name(enum controller_type type)
+{
+	return controller_names[type];
+}
+
+static void wait_at_most(uint32_t *wait_ms, uint32_t ms)
+{
+	*wait_ms = MIN(*wait_ms, ms);
+}
+
+/* Heating starts below the band and runs until the temperature is the
+ * hysteresis into it, cooling the same way from above
+ */
+static uint8_t hysteresis_demand(struct controller_state *state,
+				 const struct controller_params *params,
+				 int32_t temperature, int32_t band_min,
+				 int32_t band_max, uint32_t now,
+				 uint32_t *wait_ms)
+{
+	uint8_t demand = 0;
+
+	if (temperature > band_max ||
+	    ((state->demand & BIT(HVAC_COOLING)) &&
+	     temperature > band_max - params->hysteresis)) {
+		demand = BIT(HVAC_COOLING);
+	} else if (temperature < band_min ||
+		   ((state->demand & BIT(HVAC_HEATING)) &&
+		    temperature < band_min + params->hysteresis)) {
+		demand = BIT(HVAC_HEATING);
+	}
+
+	return demand;
+}
+
+/* Duty cycle in thousandths for a temperature error in thousandths of a
+ * degree. The integral never drops below zero and stops growing once it
+ * alone gives the full duty cycle.
+ */
+static int32_t pi_duty(int64_t *integral, const struct controller_params *params,
+		       int32_t error, uint32_t dt)
+{
+	int64_t duty = error;
+
+	if (params->ti_ms == 0 || params->kp == 0) {
+		*integral = 0;
+	} else {
+		int64_t limit = (int64_t)1000 * 1000 * params->ti_ms / params->kp;
+
+		*integral = MIN(MAX(*integral + (int64_t)error * dt, 0), limit);
+		duty += *integral / params->ti_ms;
+	}
+
+	duty = duty * params->kp / 1000;
+
+	return MIN(MAX(duty, 0), 1000);
+}
+
+/* Time proportioning, within each period heating or cooling is on for the
+ * duty cycle of the PI term of its distance to the band
+ */
+static uint8_t pi_demand(struct controller_state *state,
+			 const struct controller_params *params,
+			 int32_t temperature, int32_t band_min,
+			 int32_t band_max, uint32_t now, uint32_t *wait_ms)
+{
+	uint32_t dt = MIN(now - state->last_time, params->period_ms);
+	int32_t heat = pi_duty(&state->integral[HVAC_HEATING], params,
+			       band_min - temperature, dt);
+	int32_t cool = pi_duty(&state->integral[HVAC_COOLING], params,
+			       temperature - band_max, dt);
+	uint32_t elapsed = now - state->cycle_start;
+	uint32_t on_ms;
+	int output;
+
+	state->last_time = now;
+
+	if (elapsed >= params->period_ms) {
+		state->cycle_start = now;
+		elapsed = 0;
+	}
+
+	// the direction not needed forgets what it built up
+	if (heat >= cool) {
+		state->integral[HVAC_COOLING] = 0;
+		output = HVAC_HEATING;
+		on_ms = (uint64_t)heat * params->period_ms / 1000;
+	} else {
+		state->integral[HVAC_HEATING] = 0;
+		output = HVAC_COOLING;
+		on_ms = (uint64_t)cool * params->period_ms / 1000;
+	}
+
+	// evaluated again where the output changes within the period
+	if (elapsed < on_ms) {
+		wait_at_most(wait_ms, on_ms - elapsed);
+		return BIT(output);
+	}
+
+	wait_at_most(wait_ms, params->period_ms - elapsed);
+
+	return 0;
+}
+
+/* Whether an output may change its state now, otherwise how long it has to
+ * wait. Outputs that never switched since boot are free.
+ */
+static bool switch_allowed(const struct controller_state *state, int output,
+			   uint32_t hold_ms, uint32_t now, uint32_t *wait_ms)
+{
+	uint32_t elapsed = now - state->changed_at[output];
+
+	if (!(state->switched & BIT(output)) || elapsed >= hold_ms) {
+		return true;
+	}
+
+	wait_at_most(wait_ms, hold_ms - elapsed);
+
+	return false;
+}
+
+static void output_switch(struct controller_state *state, int output, bool on,
+			  uint32_t now)
+{
+	WRITE_BIT(state->outputs, output, on);
+	state->changed_at[output] = now;
+	state->switched |= BIT(output);
+}
+
+/* Compressor protection between demand and outputs: minimum on and off
+ * times per output and the dwell time between heating and cooling. A stale
+ * temperature switches off without waiting for the minimum on time.
+ */
+static void controller_protect(struct controller_state *state,
+			       const struct controller_params *params,
+			       bool force_off, uint32_t now, uint32_t *wait_ms)
+{
+	for (int i = HVAC_HEATING; i <= HVAC_COOLING; i++) {
+		if (!(state->outputs & BIT(i)) || (state->demand & BIT(i))) {
+			continue;
+		}
+
+		if (force_off ||
+		    switch_allowed(state, i, params->min_on_ms, now, wait_ms)) {
+			output_switch(state, i, false, now);
+		}
+	}
+
+	for (int i = HVAC_HEATING; i <= HVAC_COOLING; i++) {
+		int other = HVAC_COOLING - i;
+
+		if ((state->outputs & BIT(i)) || !(state->demand & BIT(i))) {
+			continue;
+		}
+
+		// the opposite output has to be off for the dwell time
+		if ((state->outputs & BIT(other)) ||
+		    !switch_allowed(state, other, params->dwell_ms, now, wait_ms) ||
+		    !switch_allowed(state, i, params->min_off_ms, now, wait_ms)) {
+			continue;
+		}
+
+		output_switch(state, i, true, now);
+	}
+}
+
+/* Heating and cooling outputs of a zone for the current temperature.
+ * wait_ms is lowered to the time after which the zone has to be evaluated
+ * again without a new input, e.g. once a minimum on time ran out.
+ */
+uint8_t controller_run(struct controller_state *state,
+		       const struct controller_params *params,
+		       int32_t temperature, int32_t band_min, int32_t band_max,
+		       bool stale, uint32_t now, uint32_t *wait_ms)
+{
+	if (state->type != params->type) {
+		LOG_INF("Switching to %s control", controller_names[params->type]);
+		memset(state->integral, 0, sizeof(state->integral));
+		state->cycle_start = now;
+		state->last_time = now;
+		state->type = params->type;
+	}
+
+	// nothing is heated or cooled on an outdated temperature
+	if (stale) {
+		memset(state->integral, 0, sizeof(state->integral));
+		state->last_time = now;
+		state->demand = 0;
+	} else {
+		state->demand = controllers[params->type](state, params,
+							  temperature, band_min,
+							  band_max, now, wait_ms);
+	}
+
+	controller_protect(state, params, stale, now, wait_ms);
+
+	return state->outputs & OUTPUT_MASK;
+}
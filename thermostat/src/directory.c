@@ -0,0 +1,448 @@
+/* directory.c - Sensor units and resources found by resource discovery */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(directory, LOG_LEVEL_INF);
+
+#include <zephyr/zephyr.h>
+#include <zephyr/net/net_ip.h>
+#include <errno.h>
+#include <string.h>
+
+#include "common.h"
+
+//--------------------------------------------------------
+// Directory parameters
+//--------------------------------------------------------
+
+/* Longest path stored, e.g. "sensors/temperature/1" */
+#define DIRECTORY_PATH_LEN 32
+
+/* Longest link parsed, longer ones are skipped */
+#define DIRECTORY_LINK_LEN 96
+
+//--------------------------------------------------------
+// Runtime Variables
+//--------------------------------------------------------
+
+/* A link-format body arrives in blocks, links split between two blocks are
+ * carried over in link. The answer being parsed is kept in the new_ fields
+ * and replaces the links once its last block has arrived.
+ */
+struct directory_server {
+	struct sockaddr_in6 addr;
+	char paths[RESOURCE_TYPE_COUNT][DIRECTORY_PATH_LEN];
+	char new_paths[RESOURCE_TYPE_COUNT][DIRECTORY_PATH_LEN];
+	uint32_t found;		/* bit per resource type */
+	uint32_t new_found;
+	uint32_t expires;	/* uptime in ms, from the Max-Age of the links */
+	uint32_t next_block;
+	uint8_t zone;		/* HVAC zone the sensor unit is placed in */
+	uint8_t new_zone;
+	uint8_t etag[DIRECTORY_ETAG_LEN];
+	uint8_t etag_len;
+	uint8_t new_etag[DIRECTORY_ETAG_LEN];
+	uint8_t new_etag_len;
+	char link[DIRECTORY_LINK_LEN];
+	uint8_t link_len;
+	bool quoted;
+	bool overflow;
+	bool used;
+};
+
+#define RESOURCE_TYPE_NAME(ID, rt, mode) [RESOURCE_##ID] = rt,
+
+static const char * const resource_type_names[RESOURCE_TYPE_COUNT] = {
+	RESOURCE_TYPES(RESOURCE_TYPE_NAME)
+};
+
+/* Only touched by the CoAP client thread, it survives reconnects so a known
+ * sensor unit is used again without discovery. Held entries are observed,
+ * they are neither replaced nor expired.
+ */
+static struct directory_server servers[DIRECTORY_MAX_SERVERS];
+static uint32_t held;
+
+//--------------------------------------------------------
+// Link format parsing
+//--------------------------------------------------------
+
+/* Attribute values are a token or a quoted string, rt may hold several
+ * types separated by spaces (RFC 6690 3.1)
+ */
+static void link_parse_types(struct directory_server *server,
+			     const char *path, size_t path_len,
+			     const char *value, size_t len)
+{
+	const char *end = value + len;
+
+	while (value < end) {
+		const char *type = value;
+
+		while (value < end && *value != ' ') {
+			value++;
+		}
+
+		for (int i = 0; i < RESOURCE_TYPE_COUNT; i++) {
+			if ((server->new_found & BIT(i)) ||
+			    strlen(resource_type_names[i]) != (size_t)(value - type) ||
+			    memcmp(resource_type_names[i], type, value - type) != 0) {
+				continue;
+			}
+
+			if (path_len >= DIRECTORY_PATH_LEN) {
+				LOG_WRN("Path of %s too long", resource_type_names[i]);
+				continue;
+			}
+
+			memcpy(server->new_paths[i], path, path_len);
+			server->new_paths[i][path_len] = '\0';
+			server->new_found |= BIT(i);
+		}
+
+		while (value < end && *value == ' ') {
+			value++;
+		}
+	}
+}
+
+/* zone is a number, sensor units without it belong to zone 0 */
+static void link_parse_zone(struct directory_server *server, const char *value,
+			    size_t len)
+{
+	uint32_t zone = 0;
+
+	if (len == 0 || len > 2) {
+		return;
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		if (value[i] < '0' || value[i] > '9') {
+			return;
+		}
+		zone = zone * 10 + (value[i] - '0');
+	}
+
+	server->new_zone = zone;
+}
+
+/* One link, "<path>;attr=value;attr="value";attr" */
+static void link_parse(struct directory_server *server, const char *link,
+		       size_t len)
+{
+	const char *end = link + len;
+	const char *path;
+	const char *path_end;
+
+	while (link < end && (*link == ' ' || *link == '\n' || *link == '\r')) {
+		link++;
+	}
+
+	if (link == end || *link != '<') {
+		return;
+	}
+
+	path = ++link;
+	while (link < end && *link != '>') {
+		link++;
+	}
+
+	if (link == end) {
+		return;
+	}
+
+	path_end = link++;
+
+	/* Links to other hosts are not observed */
+	if (path == path_end || *path != '/') {
+		return;
+	}
+	path++;
+
+	while (link < end && *link == ';') {
+		const char *name = ++link;
+		const char *value;
+		size_t name_len;
+		size_t value_len = 0;
+
+		while (link < end && *link != '=' && *link != ';') {
+			link++;
+		}
+		name_len = link - name;
+
+		if (link == end || *link == ';') {
+			continue;
+		}
+
+		value = ++link;
+		if (link < end && *link == '"') {
+			value = ++link;
+			while (link < end && *link != '"') {
+				link++;
+			}
+			value_len = link - value;
+			if (link < end) {
+				link++;
+			}
+		} else {
+			while (link < end && *link != ';') {
+				link++;
+			}
+			value_len = link - value;
+		}
+
+		if (name_len == 2 && memcmp(name, "rt", 2) == 0) {
+			link_parse_types(server, path, path_end - path,
+					 value, value_len);
+		} else if (name_len == 4 && memcmp(name, "zone", 4) == 0) {
+			link_parse_zone(server, value, value_len);
+		}
+	}
+}
+
+/* Links are separated by commas outside of quoted strings */
+static void link_feed(struct directory_server *server, const uint8_t *data,
+		      size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		char c = data[i];
+
+		if (c == ',' && !server->quoted) {
+			if (!server->overflow) {
+				link_parse(server, server->link, server->link_len);
+			}
+			server->link_len = 0;
+			server->overflow = false;
+			continue;
+		}
+
+		if (c == '"') {
+			server->quoted = !server->quoted;
+		}
+
+		if (server->link_len < sizeof(server->link)) {
+			server->link[server->link_len++] = c;
+		} else {
+			server->overflow = true;
+		}
+	}
+}
+
+//--------------------------------------------------------
+// Function Implementations
+//--------------------------------------------------------
+
+static struct directory_server *directory_find(const struct sockaddr_in6 *addr)
+{
+	struct directory_server *oldest = NULL;
+
+	for (int i = 0; i < DIRECTORY_MAX_SERVERS; i++) {
+		if (servers[i].used &&
+		    net_ipv6_addr_cmp(&servers[i].addr.sin6_addr, &addr->sin6_addr) &&
+		    servers[i].addr.sin6_port == addr->sin6_port) {
+			return &servers[i];
+		}
+	}
+
+	for (int i = 0; i < DIRECTORY_MAX_SERVERS; i++) {
+		if (!servers[i].used) {
+			oldest = &servers[i];
+			break;
+		}
+
+		if (held & BIT(i)) {
+			continue;
+		}
+
+		if (!oldest || (int32_t)(servers[i].expires - oldest->expires) < 0) {
+			oldest = &servers[i];
+		}
+	}
+
+	if (oldest) {
+		memset(oldest, 0, sizeof(*oldest));
+		oldest->addr = *addr;
+		oldest->used = true;
+	}
+
+	return oldest;
+}
+
+const char *resource_type_name(enum resource_type type)
+{
+	return resource_type_names[type];
+}
+
+/* Drops the sensor units whose links were not refreshed within their
+ * Max-Age, the observed ones prove to be alive by their notifications
+ */
+void directory_expire(void)
+{
+	uint32_t now = k_uptime_get_32();
+
+	for (int i = 0; i < DIRECTORY_MAX_SERVERS; i++) {
+		if (servers[i].used && !(held & BIT(i)) &&
+		    (int32_t)(servers[i].expires - now) <= 0) {
+			LOG_INF("Links of sensor unit %d expired", i);
+			directory_remove(i);
+		}
+	}
+}
+
+/* Adds one block of a link-format response, blocks have to arrive in order.
+ * Returns the index of the server or -EALREADY if the block was not expected,
+ * e.g. the answer to a retransmitted discovery request. Paths, zone and ETag
+ * only change once the whole answer is parsed, notifications arriving
+ * meanwhile still count for the old ones. changed is set with the last block
+ * if the paths differ from the ones before.
+ */
+int directory_links(const struct sockaddr_in6 *addr, uint32_t block,
+		    const uint8_t *data, size_t len, bool more, uint32_t max_age,
+		    const uint8_t *etag, uint8_t etag_len, bool *changed)
+{
+	struct directory_server *server;
+	int index;
+
+	server = directory_find(addr);
+	if (!server) {
+		return -ENOMEM;
+	}
+	index = server - servers;
+	*changed = false;
+
+	/* Links are learned again from the first block on */
+	if (block == 0) {
+		server->next_block = 0;
+		server->link_len = 0;
+		server->quoted = false;
+		server->overflow = false;
+		server->new_found = 0;
+		server->new_zone = 0;
+		memset(server->new_paths, 0, sizeof(server->new_paths));
+	}
+
+	if (block != server->next_block) {
+		return -EALREADY;
+	}
+
+	link_feed(server, data, len);
+	server->expires = k_uptime_get_32() + max_age * MSEC_PER_SEC;
+	server->new_etag_len = MIN(etag_len, sizeof(server->new_etag));
+	memcpy(server->new_etag, etag, server->new_etag_len);
+
+	if (more) {
+		server->next_block = block + 1;
+		return index;
+	}
+
+	if (!server->overflow) {
+		link_parse(server, server->link, server->link_len);
+	}
+	server->next_block = 0;
+	server->link_len = 0;
+
+	*changed = server->found != server->new_found ||
+		   memcmp(server->paths, server->new_paths, sizeof(server->paths)) != 0;
+	server->found = server->new_found;
+	memcpy(server->paths, server->new_paths, sizeof(server->paths));
+	server->etag_len = server->new_etag_len;
+	memcpy(server->etag, server->new_etag, server->etag_len);
+
+	if (server->zone != server->new_zone) {
+		LOG_INF("Sensor unit %d is in zone %u", index, server->new_zone);
+		server->zone = server->new_zone;
+	}
+
+	LOG_INF("Sensor unit %d offers %u of %u resources", index,
+		POPCOUNT(server->found), RESOURCE_TYPE_COUNT);
+
+	return index;
+}
+
+/* A 2.03 to a request with the ETag of the links, they are still valid */
+int directory_valid(const struct sockaddr_in6 *addr, uint32_t max_age)
+{
+	for (int i = 0; i < DIRECTORY_MAX_SERVERS; i++) {
+		if (servers[i].used &&
+		    net_ipv6_addr_cmp(&servers[i].addr.sin6_addr, &addr->sin6_addr) &&
+		    servers[i].addr.sin6_port == addr->sin6_port) {
+			servers[i].expires = k_uptime_get_32() + max_age * MSEC_PER_SEC;
+			return i;
+		}
+	}
+
+	return -ENOENT;
+}
+
+/* ETag of the last link-format answer, 0 if it had none */
+uint8_t directory_etag(int server, uint8_t *etag)
+{
+	memcpy(etag, servers[server].etag, servers[server].etag_len);
+
+	return servers[server].etag_len;
+}
+
+/* A sensor unit that offers all resource types and finished its answer */
+bool directory_complete(int server)
+{
+	return servers[server].used && servers[server].next_block == 0 &&
+	       servers[server].found == BIT_MASK(RESOURCE_TYPE_COUNT);
+}
+
+/* An observed sensor unit if there is one, otherwise any complete one */
+int directory_select(void)
+{
+	int found = -1;
+
+	for (int i = 0; i < DIRECTORY_MAX_SERVERS; i++) {
+		if (!directory_complete(i)) {
+			continue;
+		}
+
+		if (held & BIT(i)) {
+			return i;
+		}
+
+		if (found < 0) {
+			found = i;
+		}
+	}
+
+	return found;
+}
+
+void directory_hold(int server, bool hold)
+{
+	if (hold) {
+		held |= BIT(server);
+	} else {
+		held &= ~BIT(server);
+	}
+}
+
+void directory_remove(int server)
+{
+	memset(&servers[server], 0, sizeof(servers[server]));
+	held &= ~BIT(server);
+}
+
+const struct sockaddr_in6 *directory_addr(int server)
+{
+	return &servers[server].addr;
+}
+
+int directory_zone(int server)
+{
+	return servers[server].zone;
+}
+
+/* Path without the leading slash, segments separated by '/' */
+const char *directory_path(int server, enum resource_type type)
+{
+	return servers[server].paths[type];
+}
@@ -10,7 +10,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <zephyr/zephyr.h>
-#include <zephyr/drivers/sensor.h>
+#include <stdlib.h>
 
 #include "common.h"
 
@@ -27,7 +27,10 @@ K_THREAD_DEFINE(display_thread_id, STACK_SIZE,
 		IS_ENABLED(CONFIG_USERSPACE) ? K_USER : 0, -1);
 
 static int aiq;
-static double temperature, humidty;
+// thousandths of a degree and of a percent
+static int32_t temperature, humidty;
+// stale values are shown as "--"
+static atomic_t stale_values;
 
 void init_display(void)
 {	
@@ -67,22 +70,42 @@ void init_display(void)
 	
 }
 
+// Thousandths shown with one decimal, e.g. 23456 as "23.4", without printf
+// float support
+static int format_tenths(char *buf, size_t len, int32_t value)
+{
+    return snprintf(buf, len, "%s%d.%d\n", value < 0 ? "-" : "",
+                    abs(value) / 1000, abs(value) % 1000 / 100);
+}
 
 void display_thread(void)
 {
     char data_str[50] = {0};
+    atomic_val_t stale;
+    int len;
 
-    struct sensor_value temp, hum;
 	// Create label on the right side for the sensor data
 	lv_obj_t *data_label = lv_label_create(lv_scr_act());
 	lv_obj_align(data_label, LV_ALIGN_TOP_RIGHT, 0, 0);
     
     while (1) {
-        // convert data to sensor value as a sprintf with a float or a double cuases a buffer overflwo
-        sensor_value_from_double(&temp, temperature);
-        sensor_value_from_double(&hum, humidty);
-        
-        snprintf(data_str, 50, "\n%d.%01d\n%d.%01d\n%d", temp.val1, temp.val2/10000 , hum.val1, hum.val2/10000, aiq);
+        stale = atomic_get(&stale_values);
+        len = snprintf(data_str, 50, "\n");
+        if (stale & BIT(RESOURCE_TEMPERATURE)) {
+            len += snprintf(&data_str[len], 50 - len, "--\n");
+        } else {
+            len += format_tenths(&data_str[len], 50 - len, temperature);
+        }
+        if (stale & BIT(RESOURCE_HUMIDITY)) {
+            len += snprintf(&data_str[len], 50 - len, "--\n");
+        } else {
+            len += format_tenths(&data_str[len], 50 - len, humidty);
+        }
+        if (stale & BIT(RESOURCE_AIR_QUALITY)) {
+            snprintf(&data_str[len], 50 - len, "--");
+        } else {
+            snprintf(&data_str[len], 50 - len, "%d", aiq);
+        }
         LOG_DBG("%s", data_str);
         lv_label_set_text(data_label, data_str);
 		
@@ -91,13 +114,13 @@ void display_thread(void)
 	}
 }
 
-void display_update_temperatur(double temp)
+void display_update_temperatur(int32_t temp)
 {
     temperature = temp;
     k_wakeup(display_thread_id);
 }
 
-void display_update_humidity(double hum)
+void display_update_humidity(int32_t hum)
 {
     humidty = hum;
     k_wakeup(display_thread_id);
@@ -107,4 +130,14 @@ void display_update_air_quality(int air_qual)
 {
     aiq = air_qual;
     k_wakeup(display_thread_id);
-}
\ No newline at end of file
+}
+
+void display_set_stale(enum resource_type type, bool stale)
+{
+    if (stale) {
+        atomic_set_bit(&stale_values, type);
+    } else {
+        atomic_clear_bit(&stale_values, type);
+    }
+    k_wakeup(display_thread_id);
+}
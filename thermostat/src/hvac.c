@@ -8,12 +8,12 @@
 #include <zephyr/zephyr.h>
 #include <zephyr/device.h>
 #include <zephyr/drivers/gpio.h>
-#include <zephyr/drivers/sensor.h>
 #include <zephyr/drivers/adc.h>
 
 #include <zephyr/sys/util.h>
 #include <zephyr/sys/printk.h>
 #include <inttypes.h>
+#include <errno.h>
 
 #include <stdio.h>
 #include "common.h"
@@ -21,29 +21,87 @@
 #include <logging/log.h>
 LOG_MODULE_REGISTER(hvac, LOG_LEVEL_DBG);
 
+#define DT_DRV_COMPAT thermostat_hvac_zone
+
 //--------------------------------------------------------
-// Alias definitions 
+// Control loop parameters 
 //--------------------------------------------------------
 
+/* Shortest time between two evaluations, notifications arriving within it
+ * are handled together
+ */
+#ifndef HVAC_MIN_INTERVAL_MS
+	#define HVAC_MIN_INTERVAL_MS 200
+#endif
+
+/* Reasons to evaluate the zones, posted to hvac_events */
+#define HVAC_EVENT_INPUT	BIT(0)	/* a value or its staleness changed */
+#define HVAC_EVENT_LIMITS	BIT(1)	/* a limit was changed through /config */
+
+//--------------------------------------------------------
+// Zone definitions 
+//--------------------------------------------------------
+
+static const char * const output_names[HVAC_OUTPUT_COUNT] = {
+	[HVAC_HEATING] = "Heating",
+	[HVAC_COOLING] = "Cooling",
+	[HVAC_VENTING] = "Venting",
+};
+
+struct hvac_zone {
+	const char *name;
+	struct gpio_dt_spec outputs[HVAC_OUTPUT_COUNT];
+	int32_t setpoint_offset;	/* thousandths of a degree */
+	uint8_t sensor_zone;		/* zone attribute of the sensor unit links */
+};
+
+#if DT_HAS_COMPAT_STATUS_OKAY(DT_DRV_COMPAT)
+
+#define HVAC_ZONE_DEFINE(inst) \
+	{ \
+		.name = DT_INST_PROP_OR(inst, label, "Zone " #inst), \
+		.outputs = { \
+			[HVAC_HEATING] = GPIO_DT_SPEC_INST_GET(inst, heating_gpios), \
+			[HVAC_COOLING] = GPIO_DT_SPEC_INST_GET(inst, cooling_gpios), \
+			[HVAC_VENTING] = GPIO_DT_SPEC_INST_GET(inst, venting_gpios), \
+		}, \
+		.setpoint_offset = (int32_t)DT_INST_PROP(inst, setpoint_offset), \
+		.sensor_zone = DT_INST_PROP(inst, sensor_zone), \
+	},
+
+static const struct hvac_zone zones[HVAC_ZONE_COUNT] = {
+	DT_INST_FOREACH_STATUS_OKAY(HVAC_ZONE_DEFINE)
+};
+
+#else
+
 #define HEATING_NODE	DT_ALIAS(led0)
 #if !DT_NODE_HAS_STATUS(HEATING_NODE, okay)
 #error "Unsupported board: led0 devicetree alias is not defined"
 #endif
-static const struct gpio_dt_spec heating_out = GPIO_DT_SPEC_GET_OR(HEATING_NODE, gpios, {0});
 
 #define COOLING_NODE	DT_ALIAS(led1)
 #if !DT_NODE_HAS_STATUS(COOLING_NODE, okay)
-#error "Unsupported board: led0 devicetree alias is not defined"
+#error "Unsupported board: led1 devicetree alias is not defined"
 #endif
-static const struct gpio_dt_spec cooling_out = GPIO_DT_SPEC_GET_OR(COOLING_NODE, gpios, {0});
 
 #define VENTING_NODE	DT_ALIAS(led2)
 #if !DT_NODE_HAS_STATUS(VENTING_NODE, okay)
-#error "Unsupported board: led0 devicetree alias is not defined"
+#error "Unsupported board: led2 devicetree alias is not defined"
 #endif
-static const struct gpio_dt_spec venting_out = GPIO_DT_SPEC_GET_OR(VENTING_NODE, gpios, {0});
 
+static const struct hvac_zone zones[HVAC_ZONE_COUNT] = {
+	{
+		.name = "Zone 0",
+		.outputs = {
+			[HVAC_HEATING] = GPIO_DT_SPEC_GET_OR(HEATING_NODE, gpios, {0}),
+			[HVAC_COOLING] = GPIO_DT_SPEC_GET_OR(COOLING_NODE, gpios, {0}),
+			[HVAC_VENTING] = GPIO_DT_SPEC_GET_OR(VENTING_NODE, gpios, {0}),
+		},
+	},
+};
 
+#endif
 
 //--------------------------------------------------------
 // Static helper functions 
@@ -56,17 +114,41 @@ void hvac_thread(void);
 // Runtime Variables 
 //--------------------------------------------------------
 
-static double temperature_min;
-static double temperature_max;
-static double temperature_min_presence;
-static double temperature_max_presence;
-static double humidity_max;
-static int air_quality_max;
-
-static int presence;
-static double temperature;
-static double humidity;
-static int air_quality;
+// Limits of /config shared by all zones, comfort bands indexed by occupancy.
+// Temperatures and humidities are kept in thousandths, the control path does
+// not touch the FPU.
+struct hvac_limits {
+	int32_t temperature_min[2];
+	int32_t temperature_max[2];
+	int32_t humidity_max;
+	int air_quality_max;
+	struct controller_params control;
+};
+
+struct zone_state {
+	int presence;
+	int32_t temperature;
+	int32_t humidity;
+	int air_quality;
+	// bit per resource type whose value no sensor unit of the zone confirms
+	atomic_t stale_inputs;
+	// bit per hvac_output that is switched on
+	uint8_t outputs;
+	struct controller_state control;
+	// zones nobody reported a temperature for yet are left alone
+	bool has_temperature;
+};
+
+static struct zone_state states[HVAC_ZONE_COUNT];
+
+// The thread sleeps until an input or a limit changes
+static K_EVENT_DEFINE(hvac_events);
+
+// Cycle count of the oldest change not evaluated yet, 0 if there is none
+static atomic_t first_change;
+
+static struct hvac_stats stats;
+static struct k_spinlock stats_lock;
 
 
 // Thread definitions to update the outputs an mimic a HVAC
@@ -75,9 +157,7 @@ K_THREAD_DEFINE(hvac_thread_id, STACK_SIZE,
 		THREAD_PRIORITY,
 		IS_ENABLED(CONFIG_USERSPACE) ? K_USER : 0, -1);
 
-int hvac_init(double temp_min, double temp_max, 
-				double temp_min_presence, double temp_max_presence, 
-				double hum_max, int air_qual_max)
+int hvac_init(void)
 {
 	int ret = outputs_init();
 	if(ret < 0)
@@ -85,13 +165,6 @@ int hvac_init(double temp_min, double temp_max,
 		return ret;
 	}
 
-	temperature_min = temp_min;
-	temperature_max = temp_max;
-	temperature_min_presence = temp_min_presence;
-	temperature_max_presence = temp_max_presence;
-	humidity_max = hum_max;
-	air_quality_max = air_qual_max;
-
 #if defined(CONFIG_USERSPACE)
 		k_mem_domain_add_thread(&app_domain, hvac_thread_id);	
 		LOG_DBG("starting Thread");
@@ -103,202 +176,284 @@ int hvac_init(double temp_min, double temp_max,
 	return 0;
 }
 
+// All limits are taken from the same configuration, so a write changing
+// both ends of a band never shows up half applied
+static void load_limits(struct hvac_limits *limits)
+{
+	int32_t values[CFG_PARAM_COUNT];
+
+	config_snapshot(values);
+
+	limits->temperature_min[0] = values[CFG_TEMP_MIN];
+	limits->temperature_max[0] = values[CFG_TEMP_MAX];
+	limits->temperature_min[1] = values[CFG_TEMP_MIN_PRESENCE];
+	limits->temperature_max[1] = values[CFG_TEMP_MAX_PRESENCE];
+	limits->humidity_max = values[CFG_HUMIDITY_MAX];
+	limits->air_quality_max = values[CFG_AIQ_MAX];
+
+	limits->control.type = values[CFG_CONTROLLER];
+	limits->control.hysteresis = values[CFG_HYSTERESIS];
+	limits->control.min_on_ms = values[CFG_MIN_ON_TIME] * MSEC_PER_SEC;
+	limits->control.min_off_ms = values[CFG_MIN_OFF_TIME] * MSEC_PER_SEC;
+	limits->control.dwell_ms = values[CFG_DWELL_TIME] * MSEC_PER_SEC;
+	limits->control.kp = values[CFG_PI_KP];
+	limits->control.ti_ms = values[CFG_PI_TI] * MSEC_PER_SEC;
+	limits->control.period_ms = values[CFG_PI_PERIOD] * MSEC_PER_SEC;
+}
+
+// Outputs a zone should have switched on, the same rules for every zone.
+// Heating and cooling are left to the configured controller, wait_ms is
+// lowered to when it wants to be asked again.
+static uint8_t zone_control(const struct hvac_zone *zone,
+			    struct zone_state *state,
+			    const struct hvac_limits *limits,
+			    uint32_t now, uint32_t *wait_ms)
+{
+	atomic_val_t stale = atomic_get(&state->stale_inputs);
+	// without occupancy the comfort band is kept
+	int occupied = state->presence || (stale & BIT(RESOURCE_OCCUPANCY));
+	int32_t offset = zone->setpoint_offset;
+	uint32_t start = k_cycle_get_32();
+	uint8_t outputs;
+
+	outputs = controller_run(&state->control, &limits->control,
+				 state->temperature,
+				 limits->temperature_min[occupied] + offset,
+				 limits->temperature_max[occupied] + offset,
+				 stale & BIT(RESOURCE_TEMPERATURE), now, wait_ms);
+
+	uint32_t cycles = k_cycle_get_32() - start;
+	k_spinlock_key_t key = k_spin_lock(&stats_lock);
+	stats.max_control_cycles = MAX(stats.max_control_cycles, cycles);
+	k_spin_unlock(&stats_lock, key);
+
+	if((state->air_quality > limits->air_quality_max && !(stale & BIT(RESOURCE_AIR_QUALITY))) ||
+	   (state->humidity > limits->humidity_max && !(stale & BIT(RESOURCE_HUMIDITY))))
+	{
+		outputs |= BIT(HVAC_VENTING);
+	}
+
+	LOG_DBG("%s: temperature %d, humidity %d, air_quality %d, presence %d, stale 0x%lx",
+		zone->name, state->temperature, state->humidity, state->air_quality,
+		state->presence, (long)stale);
+
+	return outputs;
+}
+
+// Switches the outputs of a zone that changed
+static void zone_apply(int index, uint8_t outputs)
+{
+	const struct hvac_zone *zone = &zones[index];
+	struct zone_state *state = &states[index];
+	uint8_t changed = outputs ^ state->outputs;
+
+	if((changed & (BIT(HVAC_HEATING) | BIT(HVAC_COOLING))) &&
+	   !(outputs & (BIT(HVAC_HEATING) | BIT(HVAC_COOLING))) &&
+	   atomic_test_bit(&state->stale_inputs, RESOURCE_TEMPERATURE))
+	{
+		LOG_WRN("%s: Temperature stale, disabling heating and cooling", zone->name);
+	}
+
+	for(int i = 0; i < HVAC_OUTPUT_COUNT; i++)
+	{
+		if(!(changed & BIT(i)))
+		{
+			continue;
+		}
+
+		gpio_pin_set_dt(&zone->outputs[i], (outputs & BIT(i)) ? 1 : 0);
+		LOG_INF("%s: %s %s", zone->name,
+			(outputs & BIT(i)) ? "Enabling" : "Disabling", output_names[i]);
+	}
+
+	state->outputs = outputs;
+}
+
+// Wakes the thread, changes posted while it evaluates or within the minimum
+// interval are taken into the next evaluation
+static void hvac_post(uint32_t events)
+{
+	atomic_cas(&first_change, 0, k_cycle_get_32() | 1);
+	k_event_post(&hvac_events, events);
+
+	k_spinlock_key_t key = k_spin_lock(&stats_lock);
+	stats.changes++;
+	k_spin_unlock(&stats_lock, key);
+}
+
+// Time from the oldest change of an evaluation to its outputs being set
+static void hvac_account(uint32_t since)
+{
+	uint32_t latency = k_cycle_get_32() - since;
+
+	k_spinlock_key_t key = k_spin_lock(&stats_lock);
+	stats.evaluations++;
+	stats.latency_cycles += latency;
+	stats.max_latency_cycles = MAX(stats.max_latency_cycles, latency);
+	k_spin_unlock(&stats_lock, key);
+
+	LOG_DBG("Actuation %u us after the change", k_cyc_to_us_floor32(latency));
+}
+
 void hvac_thread(void)
 {
-	int heating_state = 0;
-	int cooling_state = 0;
-	int venting_state = 0;
+	struct hvac_limits limits;
+	uint32_t last = k_uptime_get_32() - HVAC_MIN_INTERVAL_MS;
+	// time the controllers asked to be run again after without new input
+	uint32_t wait_ms = UINT32_MAX;
 
 	while(true)
 	{
-		if(presence == 0)
+		k_event_wait(&hvac_events, HVAC_EVENT_INPUT | HVAC_EVENT_LIMITS,
+			     false, wait_ms == UINT32_MAX ? K_FOREVER : K_MSEC(wait_ms));
+
+		int32_t wait = HVAC_MIN_INTERVAL_MS - (int32_t)(k_uptime_get_32() - last);
+		if(wait > 0)
 		{
-			if(temperature > temperature_max)
-			{
-				gpio_pin_set(heating_out.port, heating_out.pin, 0);
-				gpio_pin_set(cooling_out.port, cooling_out.pin, 1);
-				if(cooling_state == 0)
-				{
-					LOG_INF("Enabling Cooling");
-				}
-				heating_state = 0;
-				cooling_state = 1;
-			}
-			else if (temperature < temperature_min)
-			{
-				gpio_pin_set(heating_out.port, heating_out.pin, 1);
-				gpio_pin_set(cooling_out.port, cooling_out.pin, 0);
-				if(heating_state == 0)
-				{
-					LOG_INF("Enabling Heating");
-				}
-				heating_state = 1;
-				cooling_state = 0;
-			} 
-			else
-			{
-				gpio_pin_set(heating_out.port, heating_out.pin, 0);
-				gpio_pin_set(cooling_out.port, cooling_out.pin, 0);
-				if(cooling_state == 1)
-				{
-					LOG_INF("Disabling Cooling");
-				}
-				else if(heating_state == 1)
-				{
-					LOG_INF("Disabling Heating");
-				}
-
-				heating_state = 0;
-				cooling_state = 0;
-			}
+			k_sleep(K_MSEC(wait));
 		}
-		else
+
+		// changes from now on wake the next evaluation
+		k_event_set(&hvac_events, 0);
+		uint32_t since = atomic_set(&first_change, 0);
+		last = k_uptime_get_32();
+
+		// limits changed through /config take effect right away
+		load_limits(&limits);
+
+		bool actuated = false;
+		uint32_t now = k_uptime_get_32();
+
+		wait_ms = UINT32_MAX;
+
+		for(int i = 0; i < HVAC_ZONE_COUNT; i++)
 		{
-			if(temperature > temperature_max_presence)
+			// The temperature reads 0 until the first notification,
+			// which would turn on the heating right after boot
+			if(!states[i].has_temperature)
 			{
-				gpio_pin_set(heating_out.port, heating_out.pin, 0);
-				gpio_pin_set(cooling_out.port, cooling_out.pin, 1);
-				if(cooling_state == 0)
-				{
-					LOG_INF("Enabling Cooling");
-				}
-
-				heating_state = 0;
-				cooling_state = 1;
-			}
-			else if (temperature < temperature_min_presence)
-			{
-				gpio_pin_set(heating_out.port, heating_out.pin, 1);
-				gpio_pin_set(cooling_out.port, cooling_out.pin, 0);
-				if(heating_state == 0)
-				{
-					LOG_INF("Enabling Heating");
-				}
-				heating_state = 1;
-				cooling_state = 0;
-			} 
-			else
-			{
-				gpio_pin_set(heating_out.port, heating_out.pin, 0);
-				gpio_pin_set(cooling_out.port, cooling_out.pin, 0);
-				if(cooling_state == 1)
-				{
-					LOG_INF("Disabling Cooling");
-				}
-				else if(heating_state == 1)
-				{
-					LOG_INF("Disabling Heating");
-				}
-				heating_state = 0;
-				cooling_state = 0;
+				continue;
 			}
+
+			zone_apply(i, zone_control(&zones[i], &states[i], &limits,
+						   now, &wait_ms));
+			actuated = true;
 		}
 
-		if(air_quality > air_quality_max || humidity > humidity_max)
+		if(since != 0)
 		{
-			gpio_pin_set(venting_out.port, venting_out.pin, 1);
-			if(venting_state == 0)
-			{
-				LOG_INF("Enabling Venting");
-			}
-			venting_state =1;
+			hvac_account(since);
 		}
-		else
+
+		if(!actuated)
 		{
-			gpio_pin_set(venting_out.port, venting_out.pin, 0);
-			if(venting_state == 1)
-			{
-				LOG_INF("Disabling Venting");
-			}
-			venting_state =0;
+			continue;
 		}
-		
 
-		gpio_pin_set(heating_out.port, heating_out.pin, heating_state);
-		gpio_pin_set(cooling_out.port, cooling_out.pin, cooling_state);
-		gpio_pin_set(venting_out.port, venting_out.pin, venting_state);
+		boot_mark(BOOT_FIRST_ACTUATION);
 
-		LOG_DBG("Current State: heating_state %d cooling_state %d venting_state %d", heating_state, cooling_state, venting_state);
-		LOG_DBG("temperature_min %lf, temperature %lf, temperature_max %lf", temperature_min, temperature, temperature_max);
-		LOG_DBG("temperature_min_presence %lf, temperature %lf,  temperature_max_presence %lf", temperature_min_presence, temperature, temperature_max_presence);
-		LOG_DBG("air_quality %d, air_quality_max %d, humidity %lf, humidity_max %lf", air_quality, air_quality_max, humidity, humidity_max);
-		k_sleep(K_MSEC(5000));
+		LOG_DBG("temperature_min %d, temperature_max %d", limits.temperature_min[0], limits.temperature_max[0]);
+		LOG_DBG("temperature_min_presence %d, temperature_max_presence %d", limits.temperature_min[1], limits.temperature_max[1]);
+		LOG_DBG("air_quality_max %d, humidity_max %d", limits.air_quality_max, limits.humidity_max);
 	}
 }
 
-void hvac_update_temperatur(double temp)
+void hvac_limits_changed(void)
 {
-    temperature = temp;
-	LOG_DBG("New temperature value: %lf", temp);
+	hvac_post(HVAC_EVENT_LIMITS);
 }
 
-void hvac_update_humidity(double hum)
+void hvac_get_stats(struct hvac_stats *hvac_stats)
 {
-    humidity = hum;
-	LOG_DBG("New humidity value: %lf", hum);
+	k_spinlock_key_t key = k_spin_lock(&stats_lock);
+	*hvac_stats = stats;
+	k_spin_unlock(&stats_lock, key);
 }
 
-void hvac_update_air_quality(int air_qual)
+// HVAC zones fed by the sensor units of a zone, a bit per index
+uint32_t hvac_zones_of(int sensor_zone)
 {
-    air_quality = air_qual;
-	LOG_DBG("New air quality value: %d", air_qual);
+	uint32_t mask = 0;
+
+	for(int i = 0; i < HVAC_ZONE_COUNT; i++)
+	{
+		if(zones[i].sensor_zone == sensor_zone)
+		{
+			mask |= BIT(i);
+		}
+	}
+
+	return mask;
 }
 
-void hvac_update_pressence(int pres)
+void hvac_update_temperatur(int zone, int32_t temp)
 {
-    presence = pres;
-	LOG_DBG("New pressence value: %d", pres);
+	states[zone].temperature = temp;
+	states[zone].has_temperature = true;
+	LOG_DBG("%s: New temperature value: %d", zones[zone].name, temp);
+	hvac_post(HVAC_EVENT_INPUT);
 }
 
+void hvac_update_humidity(int zone, int32_t hum)
+{
+	states[zone].humidity = hum;
+	LOG_DBG("%s: New humidity value: %d", zones[zone].name, hum);
+	hvac_post(HVAC_EVENT_INPUT);
+}
 
-int outputs_init(void)
+void hvac_update_air_quality(int zone, int air_qual)
 {
-    
-	int ret=device_is_ready(heating_out.port);
+	states[zone].air_quality = air_qual;
+	LOG_DBG("%s: New air quality value: %d", zones[zone].name, air_qual);
+	hvac_post(HVAC_EVENT_INPUT);
+}
 
-	if (!ret) {
-		LOG_ERR("Error: heating_out device %s is not ready\n",
-		       heating_out.port->name);
-		return ret;
-	}
+void hvac_update_pressence(int zone, int pres)
+{
+	states[zone].presence = pres;
+	LOG_DBG("%s: New pressence value: %d", zones[zone].name, pres);
+	hvac_post(HVAC_EVENT_INPUT);
+}
 
-	ret = gpio_pin_configure_dt(&heating_out, GPIO_OUTPUT_INACTIVE);
-	if (ret != 0) {
-		LOG_ERR("Error %d: failed to configure %s pin %d\n",
-		       ret, heating_out.port->name, heating_out.pin);
-		return ret;
+void hvac_set_stale(int zone, enum resource_type type, bool stale)
+{
+	if(stale)
+	{
+		atomic_set_bit(&states[zone].stale_inputs, type);
 	}
-
-	ret=device_is_ready(venting_out.port);
-
-	if (!ret) {
-		LOG_ERR("Error: venting_out device %s is not ready\n",
-		       venting_out.port->name);
-		return ret;
+	else
+	{
+		atomic_clear_bit(&states[zone].stale_inputs, type);
 	}
 
-	ret = gpio_pin_configure_dt(&venting_out, GPIO_OUTPUT_INACTIVE);
-	if (ret != 0) {
-		LOG_ERR("Error %d: failed to configure %s pin %d\n",
-		       ret, venting_out.port->name, venting_out.pin);
-		return ret;
-	}
+	hvac_post(HVAC_EVENT_INPUT);
+}
 
-	ret=device_is_ready(cooling_out.port);
+int outputs_init(void)
+{
+	for(int i = 0; i < HVAC_ZONE_COUNT; i++)
+	{
+		for(int j = 0; j < HVAC_OUTPUT_COUNT; j++)
+		{
+			const struct gpio_dt_spec *out = &zones[i].outputs[j];
+			int ret;
 
-	if (!ret) {
-		LOG_ERR("Error: cooling_out device %s is not ready\n",
-		       cooling_out.port->name);
-		return ret;
-	}
+			if (!device_is_ready(out->port)) {
+				LOG_ERR("Error: %s %s device %s is not ready\n",
+					zones[i].name, output_names[j], out->port->name);
+				return -ENODEV;
+			}
 
-	ret = gpio_pin_configure_dt(&cooling_out, GPIO_OUTPUT_INACTIVE);
-	if (ret != 0) {
-		LOG_ERR("Error %d: failed to configure %s pin %d\n",
-		       ret, cooling_out.port->name, cooling_out.pin);
-		return ret;
+			ret = gpio_pin_configure_dt(out, GPIO_OUTPUT_INACTIVE);
+			if (ret != 0) {
+				LOG_ERR("Error %d: failed to configure %s pin %d\n",
+					ret, out->port->name, out->pin);
+				return ret;
+			}
+		}
 	}
 
+	LOG_INF("%d HVAC zones", HVAC_ZONE_COUNT);
+
 	return 0;
 }
-
@@ -24,6 +24,8 @@ LOG_MODULE_REGISTER(thermostat, LOG_LEVEL_INF);
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/shell/shell.h>
 
 #include <zephyr/net/socket.h>
 #include <zephyr/net/tls_credentials.h>
@@ -33,30 +35,6 @@ LOG_MODULE_REGISTER(thermostat, LOG_LEVEL_INF);
 #include <zephyr/net/net_conn_mgr.h>
 
 
-#ifndef TEMP_MIN
-	#define TEMP_MIN 24.0
-#endif
-
-#ifndef TEMP_MAX
-	#define TEMP_MAX 28.0
-#endif
-
-#ifndef TEMP_MIN_PRESENCE
-	#define TEMP_MIN_PRESENCE 25.0
-#endif
-
-#ifndef TEMP_MAX_PRESENCE
-	#define TEMP_MAX_PRESENCE 27.0
-#endif
-
-#ifndef HUMIDITY_MAX
-	#define HUMIDITY_MAX 75.0
-#endif
-
-#ifndef AIQ_MAX
-	#define AIQ_MAX 100
-#endif
-
 #if defined(CONFIG_USERSPACE)
 #include <zephyr/app_memory/app_memdomain.h>
 K_APPMEM_PARTITION_DEFINE(app_partition);
@@ -139,6 +117,8 @@ static void event_handler(struct net_mgmt_event_callback *cb,
 	if (mgmt_event == NET_EVENT_L4_CONNECTED) {
 		LOG_INF("Network connected");
 
+		boot_mark(BOOT_NETWORK);
+
 		connected = true;
 		conf.ipv6.coap.mtu = net_if_get_mtu(iface);
 		k_sem_give(&run_app);
@@ -185,26 +165,33 @@ static int start_client(void)
 {
 	int ret;
 
-	// Wait for the connection. 
-	k_sem_take(&run_app, K_FOREVER);
-
-	LOG_INF("Starting...");
-
+	// The socket is bound to the unspecified address, this does not
+	// need the network and is done while it joins
 	ret = start_coap();
 	if (ret < 0) {
 		return ret;
 	}
+	boot_mark(BOOT_COAP_BOUND);
+
+	// Wait for the connection. 
+	k_sem_take(&run_app, K_FOREVER);
 
-	ret = coap_find_server();
-	if (ret == 0) {
+	LOG_INF("Starting...");
+
+	// Sensor units that stop answering are dropped from the directory,
+	// the discovery starts over once none is left
+	do {
+		ret = coap_find_server();
+		if (ret == 0) {
+			boot_mark(BOOT_SERVER_FOUND);
 
-		ret = coap_register_observers();
+			ret = coap_register_observers();
 
-		while (connected && (ret == 0)) {
-			ret = coap_process();
+			while (connected && (ret == 0)) {
+				ret = coap_process();
+			}
 		}
-	
-	}
+	} while (connected && ret == -EHOSTUNREACH);
 
 	LOG_INF("Stopping...");
 
@@ -213,8 +200,43 @@ static int start_client(void)
 	return ret;
 }
 
+static int cmd_thermostat_hvac(const struct shell *shell,
+			  size_t argc, char *argv[])
+{
+	struct hvac_stats stats;
+	uint32_t avg_cycles;
+
+	hvac_get_stats(&stats);
+	avg_cycles = stats.evaluations ?
+		     stats.latency_cycles / stats.evaluations : 0;
+
+	shell_print(shell, "changes:     %u", stats.changes);
+	shell_print(shell, "evaluations: %u", stats.evaluations);
+	shell_print(shell, "latency:     avg %u us, max %u us",
+		    k_cyc_to_us_floor32(avg_cycles),
+		    k_cyc_to_us_floor32(stats.max_latency_cycles));
+	shell_print(shell, "controller:  %s, max %u cycles (%u us)",
+		    controller_name(config_get(CFG_CONTROLLER)),
+		    stats.max_control_cycles,
+		    k_cyc_to_us_floor32(stats.max_control_cycles));
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(thermostat_commands,
+	SHELL_CMD(hvac, NULL,
+		  "Show control loop wakeups, latency and controller run time\n",
+		  cmd_thermostat_hvac),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(thermostat, &thermostat_commands,
+		   "Thermostat application commands", NULL);
+
 void main(void)
 {
+	boot_mark(BOOT_MAIN);
+
 	init_app();
 
 	if (!IS_ENABLED(CONFIG_NET_CONNECTION_MANAGER)) {
@@ -227,7 +249,14 @@ void main(void)
 
 	join_coap_multicast_group();
 
-	hvac_init(TEMP_MIN, TEMP_MAX, TEMP_MIN_PRESENCE, TEMP_MAX_PRESENCE, HUMIDITY_MAX, AIQ_MAX);
+	if (IS_ENABLED(CONFIG_SETTINGS) && settings_subsys_init() < 0) {
+		LOG_ERR("Settings could not be initialized");
+	}
+
+	/* The HVAC thread starts with the stored limits */
+	config_init();
+	boot_mark(BOOT_CONFIG);
+	hvac_init();
 	init_display();
 
 #if defined(CONFIG_USERSPACE)
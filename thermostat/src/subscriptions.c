@@ -0,0 +1,209 @@
+/* subscriptions.c - Open requests and observations indexed by token */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(subscriptions, LOG_LEVEL_INF);
+
+#include <zephyr/zephyr.h>
+#include <zephyr/net/coap.h>
+#include <errno.h>
+#include <string.h>
+
+#include "common.h"
+
+//--------------------------------------------------------
+// Table parameters
+//--------------------------------------------------------
+
+/* Slots of the table, a power of two. Registrations of all resources on
+ * every sensor unit and the discovery share it.
+ */
+#ifndef NUM_SUBSCRIPTIONS
+	#define NUM_SUBSCRIPTIONS 64
+#endif
+
+BUILD_ASSERT((NUM_SUBSCRIPTIONS & (NUM_SUBSCRIPTIONS - 1)) == 0,
+	     "NUM_SUBSCRIPTIONS has to be a power of two");
+
+/* At most three quarters of the slots are taken so probe sequences stay
+ * short
+ */
+#define SUBSCRIPTIONS_MAX_USED (NUM_SUBSCRIPTIONS * 3 / 4)
+
+#define SUBSCRIPTION_MASK (NUM_SUBSCRIPTIONS - 1)
+
+//--------------------------------------------------------
+// Runtime Variables
+//--------------------------------------------------------
+
+enum slot_state {
+	SLOT_FREE,
+	SLOT_USED,
+	SLOT_DELETED,	/* keeps probe sequences running past removed entries */
+};
+
+struct subscription {
+	uint8_t token[COAP_TOKEN_MAX_LEN];
+	uint8_t tkl;
+	uint8_t state;
+	subscription_cb_t cb;
+	void *user_data;
+};
+
+/* Open addressing with linear probing, only touched by the CoAP client
+ * thread
+ */
+static struct subscription table[NUM_SUBSCRIPTIONS];
+static int used;
+
+//--------------------------------------------------------
+// Function Implementations
+//--------------------------------------------------------
+
+/* FNV-1a, tokens are random so a cheap hash spreads them well */
+static uint32_t token_hash(const uint8_t *token, uint8_t tkl)
+{
+	uint32_t hash = 2166136261u;
+
+	for (int i = 0; i < tkl; i++) {
+		hash = (hash ^ token[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+static bool token_equal(const struct subscription *s, const uint8_t *token,
+			uint8_t tkl)
+{
+	return s->tkl == tkl && memcmp(s->token, token, tkl) == 0;
+}
+
+/* Adds a handler for responses carrying token, an existing entry of the same
+ * token is taken over. Returns NULL if the table is full.
+ */
+struct subscription *subscription_add(const uint8_t *token, uint8_t tkl,
+				      subscription_cb_t cb, void *user_data)
+{
+	struct subscription *slot = NULL;
+	uint32_t index;
+
+	if (tkl == 0 || tkl > COAP_TOKEN_MAX_LEN) {
+		return NULL;
+	}
+
+	index = token_hash(token, tkl) & SUBSCRIPTION_MASK;
+
+	for (int n = 0; n < NUM_SUBSCRIPTIONS; n++) {
+		struct subscription *s = &table[(index + n) & SUBSCRIPTION_MASK];
+
+		if (s->state == SLOT_USED) {
+			if (token_equal(s, token, tkl)) {
+				s->cb = cb;
+				s->user_data = user_data;
+				return s;
+			}
+			continue;
+		}
+
+		// the first removed entry is reused, the token may still
+		// follow further down until a free slot
+		if (!slot) {
+			slot = s;
+		}
+
+		if (s->state == SLOT_FREE) {
+			break;
+		}
+	}
+
+	if (!slot || used >= SUBSCRIPTIONS_MAX_USED) {
+		LOG_ERR("No free subscription slot");
+		return NULL;
+	}
+
+	memcpy(slot->token, token, tkl);
+	slot->tkl = tkl;
+	slot->state = SLOT_USED;
+	slot->cb = cb;
+	slot->user_data = user_data;
+	used++;
+
+	return slot;
+}
+
+struct subscription *subscription_find(const uint8_t *token, uint8_t tkl)
+{
+	uint32_t index;
+
+	if (tkl == 0 || tkl > COAP_TOKEN_MAX_LEN) {
+		return NULL;
+	}
+
+	index = token_hash(token, tkl) & SUBSCRIPTION_MASK;
+
+	for (int n = 0; n < NUM_SUBSCRIPTIONS; n++) {
+		struct subscription *s = &table[(index + n) & SUBSCRIPTION_MASK];
+
+		if (s->state == SLOT_FREE) {
+			break;
+		}
+
+		if (s->state == SLOT_USED && token_equal(s, token, tkl)) {
+			return s;
+		}
+	}
+
+	return NULL;
+}
+
+/* Later responses with the token are no longer matched. Removed entries
+ * in front of a free slot end no probe sequence and are freed right away.
+ */
+void subscription_remove(struct subscription *s)
+{
+	uint32_t index = s - table;
+
+	if (s->state != SLOT_USED) {
+		return;
+	}
+
+	s->state = SLOT_DELETED;
+	s->cb = NULL;
+	s->user_data = NULL;
+	used--;
+
+	if (table[(index + 1) & SUBSCRIPTION_MASK].state != SLOT_FREE) {
+		return;
+	}
+
+	while (table[index].state == SLOT_DELETED) {
+		table[index].state = SLOT_FREE;
+		index = (index - 1) & SUBSCRIPTION_MASK;
+	}
+}
+
+/* Hands a response to the handler of its token, returns false if nobody
+ * subscribed to it
+ */
+bool subscription_dispatch(const struct coap_packet *response,
+			   const struct sockaddr_in6 *from)
+{
+	uint8_t token[COAP_TOKEN_MAX_LEN];
+	struct subscription *s;
+	uint8_t tkl;
+
+	tkl = coap_header_get_token(response, token);
+	s = subscription_find(token, tkl);
+	if (!s) {
+		return false;
+	}
+
+	s->cb(response, s->user_data, from);
+
+	return true;
+}
@@ -0,0 +1,45 @@
+/* timeline.c - Boot timeline trace */
+
+/*
+ * Copyright (c) 2018 Nordic Semiconductor ASA.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(timeline, LOG_LEVEL_INF);
+
+#include <zephyr/zephyr.h>
+
+#include "common.h"
+
+//--------------------------------------------------------
+// Runtime Variables
+//--------------------------------------------------------
+
+#define BOOT_MILESTONE_NAME(ID, desc) [BOOT_##ID] = desc,
+
+static const char * const milestone_names[BOOT_MILESTONE_COUNT] = {
+	BOOT_MILESTONES(BOOT_MILESTONE_NAME)
+};
+
+static ATOMIC_DEFINE(reached, BOOT_MILESTONE_COUNT);
+
+//--------------------------------------------------------
+// Function Implementations
+//--------------------------------------------------------
+
+/* Logs the first time a milestone is reached, e.g. the network connecting
+ * again later is not traced
+ */
+void boot_mark(enum boot_milestone milestone)
+{
+	uint32_t now = k_ticks_to_us_floor32(k_uptime_ticks());
+
+	if (atomic_test_and_set_bit(reached, milestone)) {
+		return;
+	}
+
+	LOG_INF("Boot: %s after %u.%03u ms", milestone_names[milestone],
+		now / USEC_PER_MSEC, now % USEC_PER_MSEC);
+}